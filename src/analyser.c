@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "analyser.h"
+#include "cfg.h"
+#include "util.h"
+
+#define CACHE_LINE_SIZE 128
+
+static const char* feature_names[NUM_ROM_FEATURES] = {
+    "schip", "xochip", "jumpi", "load-store", "shift-xy", "logic", "flags",
+    "backward-jump", "self-modify", "indirect-store"
+};
+
+// Features of one instruction at pc, given its template.
+static uint32_t opcode_features(uint16_t template, uint16_t opcode, uint16_t pc)
+{
+    const uint8_t x = (opcode >> 8) & 0xF, y = (opcode >> 4) & 0xF;
+
+    switch (template) {
+        case 0x00C0: case 0x00FB: case 0x00FC: case 0x00FD: case 0x00FE:
+        case 0x00FF: case 0xF030: case 0xF075: case 0xF085:
+            return ROM_SCHIP;
+        case 0x00D0: case 0x5002: case 0x5003: case 0xF000: case 0xF001:
+        case 0xF002: case 0xF03A:
+            return ROM_XOCHIP;
+        case 0x1000:
+            return (opcode & 0xFFF) <= pc ? ROM_BACKWARD_JUMP : 0;
+        case 0xB000:
+            return ROM_JUMPI;
+        case 0xD000:
+            // DXY0 is a 16x16 sprite only on SUPER-CHIP and later.
+            return (opcode & 0xF) == 0 ? ROM_SCHIP : 0;
+        case 0xF055:
+        case 0xF065:
+            return ROM_LOAD_STORE;
+        case 0x8001: case 0x8002: case 0x8003:
+            return ROM_LOGIC;
+        case 0x8004: case 0x8005: case 0x8007:
+            return ROM_FLAGS;
+        case 0x8006: case 0x800E:
+            return ROM_FLAGS | (x != y ? ROM_SHIFT_XY : 0);
+    }
+    return 0;
+}
+
+// Bytes written through I by opcode, or 0.
+static int store_length(uint16_t template, uint16_t opcode)
+{
+    const uint8_t x = (opcode >> 8) & 0xF, y = (opcode >> 4) & 0xF;
+
+    switch (template) {
+        case 0xF033:
+            return 3;
+        case 0xF055:
+            return x + 1;
+        case 0x5002:
+            return (x > y ? x - y : y - x) + 1;
+    }
+    return 0;
+}
+
+// Walk each block keeping track of I while it holds a constant, so stores
+// into the code can be told apart from stores into data.
+static uint32_t scan_blocks(const cfg_t *cfg, const uint8_t *rom)
+{
+    uint32_t features = 0;
+
+    for (size_t b = 0; b < cfg->numblocks; b++) {
+        const cfg_block_t *block = &cfg->blocks[b];
+        int known = 0;
+        uint32_t i = 0;
+
+        for (uint32_t pc = block->start; pc < block->end; ) {
+            const uint16_t opcode = rom[pc - cfg->base] << 8 | rom[pc - cfg->base + 1];
+            const uint16_t template = chip8_opcode_template(opcode);
+            int length = 2;
+
+            features |= opcode_features(template, opcode, pc);
+
+            const int stored = store_length(template, opcode);
+            if (stored > 0 && !known) {
+                features |= ROM_INDIRECT_STORE;
+            } else if (stored > 0) {
+                for (uint32_t a = i; a < i + stored && a < CFG_MEMORY; a++) {
+                    if (cfg->map[a] & (CFG_CODE | CFG_OPERAND))
+                        features |= ROM_SELF_MODIFY;
+                }
+            }
+
+            if (template == 0xA000) {
+                i = opcode & 0xFFF;
+                known = 1;
+            } else if (template == 0xF000) {
+                length = 4;
+                known = pc + 3 < cfg->base + cfg->size;
+                if (known)
+                    i = rom[pc - cfg->base + 2] << 8 | rom[pc - cfg->base + 3];
+            } else if (template == 0xF01E || template == 0xF029 || template == 0xF030 ||
+                       template == 0xF055 || template == 0xF065) {
+                // Depends on registers, or on the load_store_i quirk.
+                known = 0;
+            }
+            pc += length;
+        }
+    }
+    return features;
+}
+
+void rom_analyse(const uint8_t *rom, size_t size, rom_analysis_t *analysis)
+{
+    cfg_t *cfg = cfg_build(rom, size, PC_START, PC_START);
+    const uint32_t features = scan_blocks(cfg, rom);
+    cfg_free(cfg);
+
+    analysis->hash = hash_bytes(rom, size);
+    analysis->features = features;
+
+    // The newest instruction set used decides the profile. Plain CHIP-8 ROMs
+    // all get the original interpreter's behaviour: even those without any
+    // of the quirky opcodes draw, and the profiles differ in sprite clipping.
+    if (features & ROM_XOCHIP) {
+        analysis->quirks = QUIRKS_XOCHIP;
+    } else if (features & ROM_SCHIP) {
+        analysis->quirks = QUIRKS_SCHIP;
+    } else {
+        analysis->quirks = QUIRKS_CHIP8;
+    }
+    analysis->lazy_flags = (features & ROM_FLAGS) != 0;
+    analysis->skip_idle = (features & ROM_BACKWARD_JUMP) != 0;
+}
+
+// Cache lines are "v<version> <hash> <profile> <lazy flags> <idle skip>
+// <features>". Lines from before versions were written have no "v" prefix
+// and are skipped like any other version.
+static int cache_lookup(FILE *fp, uint64_t hash, rom_analysis_t *analysis)
+{
+    char line[CACHE_LINE_SIZE], name[CACHE_LINE_SIZE];
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t key;
+        unsigned version, lazy_flags, skip_idle, features;
+        if (sscanf(line, "v%u %" SCNx64 " %s %u %u %x", &version, &key, name, &lazy_flags, &skip_idle,
+                   &features) != 6 || version != ANALYSER_VERSION || key != hash)
+            continue;
+        const int quirks = chip8_find_quirks(name);
+        if (quirks < 0)
+            continue;
+        analysis->hash = hash;
+        analysis->features = features;
+        analysis->quirks = quirks;
+        analysis->lazy_flags = lazy_flags;
+        analysis->skip_idle = skip_idle;
+        return 1;
+    }
+    return 0;
+}
+
+int rom_analyse_cached(const char *path, const uint8_t *rom, size_t size, rom_analysis_t *analysis)
+{
+    FILE *fp = path ? fopen(path, "a+") : NULL;
+    if (!fp) {
+        rom_analyse(rom, size, analysis);
+        return 0;
+    }
+
+    const int hit = cache_lookup(fp, hash_bytes(rom, size), analysis);
+    if (!hit) {
+        rom_analyse(rom, size, analysis);
+        fprintf(fp, "v%u %016" PRIx64 " %s %u %u %x\n", ANALYSER_VERSION, analysis->hash,
+                chip8_quirk_names[analysis->quirks], analysis->lazy_flags, analysis->skip_idle, analysis->features);
+    }
+    fclose(fp);
+    return hit;
+}
+
+const char* rom_cache_path()
+{
+    static char path[4096];
+    const char *env = getenv("CHIP8_QUIRK_CACHE");
+    const char *home = getenv("HOME");
+
+    if (env)
+        return env;
+    if (!home)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/.cache/chip8-quirks", home);
+    return path;
+}
+
+void rom_apply(const rom_analysis_t *analysis, chip8_t *vm)
+{
+    vm->quirks = analysis->quirks;
+    vm->lazy_flags = analysis->lazy_flags;
+    vm->skip_idle = analysis->skip_idle;
+}
+
+void rom_feature_names(uint32_t features, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < NUM_ROM_FEATURES && len < size; i++) {
+        if (features & (1 << i))
+            len += snprintf(buf + len, size - len, "%s%s", len ? " " : "", feature_names[i]);
+    }
+}
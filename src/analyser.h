@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8-vm.h"
+
+// Opcode families and patterns found in the code reachable from PC_START.
+#define ROM_SCHIP          0x0001   // SUPER-CHIP opcodes.
+#define ROM_XOCHIP         0x0002   // XO-CHIP opcodes.
+#define ROM_JUMPI          0x0004   // BNNN, affected by the jump_vx quirk.
+#define ROM_LOAD_STORE     0x0008   // FX55/FX65, affected by load_store_i.
+#define ROM_SHIFT_XY       0x0010   // 8XY6/8XYE with X != Y, affected by shift_vy.
+#define ROM_LOGIC          0x0020   // 8XY1-8XY3, affected by vf_reset.
+#define ROM_FLAGS          0x0040   // Flag-producing ALU operations.
+#define ROM_BACKWARD_JUMP  0x0080   // JUMP to itself or backwards: idle loop candidates.
+#define ROM_SELF_MODIFY    0x0100   // Stores through a constant I into code.
+#define ROM_INDIRECT_STORE 0x0200   // Stores through an I not known statically.
+#define NUM_ROM_FEATURES   10
+
+// Version of the scan rules and of the engines they pick for, written with
+// each cache entry. Bump it when either changes: entries of other versions
+// are then ignored and analysed again.
+#define ANALYSER_VERSION 3
+
+typedef struct {
+    uint64_t hash;          // Content hash, see hash_bytes().
+    uint32_t features;      // ROM_* flags.
+    uint8_t quirks;         // Profile picked, one of QUIRKS_*.
+    uint8_t lazy_flags;     // Engine picked.
+    uint8_t skip_idle;
+} rom_analysis_t;
+
+// Scan the reachable code of a ROM loaded at PC_START and pick a profile and
+// engine for it. Every engine gives the same state as the reference one, so
+// they are only enabled when the ROM has code they speed up.
+void rom_analyse(const uint8_t *rom, size_t size, rom_analysis_t *analysis);
+// Same, looking the ROM up first by content hash in the cache file at path,
+// and appending the analysis there on a miss. A NULL path, or a file that
+// can't be opened, skips the cache. Returns 1 on a hit.
+int rom_analyse_cached(const char *path, const uint8_t *rom, size_t size, rom_analysis_t *analysis);
+// Default cache file: $CHIP8_QUIRK_CACHE, or ~/.cache/chip8-quirks. NULL if
+// neither can be derived.
+const char* rom_cache_path();
+void rom_apply(const rom_analysis_t *analysis, chip8_t *vm);
+// Space separated feature names, e.g. "schip flags", written to buf.
+void rom_feature_names(uint32_t features, char *buf, size_t size);
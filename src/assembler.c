@@ -7,81 +7,7 @@
 #include "parser.h"
 #include "util.h"
 
-#define DEBUG 0
-
-typedef struct {
-    uint32_t numlines;
-    char **lines;
-} source_program_t;
-
-source_program_t* source_program_read(char* buffer)
-{
-    source_program_t* ret = (source_program_t*) malloc(sizeof(source_program_t));
-
-    // Read number of lines.
-    int numlines = 0;
-    for (int i = 0; buffer[i] != '\0'; i++) {
-        if (buffer[i] == '\n') {
-            numlines++;
-        }
-    }
-
-    // Allocate number of lines.
-    ret->numlines = numlines;
-    ret->lines = (char**) calloc(sizeof(char*), numlines);
-
-    // Copy content per line.
-    int i = 0;
-    for (char* ptr = buffer; *ptr != '\0';) {
-        char *end = strchr(ptr, '\n');
-        size_t len = end - ptr;
-        ret->lines[i] = calloc(sizeof(char), len);
-        strncpy(ret->lines[i++], ptr, len);
-        ptr = end + 1;
-    }
-
-    return ret;
-}
-
-void source_program_free(source_program_t* p)
-{
-    free(p->lines);
-    free(p);
-}
-
-void assembler_dump_instruction(uint16_t opcode, const instr_t* instr)
-{
-    printf("0x%.4x: ", opcode);
-    printf("{'%s'", instr->keyword);
-    if (strlen(instr->op1) > 0) {
-        printf(", '%s'", instr->op1);
-    }
-    if (strlen(instr->op2) > 0) {
-        printf(", '%s'", instr->op2);
-    }
-    if (strlen(instr->op3) > 0) {
-        printf(", '%s'", instr->op3);
-    }
-    printf("}\n");
-}
-
-size_t assembler_compile_program(uint16_t *output, source_program_t* program)
-{
-    instr_t instr = empty_instr;
-    int i = 0;
-    for (; i < program->numlines; i++) {
-        assembler_parse_line(&instr, program->lines[i]);
-        output[i] = assembler_compile_instruction(&instr);
-        if (DEBUG) {
-            assembler_dump_instruction(output[i], &instr);
-        }
-    }
-    source_program_free(program);
-
-    return i;
-}
-
-void assembler_write_to_file(const char* fileout, uint16_t* output, size_t size)
+void assembler_write_to_file(const char* fileout, const uint8_t* output, size_t size)
 {
     FILE* fp = fopen(fileout, "wb+");
     if (!fp) {
@@ -89,7 +15,7 @@ void assembler_write_to_file(const char* fileout, uint16_t* output, size_t size)
         exit(1);
     }
 
-    fwrite(output, sizeof(uint16_t), size, fp);
+    fwrite(output, sizeof(uint8_t), size, fp);
     fclose(fp);
 }
 
@@ -103,10 +29,10 @@ char** chip8_parse_line(const char* line)
 
     int pos = 0, i = 0;
     while (1) {
-        pos += next_token(token, line, pos, " ,");
-        if (eol(line[pos]))
+        pos += next_token(token, token_size, line, pos, " ,");
+        if (eol(line[pos]) || i == instr_size)
             break;
-        ret[i] = (char*) calloc(strlen(token), sizeof(char));
+        ret[i] = (char*) calloc(strlen(token) + 1, sizeof(char));
         strcpy(ret[i++], token);
         pos++;
     }
@@ -177,12 +103,14 @@ int main(int argc, char* argv[])
         }
     }
 
-    char* buffer = readtext(filein);
+    size_t len;
+    const char* source = mapfile(filein, &len);
 
-    source_program_t* program = source_program_read(buffer);
-    uint16_t output[program->numlines];
-    size_t size = assembler_compile_program(output, program);
+    uint8_t* output = (uint8_t*) malloc(len + 2);
+    size_t size = assembler_assemble(source, len, output);
     assembler_write_to_file(fileout, output, size);
+    unmapfile(source, len);
+    free(output);
     if (argc != 3) {
         fprintf(stdout, "Generated: %s\n", fileout);
     }
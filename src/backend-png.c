@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+
+#define PNG_SCALE 4
+#define DEFAULT_PATTERN "frame-%06u.png"
+#define MAX_STORED_BLOCK 65535
+
+// PNG backend: writes every presented frame as a 1-bit grayscale PNG. The
+// image data is stored uncompressed, so no external library is needed.
+
+typedef struct {
+    chip8_backend_t base;
+    char pattern[256];
+    unsigned frames;
+    uint8_t *raw;       // Filtered scanlines.
+    uint8_t *out;       // Encoded file.
+    size_t width, height;
+    size_t rawlen, outcap;
+} png_backend_t;
+
+static uint32_t crc_table[256];
+
+static void crc_init()
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc(const uint8_t *buf, size_t len)
+{
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFF;
+}
+
+static uint32_t adler32(const uint8_t *buf, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a = (a + buf[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return b << 16 | a;
+}
+
+static uint8_t* put32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = value >> 24;
+    ptr[1] = value >> 16;
+    ptr[2] = value >> 8;
+    ptr[3] = value;
+    return ptr + 4;
+}
+
+// Append a chunk whose data was already written at ptr + 8.
+static uint8_t* put_chunk(uint8_t *ptr, const char *type, size_t len)
+{
+    put32(ptr, len);
+    memcpy(ptr + 4, type, 4);
+    uint8_t *end = ptr + 8 + len;
+    return put32(end, crc(ptr + 4, len + 4));
+}
+
+// Size the buffers for a frame, which changes with the SUPER-CHIP resolution.
+static void png_resize(png_backend_t *png, size_t width, size_t height)
+{
+    const size_t stride = 1 + (width * PNG_SCALE + 7) / 8;
+    png->width = width;
+    png->height = height;
+    png->rawlen = stride * height * PNG_SCALE;
+    png->raw = (uint8_t*) realloc(png->raw, png->rawlen);
+    // Signature, three chunk headers, zlib header and one header per block.
+    const size_t blocks = png->rawlen / MAX_STORED_BLOCK + 1;
+    png->outcap = 8 + 3 * 12 + 13 + 2 + 4 + blocks * 5 + png->rawlen;
+    png->out = (uint8_t*) realloc(png->out, png->outcap);
+}
+
+static size_t png_encode(png_backend_t *png, const chip8_frame_t *frame)
+{
+    if (frame->width != png->width || frame->height != png->height)
+        png_resize(png, frame->width, frame->height);
+
+    const size_t width = frame->width * PNG_SCALE;
+    const size_t height = frame->height * PNG_SCALE;
+    const size_t stride = 1 + (width + 7) / 8;
+
+    // Build scanlines: filter type 0 followed by packed pixels, MSB first.
+    memset(png->raw, 0, png->rawlen);
+    for (size_t y = 0; y < height; y++) {
+        uint8_t *line = png->raw + y * stride + 1;
+        const uint8_t *src = frame->pixels + (y / PNG_SCALE) * frame->width;
+        for (size_t x = 0; x < width; x++) {
+            if (src[x / PNG_SCALE])
+                line[x / 8] |= 0x80 >> (x % 8);
+        }
+    }
+
+    uint8_t *ptr = png->out;
+    memcpy(ptr, "\x89PNG\r\n\x1a\n", 8);
+    ptr += 8;
+
+    // IHDR: 1-bit grayscale, no interlace.
+    uint8_t *data = ptr + 8;
+    data = put32(data, width);
+    data = put32(data, height);
+    memcpy(data, "\x01\x00\x00\x00\x00", 5);
+    ptr = put_chunk(ptr, "IHDR", 13);
+
+    // IDAT: zlib stream made of stored deflate blocks.
+    data = ptr + 8;
+    *data++ = 0x78;
+    *data++ = 0x01;
+    size_t left = png->rawlen;
+    const uint8_t *src = png->raw;
+    do {
+        uint16_t len = left > MAX_STORED_BLOCK ? MAX_STORED_BLOCK : left;
+        left -= len;
+        *data++ = left == 0 ? 1 : 0;
+        *data++ = len & 0xFF;
+        *data++ = len >> 8;
+        *data++ = ~len & 0xFF;
+        *data++ = (~len >> 8) & 0xFF;
+        memcpy(data, src, len);
+        data += len;
+        src += len;
+    } while (left > 0);
+    data = put32(data, adler32(png->raw, png->rawlen));
+    ptr = put_chunk(ptr, "IDAT", data - (ptr + 8));
+
+    ptr = put_chunk(ptr, "IEND", 0);
+
+    return ptr - png->out;
+}
+
+static void png_present(chip8_backend_t *backend, const chip8_frame_t *frame)
+{
+    png_backend_t *png = (png_backend_t*) backend;
+
+    char filename[300];
+    snprintf(filename, sizeof(filename), png->pattern, png->frames++);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't create file: %s\n", filename);
+        return;
+    }
+    size_t size = png_encode(png, frame);
+    fwrite(png->out, 1, size, fp);
+    fclose(fp);
+}
+
+static void png_destroy(chip8_backend_t *backend)
+{
+    png_backend_t *png = (png_backend_t*) backend;
+
+    free(png->raw);
+    free(png->out);
+    free(png);
+}
+
+chip8_backend_t* png_backend_create(size_t width, size_t height, const char *arg)
+{
+    png_backend_t *ret = (png_backend_t*) calloc(1, sizeof(png_backend_t));
+    ret->base.name = "png";
+    ret->base.present = png_present;
+    ret->base.poll = NULL;
+    ret->base.destroy = png_destroy;
+
+    snprintf(ret->pattern, sizeof(ret->pattern), "%s", arg ? arg : DEFAULT_PATTERN);
+
+    png_resize(ret, width, height);
+
+    if (crc_table[1] == 0)
+        crc_init();
+
+    return &ret->base;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "SDL.h"
+
+#include "backend.h"
+#include "sound-ring.h"
+
+#define COLOR_ON  0xFFFFFFFF
+#define COLOR_OFF 0xFF000000
+
+// Colors by plane bits: only the first plane, only the second, and both.
+static const uint32_t palette[4] = { COLOR_OFF, COLOR_ON, 0xFFFF5555, 0xFF55AAFF };
+
+#define AUDIO_RATE 44100
+#define AUDIO_BUFFER 512
+// One period of the 441Hz tone.
+#define SQUARE_PERIOD (AUDIO_RATE / 441)
+#define SQUARE_VOLUME 4000
+// Delay between an edge and when it's heard. Edges later than this are
+// resynchronised, e.g. after a pause or in turbo mode.
+#define AUDIO_LATENCY (AUDIO_RATE / 20)
+
+typedef struct {
+    chip8_backend_t base;
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    size_t width, height;
+    uint32_t *pixels;
+
+    SDL_AudioDeviceID audio;
+    sound_ring_t ring;
+    // Owned by the audio callback.
+    int16_t square[SQUARE_PERIOD];
+    uint64_t clock;             // Samples played.
+    int64_t offset;             // Sample at emulated time 0.
+    int synced;
+    int beeping;
+    unsigned phase;
+} sdl_backend_t;
+
+static SDL_Texture* sdl_create_texture(SDL_Renderer *renderer, size_t width, size_t height)
+{
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!texture) {
+        fprintf(stderr, "Could not create texture\n");
+        exit(1);
+    }
+    return texture;
+}
+
+// Upload the whole frame as one streaming texture, scaled by the renderer.
+// The window keeps its size when the resolution changes.
+static void sdl_present(chip8_backend_t *backend, const chip8_frame_t *frame)
+{
+    sdl_backend_t *sdl = (sdl_backend_t*) backend;
+    const size_t size = (size_t) frame->width * frame->height;
+
+    if (frame->width != sdl->width || frame->height != sdl->height) {
+        SDL_DestroyTexture(sdl->texture);
+        sdl->texture = sdl_create_texture(sdl->renderer, frame->width, frame->height);
+        sdl->width = frame->width;
+        sdl->height = frame->height;
+        sdl->pixels = (uint32_t*) realloc(sdl->pixels, size * sizeof(uint32_t));
+    }
+    for (size_t i = 0; i < size; i++) {
+        sdl->pixels[i] = palette[frame->pixels[i] & 3];
+    }
+    SDL_UpdateTexture(sdl->texture, NULL, sdl->pixels, frame->width * sizeof(uint32_t));
+    SDL_RenderClear(sdl->renderer);
+    SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
+    SDL_RenderPresent(sdl->renderer);
+}
+
+static void sdl_sound(chip8_backend_t *backend, int on, uint64_t time)
+{
+    sound_ring_push(&((sdl_backend_t*) backend)->ring, time, on);
+}
+
+// Audio thread. Applies the edges due at each sample and copies the tone
+// from the precomputed period.
+static void sdl_audio(void *userdata, Uint8 *stream, int len)
+{
+    sdl_backend_t *sdl = (sdl_backend_t*) userdata;
+    int16_t *out = (int16_t*) stream;
+    const int samples = len / sizeof(int16_t);
+
+    for (int i = 0; i < samples; i++, sdl->clock++) {
+        sound_edge_t edge;
+        while (sound_ring_peek(&sdl->ring, &edge)) {
+            const int64_t at = (int64_t) (edge.time * AUDIO_RATE / 1000000);
+            if (!sdl->synced || at + sdl->offset + AUDIO_LATENCY < (int64_t) sdl->clock) {
+                sdl->offset = sdl->clock + AUDIO_LATENCY - at;
+                sdl->synced = 1;
+            }
+            if (at + sdl->offset > (int64_t) sdl->clock)
+                break;
+            sdl->beeping = edge.on;
+            sound_ring_pop(&sdl->ring);
+        }
+
+        out[i] = sdl->beeping ? sdl->square[sdl->phase] : 0;
+        sdl->phase = (sdl->phase + 1) % SQUARE_PERIOD;
+    }
+}
+
+static void sdl_open_audio(sdl_backend_t *sdl)
+{
+    for (int i = 0; i < SQUARE_PERIOD; i++) {
+        sdl->square[i] = i < SQUARE_PERIOD / 2 ? SQUARE_VOLUME : -SQUARE_VOLUME;
+    }
+
+    SDL_AudioSpec want = { 0 }, have;
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_BUFFER;
+    want.callback = sdl_audio;
+    want.userdata = sdl;
+
+    // Running without sound is fine, e.g. on machines without a device.
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0 ||
+        !(sdl->audio = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0))) {
+        fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
+        return;
+    }
+    sdl->base.sound = sdl_sound;
+    SDL_PauseAudioDevice(sdl->audio, 0);
+}
+
+// Keypad on the left of a QWERTY keyboard:
+//   1 2 3 4      1 2 3 C
+//   Q W E R  ->  4 5 6 D
+//   A S D F      7 8 9 E
+//   Z X C V      A 0 B F
+static int sdl_keypad(SDL_Keycode sym)
+{
+    switch (sym) {
+        case SDLK_1: return 0x1;
+        case SDLK_2: return 0x2;
+        case SDLK_3: return 0x3;
+        case SDLK_4: return 0xC;
+        case SDLK_q: return 0x4;
+        case SDLK_w: return 0x5;
+        case SDLK_e: return 0x6;
+        case SDLK_r: return 0xD;
+        case SDLK_a: return 0x7;
+        case SDLK_s: return 0x8;
+        case SDLK_d: return 0x9;
+        case SDLK_f: return 0xE;
+        case SDLK_z: return 0xA;
+        case SDLK_x: return 0x0;
+        case SDLK_c: return 0xB;
+        case SDLK_v: return 0xF;
+    }
+    return -1;
+}
+
+// Host time of an event. SDL stamps events in milliseconds since SDL_Init
+// when they are queued, which can be a few milliseconds before they are
+// polled, so the clock is read now and moved back by the difference.
+static uint64_t sdl_event_time(uint32_t timestamp)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    const uint64_t age = (uint64_t) (SDL_GetTicks() - timestamp) * 1000000;
+    return age < now ? now - age : now;
+}
+
+static int sdl_poll(chip8_backend_t *backend)
+{
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT)
+            return 0;
+        if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat && backend->keys) {
+            const int key = sdl_keypad(event.key.keysym.sym);
+            if (key < 0)
+                continue;
+            key_event_t key_event = { sdl_event_time(event.key.timestamp), key, event.type == SDL_KEYDOWN };
+            key_ring_push(backend->keys, &key_event);
+        }
+    }
+    return 1;
+}
+
+static void sdl_destroy(chip8_backend_t *backend)
+{
+    sdl_backend_t *sdl = (sdl_backend_t*) backend;
+
+    if (sdl->audio)
+        SDL_CloseAudioDevice(sdl->audio);
+    SDL_DestroyTexture(sdl->texture);
+    SDL_DestroyRenderer(sdl->renderer);
+    SDL_DestroyWindow(sdl->window);
+    SDL_Quit();
+    free(sdl->pixels);
+    free(sdl);
+}
+
+chip8_backend_t* sdl_backend_create(size_t width, size_t height, const char *arg)
+{
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "Could not init SDL: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    SDL_Window *window = SDL_CreateWindow("chip8",
+            SDL_WINDOWPOS_UNDEFINED,
+            SDL_WINDOWPOS_UNDEFINED,
+            width * PIXEL_SIZE,
+            height * PIXEL_SIZE,
+            0);
+    if (!window) {
+        fprintf(stderr, "Could not create window\n");
+        exit(1);
+    }
+
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!renderer) {
+        fprintf(stderr, "Could not create renderer\n");
+        exit(1);
+    }
+
+    SDL_Texture *texture = sdl_create_texture(renderer, width, height);
+
+    sdl_backend_t *ret = (sdl_backend_t*) calloc(1, sizeof(sdl_backend_t));
+    ret->base.name = "sdl";
+    ret->base.present = sdl_present;
+    ret->base.poll = sdl_poll;
+    ret->base.destroy = sdl_destroy;
+    ret->window = window;
+    ret->renderer = renderer;
+    ret->texture = texture;
+    ret->width = width;
+    ret->height = height;
+    ret->pixels = (uint32_t*) calloc(width * height, sizeof(uint32_t));
+    sdl_open_audio(ret);
+
+    return &ret->base;
+}
@@ -1,71 +1,77 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "backend.h"
 
-color_t colors[] = {
-    {0, 0, 0},         // black
-    {0, 0, 255},       // blue
-    {0, 255, 0},       // green
-    {255, 0, 0},       // red
-    {255, 255, 255},   // white
+typedef chip8_backend_t* (*backend_create_t)(size_t width, size_t height, const char *arg);
+
+typedef struct {
+    const char *name;
+    backend_create_t create;
+    const char *description;
+} backend_entry_t;
+
+static const backend_entry_t backends[] = {
+    { "sdl",     sdl_backend_create,     "SDL window" },
+    { "term",    term_backend_create,    "ANSI terminal, half-block glyphs" },
+    { "braille", braille_backend_create, "ANSI terminal, braille glyphs" },
+    { "png",     png_backend_create,     "PNG file per frame, arg is a printf pattern" },
+    { "null",    null_backend_create,    "Discard frames" },
 };
 
-display_t* create_display(size_t width, size_t height)
-{
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fprintf(stderr, "Could not init SDL: %s\n", SDL_GetError());
-        exit(1);
-    }
+static const size_t NUM_BACKENDS = sizeof(backends) / sizeof(backends[0]);
 
-    SDL_Window *window = SDL_CreateWindow("My application",
-            SDL_WINDOWPOS_UNDEFINED,
-            SDL_WINDOWPOS_UNDEFINED,
-            width * PIXEL_SIZE,
-            height * PIXEL_SIZE,
-            0);
-    if (!window) {
-        fprintf(stderr, "Could not create window\n");
-        exit(1);
-    }
+chip8_backend_t* create_backend(const char *spec, size_t width, size_t height)
+{
+    const char *arg = strchr(spec, ':');
+    size_t len = arg ? (size_t) (arg - spec) : strlen(spec);
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-    if(!renderer) {
-        fprintf(stderr, "Could not create renderer\n");
-        exit(1);
+    for (size_t i = 0; i < NUM_BACKENDS; i++) {
+        if (strlen(backends[i].name) == len && !strncmp(spec, backends[i].name, len)) {
+            return backends[i].create(width, height, arg ? arg + 1 : NULL);
+        }
     }
+    return NULL;
+}
 
-    display_t *display = (display_t*) malloc(sizeof(display_t));
-    display->window = window;
-    display->renderer = renderer;
-
-    return display;
+void delete_backend(chip8_backend_t *backend)
+{
+    backend->destroy(backend);
 }
 
-void delete_display(display_t *display)
+void list_backends(FILE *fp)
 {
-    SDL_DestroyWindow(display->window);
-    SDL_Quit();
+    for (size_t i = 0; i < NUM_BACKENDS; i++) {
+        fprintf(fp, "  %-8s %s\n", backends[i].name, backends[i].description);
+    }
 }
 
-void clean_display(display_t *display, color_t color)
+// Null backend: only counts frames, so the emulation loop can be measured
+// without any rendering cost.
+
+typedef struct {
+    chip8_backend_t base;
+    uint64_t frames;
+} null_backend_t;
+
+static void null_present(chip8_backend_t *backend, const chip8_frame_t *frame)
 {
-    SDL_SetRenderDrawColor(display->renderer, color.r, color.g, color.b, 255);
-    SDL_RenderClear(display->renderer);
+    ((null_backend_t*) backend)->frames++;
 }
 
-void refresh(display_t* display)
+static void null_destroy(chip8_backend_t *backend)
 {
-    SDL_RenderPresent(display->renderer);
+    free(backend);
 }
 
-void draw_pixel(display_t *display, uint16_t x, uint16_t y, color_t c)
+chip8_backend_t* null_backend_create(size_t width, size_t height, const char *arg)
 {
-    SDL_SetRenderDrawColor(display->renderer, c.r, c.g, c.b, 255);
-    for (uint16_t i = x * PIXEL_SIZE; i < (x * PIXEL_SIZE) + PIXEL_SIZE; i++) {
-        for (uint16_t j = y * PIXEL_SIZE; j < (y * PIXEL_SIZE) + PIXEL_SIZE; j++) {
-            SDL_RenderDrawPoint(display->renderer, i, j);
-        }
-    }
+    null_backend_t *ret = (null_backend_t*) calloc(1, sizeof(null_backend_t));
+    ret->base.name = "null";
+    ret->base.present = null_present;
+    ret->base.poll = NULL;
+    ret->base.destroy = null_destroy;
+    return &ret->base;
 }
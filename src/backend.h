@@ -1,32 +1,60 @@
 #pragma once
 
-#include "SDL.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 
-#define WIDTH   64
-#define HEIGHT  32
+#include "key-ring.h"
 
 #define PIXEL_SIZE 10
 
-typedef struct display_t {
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-} display_t;
-
-typedef struct color_t {
-    uint8_t r, g, b;
-} color_t;
-
-enum color_index { black, blue, green, red, white };
-
-extern color_t colors[];
-
-typedef struct pixel_t {
-    uint16_t x, y;
-    color_t color;
-} pixel_t;
-
-display_t* create_display(size_t width, size_t height);
-void delete_display(display_t *display);
-void clean_display(display_t *display, color_t color);
-void refresh(display_t* display);
-void draw_pixel(display_t *display, uint16_t x, uint16_t y, color_t c);
\ No newline at end of file
+// A complete framebuffer handed to a backend. One byte per pixel, non-zero
+// means the pixel is lit.
+typedef struct chip8_frame_t {
+    uint16_t width, height;
+    const uint8_t *pixels;
+} chip8_frame_t;
+
+// Output backend. Implementations embed this struct as their first member
+// and are created through create_backend().
+typedef struct chip8_backend_t {
+    const char *name;
+    // Show a whole frame.
+    void (*present)(struct chip8_backend_t *backend, const chip8_frame_t *frame);
+    // Process pending host events. Returns 0 when the user asked to quit.
+    int (*poll)(struct chip8_backend_t *backend);
+    // Beeper turned on or off at an emulated time in microseconds. Optional.
+    void (*sound)(struct chip8_backend_t *backend, int on, uint64_t time);
+    void (*destroy)(struct chip8_backend_t *backend);
+    // Where poll sends the keypad keys pressed and released, timestamped.
+    // Set by the host, NULL to ignore them.
+    key_ring_t *keys;
+} chip8_backend_t;
+
+chip8_backend_t* sdl_backend_create(size_t width, size_t height, const char *arg);
+chip8_backend_t* null_backend_create(size_t width, size_t height, const char *arg);
+chip8_backend_t* png_backend_create(size_t width, size_t height, const char *arg);
+chip8_backend_t* term_backend_create(size_t width, size_t height, const char *arg);
+chip8_backend_t* braille_backend_create(size_t width, size_t height, const char *arg);
+
+// Create a backend by name. The name can be followed by ':' and an argument
+// for the backend, e.g. "png:shots/%06u.png". Returns NULL if unknown.
+chip8_backend_t* create_backend(const char *spec, size_t width, size_t height);
+void delete_backend(chip8_backend_t *backend);
+void list_backends(FILE *fp);
+
+static inline void backend_present(chip8_backend_t *backend, const chip8_frame_t *frame)
+{
+    backend->present(backend, frame);
+}
+
+static inline int backend_poll(chip8_backend_t *backend)
+{
+    return backend->poll ? backend->poll(backend) : 1;
+}
+
+static inline void backend_sound(chip8_backend_t *backend, int on, uint64_t time)
+{
+    if (backend->sound)
+        backend->sound(backend, on, time);
+}
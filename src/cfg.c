@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+
+// How an instruction transfers control.
+typedef enum {
+    FLOW_NEXT,
+    FLOW_RET,
+    FLOW_JUMP,
+    FLOW_CALL,
+    FLOW_SKIP,
+    FLOW_INDIRECT,
+    FLOW_EXIT,
+    FLOW_INVALID,
+} flow_t;
+
+static flow_t classify(uint16_t opcode)
+{
+    const uint8_t lo = opcode & 0xFF, n = opcode & 0xF;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00EE)
+                return FLOW_RET;
+            if (opcode == 0x00FD)
+                return FLOW_EXIT;
+            return opcode == 0x0000 ? FLOW_INVALID : FLOW_NEXT;
+        case 0x1:
+            return FLOW_JUMP;
+        case 0x2:
+            return FLOW_CALL;
+        case 0x3:
+        case 0x4:
+            return FLOW_SKIP;
+        case 0x5:
+            if (n == 0x2 || n == 0x3)
+                return FLOW_NEXT;
+            return n == 0 ? FLOW_SKIP : FLOW_INVALID;
+        case 0x9:
+            return n == 0 ? FLOW_SKIP : FLOW_INVALID;
+        case 0x8:
+            return (n <= 0x7 || n == 0xE) ? FLOW_NEXT : FLOW_INVALID;
+        case 0xB:
+            return FLOW_INDIRECT;
+        case 0xE:
+            return (lo == 0x9E || lo == 0xA1) ? FLOW_SKIP : FLOW_INVALID;
+        case 0xF:
+            switch (lo) {
+                case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E:
+                case 0x29: case 0x33: case 0x55: case 0x65:
+                case 0x01: case 0x30: case 0x3A: case 0x75: case 0x85:
+                    return FLOW_NEXT;
+                case 0x00:
+                case 0x02:
+                    return (opcode & 0x0F00) == 0 ? FLOW_NEXT : FLOW_INVALID;
+            }
+            return FLOW_INVALID;
+        default:
+            return FLOW_NEXT;
+    }
+}
+
+// XO-CHIP F000 NNNN is the only four-byte instruction.
+static inline int length(uint16_t opcode)
+{
+    return opcode == 0xF000 ? 4 : 2;
+}
+
+typedef struct {
+    uint16_t *items;
+    size_t len, cap;
+} worklist_t;
+
+static void worklist_push(worklist_t *list, uint16_t addr)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->items = (uint16_t*) realloc(list->items, list->cap * sizeof(uint16_t));
+    }
+    list->items[list->len++] = addr;
+}
+
+static inline int in_rom(const cfg_t *cfg, uint32_t addr)
+{
+    return addr >= cfg->base && addr + 1 < (uint32_t) cfg->base + cfg->size;
+}
+
+static inline uint16_t fetch(const uint8_t *rom, const cfg_t *cfg, uint16_t addr)
+{
+    return rom[addr - cfg->base] << 8 | rom[addr - cfg->base + 1];
+}
+
+// Queue a block start discovered from a branch.
+static void add_leader(cfg_t *cfg, worklist_t *list, uint32_t addr, uint8_t flags)
+{
+    if (!in_rom(cfg, addr))
+        return;
+    cfg->map[addr] |= CFG_LEADER | flags;
+    worklist_push(list, addr);
+}
+
+static void traverse(cfg_t *cfg, const uint8_t *rom, uint16_t entry)
+{
+    worklist_t list = { NULL, 0, 0 };
+
+    add_leader(cfg, &list, entry, 0);
+    while (list.len > 0) {
+        uint32_t pc = list.items[--list.len];
+
+        while (in_rom(cfg, pc)) {
+            // Flowing into code already decoded: it starts a block.
+            if (cfg->map[pc] & CFG_CODE) {
+                cfg->map[pc] |= CFG_LEADER;
+                break;
+            }
+            const uint16_t opcode = fetch(rom, cfg, pc);
+            const flow_t flow = classify(opcode);
+            cfg->map[pc] |= CFG_CODE;
+            for (int i = 1; i < length(opcode) && pc + i < CFG_MEMORY; i++)
+                cfg->map[pc + i] |= CFG_OPERAND;
+            if (flow == FLOW_NEXT) {
+                pc += length(opcode);
+                continue;
+            }
+
+            if (flow == FLOW_JUMP || flow == FLOW_CALL) {
+                add_leader(cfg, &list, opcode & 0xFFF, CFG_TARGET);
+            }
+            if (flow == FLOW_CALL || flow == FLOW_SKIP) {
+                add_leader(cfg, &list, pc + 2, 0);
+            }
+            if (flow == FLOW_SKIP && in_rom(cfg, pc + 2)) {
+                add_leader(cfg, &list, pc + 2 + length(fetch(rom, cfg, pc + 2)), 0);
+            }
+            break;
+        }
+    }
+    free(list.items);
+}
+
+static void add_edge(cfg_t *cfg, size_t *cap, uint16_t from, uint32_t to, uint8_t kind)
+{
+    if (!in_rom(cfg, to) || !(cfg->map[to] & CFG_CODE))
+        return;
+    if (cfg->numedges == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        cfg->edges = (cfg_edge_t*) realloc(cfg->edges, *cap * sizeof(cfg_edge_t));
+    }
+    cfg->edges[cfg->numedges++] = (cfg_edge_t) { from, to, kind };
+}
+
+static void build_blocks(cfg_t *cfg, const uint8_t *rom)
+{
+    size_t capblocks = 0, capedges = 0;
+
+    for (uint32_t start = cfg->base; in_rom(cfg, start); start++) {
+        if (!(cfg->map[start] & CFG_LEADER) || !(cfg->map[start] & CFG_CODE))
+            continue;
+
+        cfg_block_t block = { start, start, 0 };
+        uint32_t pc = start;
+        flow_t flow;
+        uint16_t opcode;
+        do {
+            if ((cfg->map[pc] & CFG_OPERAND) || (cfg->map[pc + 1] & CFG_CODE))
+                block.flags |= BLOCK_OVERLAP;
+            opcode = fetch(rom, cfg, pc);
+            flow = classify(opcode);
+            pc += length(opcode);
+        } while (flow == FLOW_NEXT && in_rom(cfg, pc) &&
+                 (cfg->map[pc] & CFG_CODE) && !(cfg->map[pc] & CFG_LEADER));
+        block.end = pc;
+
+        switch (flow) {
+            case FLOW_NEXT:
+                add_edge(cfg, &capedges, start, pc, EDGE_FALLTHROUGH);
+                break;
+            case FLOW_JUMP:
+                add_edge(cfg, &capedges, start, opcode & 0xFFF, EDGE_JUMP);
+                break;
+            case FLOW_CALL:
+                add_edge(cfg, &capedges, start, opcode & 0xFFF, EDGE_CALL);
+                add_edge(cfg, &capedges, start, pc, EDGE_FALLTHROUGH);
+                break;
+            case FLOW_SKIP:
+                add_edge(cfg, &capedges, start, pc, EDGE_FALLTHROUGH);
+                if (in_rom(cfg, pc))
+                    add_edge(cfg, &capedges, start, pc + length(fetch(rom, cfg, pc)), EDGE_SKIP);
+                break;
+            case FLOW_RET:
+                block.flags |= BLOCK_RETURN;
+                break;
+            case FLOW_INDIRECT:
+                block.flags |= BLOCK_INDIRECT;
+                break;
+            case FLOW_EXIT:
+                block.flags |= BLOCK_EXIT;
+                break;
+            case FLOW_INVALID:
+                block.flags |= BLOCK_INVALID;
+                break;
+        }
+
+        if (cfg->numblocks == capblocks) {
+            capblocks = capblocks ? capblocks * 2 : 64;
+            cfg->blocks = (cfg_block_t*) realloc(cfg->blocks, capblocks * sizeof(cfg_block_t));
+        }
+        cfg->blocks[cfg->numblocks++] = block;
+    }
+}
+
+cfg_t* cfg_build(const uint8_t *rom, size_t size, uint16_t base, uint16_t entry)
+{
+    cfg_t *cfg = (cfg_t*) calloc(1, sizeof(cfg_t));
+
+    cfg->base = base;
+    cfg->size = size > CFG_MEMORY - base ? CFG_MEMORY - base : size;
+    traverse(cfg, rom, entry);
+    build_blocks(cfg, rom);
+
+    return cfg;
+}
+
+void cfg_free(cfg_t *cfg)
+{
+    free(cfg->blocks);
+    free(cfg->edges);
+    free(cfg);
+}
+
+long cfg_find_block(const cfg_t *cfg, uint16_t addr)
+{
+    size_t lo = 0, hi = cfg->numblocks;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cfg->blocks[mid].end <= addr) {
+            lo = mid + 1;
+        } else if (cfg->blocks[mid].start > addr) {
+            hi = mid;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+const char* cfg_edge_name(uint8_t kind)
+{
+    static const char* names[] = { "fallthrough", "jump", "call", "skip" };
+    return kind < 4 ? names[kind] : "?";
+}
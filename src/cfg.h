@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CFG_MEMORY 0x10000
+
+// Per-address flags in cfg_t.map.
+#define CFG_CODE    0x01    // First byte of a reachable instruction.
+#define CFG_OPERAND 0x02    // Other bytes of a reachable instruction.
+#define CFG_LEADER  0x04    // First instruction of a basic block.
+#define CFG_TARGET  0x08    // Target of a JUMP or CALL.
+
+// Block flags.
+#define BLOCK_RETURN   0x01 // Ends with RET.
+#define BLOCK_INDIRECT 0x02 // Ends with JUMPI, targets unknown.
+#define BLOCK_INVALID  0x04 // Ends on an unknown or zero opcode.
+#define BLOCK_OVERLAP  0x08 // Shares bytes with an instruction at another alignment.
+#define BLOCK_EXIT     0x10 // Ends with the SUPER-CHIP EXIT.
+
+typedef enum {
+    EDGE_FALLTHROUGH,   // Next instruction, including the return from a CALL.
+    EDGE_JUMP,
+    EDGE_CALL,
+    EDGE_SKIP,          // Skip taken, lands past the next instruction.
+} cfg_edge_kind_t;
+
+typedef struct {
+    uint16_t from, to;  // Block start addresses.
+    uint8_t kind;
+} cfg_edge_t;
+
+typedef struct {
+    uint16_t start;
+    uint32_t end;           // [start, end) in bytes: 0x10000 at the end of memory.
+    uint8_t flags;
+} cfg_block_t;
+
+typedef struct {
+    uint16_t base;
+    size_t size;
+    uint8_t map[CFG_MEMORY];
+    cfg_block_t *blocks;    // Sorted by start address.
+    size_t numblocks;
+    cfg_edge_t *edges;      // Sorted by source block.
+    size_t numedges;
+} cfg_t;
+
+// Recursive traversal of a ROM loaded at base, following JUMP, CALL, skips
+// and RET from the entry point. Bytes not reached are data.
+cfg_t* cfg_build(const uint8_t *rom, size_t size, uint16_t base, uint16_t entry);
+void cfg_free(cfg_t *cfg);
+// Index of the block containing addr, or -1.
+long cfg_find_block(const cfg_t *cfg, uint16_t addr);
+const char* cfg_edge_name(uint8_t kind);
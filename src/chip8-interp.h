@@ -0,0 +1,374 @@
+// Interpreter template, included by chip8-vm.c once per quirk profile of
+// CHIP8_QUIRK_PROFILES with PROFILE set to the profile id. Handlers that
+// depend on a quirk live here and test QUIRK(name), an enum constant of the
+// profile, so every copy is compiled without the branches of the others.
+// Handlers shared by all profiles are in chip8-vm.c.
+
+#define QUIRK(name) CAT(CAT(QUIRK_, PROFILE), _##name)
+#define SPECIALISE(name) CAT(name##_, PROFILE)
+
+// 8XY1 Sets VX to VX or VY. With the VF_RESET quirk, 8XY1-8XY3 also clear VF.
+static inline void SPECIALISE(or)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+
+    vm->V[x] = vm->V[x] | vm->V[y];
+    if (QUIRK(VF_RESET))
+        reset_flag(vm);
+    vm->PC += 2;
+}
+
+// 8XY2 Sets VX to VX and VY.
+static inline void SPECIALISE(and)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+
+    vm->V[x] = vm->V[x] & vm->V[y];
+    if (QUIRK(VF_RESET))
+        reset_flag(vm);
+    vm->PC += 2;
+}
+
+// 8XY3 Sets VX to VX xor VY.
+static inline void SPECIALISE(xor)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+
+    vm->V[x] = vm->V[x] ^ vm->V[y];
+    if (QUIRK(VF_RESET))
+        reset_flag(vm);
+    vm->PC += 2;
+}
+
+// 8X06 Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
+// With the SHIFT_VY quirk, 8XY6 shifts VY into VX instead.
+static inline void SPECIALISE(shr)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+
+    const uint8_t a = QUIRK(SHIFT_VY) ? vm->V[y] : vm->V[x];
+
+    vm->V[x] = a >> 1;
+    set_flag(vm, FLAG_SHR, a, 0);
+    vm->PC += 2;
+}
+
+// 8X0E Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
+// With the SHIFT_VY quirk, 8XYE shifts VY into VX instead.
+static inline void SPECIALISE(shl)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+
+    const uint8_t a = QUIRK(SHIFT_VY) ? vm->V[y] : vm->V[x];
+
+    vm->V[x] = a << 1;
+    set_flag(vm, FLAG_SHL, a, 0);
+    vm->PC += 2;
+}
+
+// BNNN: Jump to the address NNN + V[0]. With the JUMP_VX quirk, BXNN jumps to
+// XNN + V[X].
+static inline void SPECIALISE(jmpv0)(chip8_t *vm) {
+    const uint8_t x = QUIRK(JUMP_VX) ? vm->opcode.hi & 0x0F : 0;
+
+    vm->PC = address(vm->opcode) + vm->V[x];
+}
+
+// DXYN: Draw a sprite at coordinate (V[X], V[Y]) that has a width of 8 pixels and a height of N pixels.
+// DXY0 draws a 16x16 sprite. With two planes selected, the sprite data for
+// the second plane follows the first. Sprites wrap around the edges, or are
+// cut there with the CLIP quirk.
+static inline void SPECIALISE(draw)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0xf;
+    const uint8_t y = vm->opcode.lo >> 4;
+    const uint8_t n = vm->opcode.lo & 0xf;
+    const int big = n == 0;
+    const int rows = big ? 16 : n;
+    const int scale = vm->hires ? 1 : 2;
+    const unsigned px = (vm->V[x] % (HIRES_WIDTH / scale)) * scale;
+    const unsigned py = (vm->V[y] % (HIRES_HEIGHT / scale)) * scale;
+    uint16_t addr = vm->I;
+    int collision = 0;
+
+    for (int p = 0; p < NUM_PLANES; p++) {
+        if (!(vm->plane_mask & (1 << p)))
+            continue;
+        for (int row = 0; row < rows; row++) {
+            uint32_t bits = vm->ram[addr++];
+            int width = 8;
+            if (big) {
+                bits = bits << 8 | vm->ram[addr++];
+                width = 16;
+            }
+            if (scale == 2) {
+                bits = big ? (uint32_t) double_bits(bits >> 8) << 16 | double_bits(bits) : double_bits(bits);
+                width *= 2;
+            }
+
+            const chip8_row_t sprite = QUIRK(CLIP) ? clip_sprite(bits, width, px) : place_sprite(bits, width, px);
+            for (int i = 0; i < scale; i++) {
+                const unsigned line_y = py + row * scale + i;
+                if (QUIRK(CLIP) && line_y >= HIRES_HEIGHT)
+                    break;
+                chip8_row_t *line = &vm->planes[p][line_y % HIRES_HEIGHT];
+                collision |= (*line & sprite) != 0;
+                *line ^= sprite;
+            }
+        }
+    }
+    vm->V[0xF] = collision;
+    vm->vRamChanged = 1;
+    vm->PC += 2;
+}
+
+// Stores V0 to VX (including VX) in memory starting at address I. The offset from I
+// is increased by 1 for each value written, but I itself is left unmodified, unless
+// with the LOAD_STORE_I quirk.
+static inline void SPECIALISE(push)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    chip8_ram_written(vm, vm->I, x + 1);
+    for (uint8_t i = 0; i <= x; i++) {
+        vm->ram[(vm->I + i) % RAM_MEMORY] = vm->V[i];
+    }
+    if (QUIRK(LOAD_STORE_I))
+        vm->I = (vm->I + x + 1) % RAM_MEMORY;
+    vm->PC += 2;
+}
+
+// Fills V0 to VX (including VX) with values from memory starting at address I. The
+// offset from I is increased by 1 for each value written, but I itself is left
+// unmodified, unless with the LOAD_STORE_I quirk.
+static inline void SPECIALISE(pop)(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    for (uint8_t i = 0; i <= x; i++) {
+        vm->V[i] = vm->ram[(vm->I + i) % RAM_MEMORY];
+    }
+    if (QUIRK(LOAD_STORE_I))
+        vm->I = (vm->I + x + 1) % RAM_MEMORY;
+    vm->PC += 2;
+}
+
+static void SPECIALISE(evaluate)(chip8_t *vm)
+{
+    if (vm->flag_op != FLAG_NONE && touches_vf(vm->opcode)) {
+        chip8_sync_flags(vm);
+    }
+
+    switch (MSB(vm->opcode.hi)) {
+        case 0x0: {
+                      const uint8_t lo = vm->opcode.lo;
+
+                      if (lo == 0xE0) {
+                          cls(vm);
+                      } else if (lo == 0xEE) {
+                          ret(vm);
+                      } else if (vm->opcode.hi != 0x00) {
+                          ecall(vm);
+                      } else if ((lo & 0xF0) == 0xC0) {
+                          scroll_down(vm);
+                      } else if ((lo & 0xF0) == 0xD0) {
+                          scroll_up(vm);
+                      } else if (lo == 0xFB) {
+                          scroll_sideways(vm, 1);
+                      } else if (lo == 0xFC) {
+                          scroll_sideways(vm, 0);
+                      } else if (lo == 0xFD) {
+                          // EXIT: stay on this instruction.
+                      } else if (lo == 0xFE) {
+                          resolution(vm, 0);
+                      } else if (lo == 0xFF) {
+                          resolution(vm, 1);
+                      } else {
+                          ecall(vm);
+                      }
+                  }
+                  break;
+        case 0x1: jmp(vm);
+                  break;
+        case 0x2: call(vm);
+                  break;
+        case 0x3: ske(vm);
+                  break;
+        case 0x4: skne(vm);
+                  break;
+        case 0x5: {
+                      const uint8_t lsb = vm->opcode.lo & 0x0F;
+
+                      if (lsb == 0x2) {
+                          range(vm, 1);
+                      } else if (lsb == 0x3) {
+                          range(vm, 0);
+                      } else {
+                          skre(vm);
+                      }
+                  }
+                  break;
+        case 0x6: load(vm);
+                  break;
+        case 0x7: add(vm);
+                  break;
+        case 0x8: {
+                      const uint8_t lsb = vm->opcode.lo & 0x0F;
+
+                      // Bitwise operations.
+                      if (lsb == 0x0) {
+                          setr(vm);
+                      } else if (lsb == 0x1) {
+                          SPECIALISE(or)(vm);
+                      } else if (lsb == 0x2) {
+                          SPECIALISE(and)(vm);
+                      } else if (lsb == 0x3) {
+                          SPECIALISE(xor)(vm);
+                      } else if (lsb == 0x4) {
+                          addr(vm);
+                      } else if (lsb == 0x5) {
+                          sub(vm);
+                      } else if (lsb == 0x6) {
+                          SPECIALISE(shr)(vm);
+                      } else if (lsb == 0x7) {
+                          subb(vm);
+                      } else if (lsb == 0xE) {
+                          SPECIALISE(shl)(vm);
+                      } else {
+                          // Unreachable.
+                      }
+                  }
+                  break;
+        case 0x9: jneq(vm);
+                  break;
+        case 0xA: seti(vm);
+                  break;
+        case 0xB: SPECIALISE(jmpv0)(vm);
+                  break;
+        case 0xC: rrand(vm);
+                  break;
+        case 0xD: SPECIALISE(draw)(vm);
+                  break;
+        case 0xE: {
+                      const uint8_t lo = vm->opcode.lo;
+
+                      if (lo == 0x9E) {
+                          jkey(vm);
+                      } else if (lo == 0xA1) {
+                          jnkey(vm);
+                      } else {
+                          // Unreachable.
+                      }
+                  }
+                  break;
+        case 0xF: {
+                      const uint8_t lo = vm->opcode.lo;
+
+                      if (vm->opcode.value == 0xF000) {
+                          longi(vm);
+                      } else if (lo == 0x01) {
+                          plane(vm);
+                      } else if (lo == 0x02 || lo == 0x3A) {
+                          // XO-CHIP audio pattern and pitch: no audio output for them.
+                          vm->PC += 2;
+                      } else if (lo == 0x07) {
+                          getdelay(vm);
+                      } else if (lo == 0x0A) {
+                          waitkey(vm);
+                      } else if (lo == 0x15) {
+                          setdelay(vm);
+                      } else if (lo == 0x18) {
+                          setsound(vm);
+                      } else if (lo == 0x1E) {
+                          addi(vm);
+                      } else if (lo == 0x29) {
+                          spritei(vm);
+                      } else if (lo == 0x30) {
+                          bigspritei(vm);
+                      } else if (lo == 0x75) {
+                          saverpl(vm);
+                      } else if (lo == 0x85) {
+                          loadrpl(vm);
+                      } else if (lo == 0x33) {
+                          bcd(vm);
+                      } else if (lo == 0x55) {
+                          SPECIALISE(push)(vm);
+                      } else if (lo == 0x65) {
+                          SPECIALISE(pop)(vm);
+                      } else {
+                          // Unreachable.
+                      }
+                  }
+                  break;
+        default: {
+                     // Unreachable.
+                 }
+    }
+}
+
+static void SPECIALISE(emulate_cycle)(chip8_t *vm)
+{
+    chip8_fetch_instruction(vm);
+    SPECIALISE(evaluate)(vm);
+
+    vm->cycles++;
+    if (++vm->tick_cycles >= vm->cycles_per_tick)
+        chip8_tick(vm);
+}
+
+static int SPECIALISE(run_frame)(chip8_t *vm)
+{
+    int idle = 0;
+
+    do {
+        const uint16_t pc = vm->PC;
+        SPECIALISE(emulate_cycle)(vm);
+
+        // Idle loops are only looked for after a backward jump or a key wait.
+        if (vm->skip_idle && (((vm->opcode.hi >> 4) == 0x1 && vm->PC <= pc) || vm->key_wait) &&
+            vm->tick_cycles != 0) {
+            idle |= chip8_skip_idle(vm);
+        }
+    } while (vm->tick_cycles != 0);
+
+    return idle;
+}
+
+static chip8_yield_t SPECIALISE(run)(chip8_t *vm, uint32_t slice)
+{
+    while (slice-- > 0) {
+        const uint16_t pc = vm->PC;
+        SPECIALISE(emulate_cycle)(vm);
+
+        if (vm->key_wait)
+            return YIELD_KEY;
+        if (vm->skip_idle && (vm->opcode.hi >> 4) == 0x1 && vm->PC <= pc && vm->tick_cycles != 0)
+            chip8_skip_idle(vm);
+        if (vm->tick_cycles == 0)
+            return YIELD_FRAME;
+    }
+    return YIELD_SLICE;
+}
+
+static void SPECIALISE(run_debug)(chip8_t *vm, uint32_t slice, const uint16_t *next_break,
+                                  const uint8_t *watch_pages)
+{
+    uint16_t next = next_break[vm->PC];
+
+    while (slice-- > 0 && vm->PC != next) {
+        const uint16_t pc = vm->PC;
+        chip8_fetch_instruction(vm);
+        if (((MEMORY_GROUPS >> (vm->opcode.hi >> 4)) & 1) && in_pages(vm, watch_pages))
+            return;
+        SPECIALISE(evaluate)(vm);
+        vm->cycles++;
+        if (++vm->tick_cycles >= vm->cycles_per_tick)
+            chip8_tick(vm);
+
+        // Straight-line code reaches next, if anything: look it up again only
+        // after a jump, call, return, taken skip or wrap.
+        if (vm->PC != pc + 2)
+            next = next_break[vm->PC];
+    }
+}
+
+#undef QUIRK
+#undef SPECIALISE
+#undef PROFILE
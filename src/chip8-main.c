@@ -1,38 +1,529 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
 #include <time.h>
-
-#include <SDL2/SDL.h>
+#include <pthread.h>
 
 #include "chip8-vm.h"
+#include "backend.h"
+#include "key-ring.h"
+#include "gdbstub.h"
+#include "analyser.h"
+#include "rompack.h"
+#include "triple-buffer.h"
+#include "perf.h"
+#include "metrics.h"
+#include "util.h"
+
+#define FRAME_NS (1000000000L / 60)
+// In turbo mode, number of frames run between checks of the host clock.
+#define FRAMES_PER_CHECK 64
+// Terminals only report key presses, so a key read from stdin is held for
+// this many frames and then released.
+#define KEY_HOLD_FRAMES 6
+// How often the render thread looks for a new frame when there is none.
+#define RENDER_POLL_NS 2000000L
+// Frames kept by --perf for --perf-csv.
+#define PERF_FRAMES 65536
+// A key followed to the screen is given up on after this long, e.g. when the
+// ROM ignores it, so that the next one can be followed.
+#define KEY_PROBE_NS 1000000000L
+// Most frames --run-ahead can run per host frame.
+#define MAX_RUN_AHEAD 8
+
+static volatile sig_atomic_t running = 1;
+
+// The emulation loop and what it needs.
+typedef struct {
+    chip8_t *vm;
+    chip8_backend_t *backend;
+    gdb_stub_t *stub;
+    // Where frames go. NULL to present them from the emulation loop.
+    triple_buffer_t *frames;
+    uint64_t max_cycles;
+    int turbo;
+    // Frames kept by the performance counters, 0 to leave them off. They
+    // count the thread that opens them, so the emulation loop does.
+    size_t perf_frames;
+    perf_counters_t *perf;
+    int metrics;
+    uint64_t frames_run, idle_frames;
+    // Key events from the backend, polled by whichever thread presents.
+    key_ring_t keys;
+    // Key followed to the screen: host time it was pressed, 0 if none, the
+    // VM's key_reads then, and whether it has read the keypad since.
+    uint64_t probe_time;
+    uint32_t probe_reads;
+    int probe_read;
+    // Frames emulated ahead of the real one for display, 0 for none.
+    int run_ahead;
+    chip8_snapshot_t *snapshot;
+    uint64_t ahead_frames;
+    long rollback_ns;           // Spent saving and restoring snapshots.
+} emulator_t;
+
+static void stop(int signum)
+{
+    running = 0;
+}
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Set keyboard as non-buffered input, keys 0-F are read from stdin.
+static void set_raw_input()
+{
+    struct termios info;
+    if (tcgetattr(0, &info) != 0)
+        return;
+    info.c_lflag &= ~ICANON;      /* disable canonical mode */
+    info.c_cc[VMIN] = 1;          /* wait until at least one keystroke available */
+    info.c_cc[VTIME] = 0;         /* no timeout */
+    tcsetattr(0, TCSANOW, &info); /* set immediately */
+}
+
+// Last hex digit typed on stdin as a key, or -1. Never blocks.
+static int read_key()
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    int key = -1;
+    char c;
+
+    while (poll(&pfd, 1, 0) > 0 && read(0, &c, 1) == 1) {
+        if (c >= '0' && c <= '9') {
+            key = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            key = (c | 0x20) - 'a' + 10;
+        }
+    }
+    return key;
+}
+
+// Press a key on the keypad at a host time, and follow it to the screen
+// unless another key still is.
+static void press_key(emulator_t *emu, int key, uint64_t time)
+{
+    emu->vm->keycode = key;
+    if (!emu->probe_time || time - emu->probe_time > KEY_PROBE_NS) {
+        emu->probe_time = time;
+        emu->probe_reads = emu->vm->key_reads;
+        emu->probe_read = 0;
+    }
+}
+
+// A frame responding to a key pressed at key_time was just presented. That
+// is when the backend handed it over: the display's own delay isn't seen.
+static void key_to_photon(uint64_t key_time)
+{
+    metrics_observe(metrics_shard(), METRIC_KEY_TO_PHOTON, now_ns() - key_time);
+}
+
+// Hand the screen to the render thread, or present it from here. The first
+// frame drawn since the VM read the followed key is the one showing it, so
+// changed tells whether anything was drawn since the last one.
+static void present_frame(emulator_t *emu, metrics_shard_t *metrics, int changed)
+{
+    chip8_frame_t frame;
+    uint64_t tag = 0;
+
+    if (emu->probe_read && changed) {
+        tag = emu->probe_time;
+        emu->probe_time = 0;
+        emu->probe_read = 0;
+    }
+    chip8_frame(emu->vm, &frame);
+    if (emu->frames) {
+        if (triple_buffer_publish(emu->frames, &frame, tag) && metrics)
+            metrics_add(metrics, METRIC_DROPPED_FRAMES, 1);
+    } else {
+        backend_present(emu->backend, &frame);
+        if (tag)
+            key_to_photon(tag);
+    }
+}
+
+// Run-ahead: emulate run_ahead frames past the real one with the keys held
+// now, present the last, and roll back. ROMs commonly read keys a frame or
+// more before drawing the result, and that delay is hidden as long as the
+// keys don't change in between. A mispredicted frame is simply replaced by
+// the next one, so every host frame is presented. Sound, metrics and
+// performance counters only follow the real frames.
+static void run_ahead(emulator_t *emu, metrics_shard_t *metrics)
+{
+    chip8_t *vm = emu->vm;
+    const long start = now_ns();
+
+    chip8_save(vm, emu->snapshot);
+    const long saved = now_ns();
+    for (int i = 0; i < emu->run_ahead; i++)
+        chip8_run_frame(vm);
+    emu->ahead_frames += emu->run_ahead;
+    if (emu->probe_time && vm->key_reads != emu->probe_reads)
+        emu->probe_read = 1;
+    present_frame(emu, metrics, vm->vRamChanged);
+    const long restore = now_ns();
+    chip8_restore(vm, emu->snapshot);
+    emu->rollback_ns += saved - start + now_ns() - restore;
+}
+
+// Emulated time in microseconds, one tick being 1/60s.
+static uint64_t emulated_us(const chip8_t *vm)
+{
+    return vm->cycles * 1000000 / (60 * vm->cycles_per_tick);
+}
+
+static void sleep_until(long deadline)
+{
+    struct timespec ts = { deadline / 1000000000L, deadline % 1000000000L };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && running)
+        ;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: chip8-main [--backend <name>[:<arg>]] [--cycles <n>] [--lazy-flags]\n"
+                    "                  [--turbo] [--no-skip-idle] [--gdb <port|path>]\n"
+                    "                  [--quirks <profile|auto>] [--pack <file>] [--sync]\n"
+                    "                  [--perf] [--perf-csv <file>] [--metrics <port|path>]\n"
+                    "                  [--run-ahead <frames>] [<rom>]\n");
+    fprintf(stderr, "With --pack, <rom> is the hash of a ROM in the pack, see chip8-pack -l.\n");
+    fprintf(stderr, "With --perf, host performance counters are read around each frame and\n"
+                    "summarised at exit. --perf-csv also writes the last %d frames to a file.\n", PERF_FRAMES);
+    fprintf(stderr, "Keys 0-F are typed on stdin, or held on 1234/QWER/ASDF/ZXCV with the sdl\n"
+                    "backend. The latency from a key to the frame showing it is reported at exit.\n");
+    fprintf(stderr, "With --metrics, metrics are served over HTTP in Prometheus text format.\n");
+    fprintf(stderr, "With --run-ahead, the frame shown is emulated up to %d frames ahead with the\n"
+                    "keys held, then rolled back, hiding ROMs' delay from input to display.\n", MAX_RUN_AHEAD);
+    fprintf(stderr, "With --sync, every frame is presented from the emulation thread, e.g. to save\n"
+                    "each one with the png backend. The newest one is presented otherwise.\n");
+    fprintf(stderr, "Quirk profiles:");
+    for (int i = 0; i < NUM_QUIRK_PROFILES; i++)
+        fprintf(stderr, " %s", chip8_quirk_names[i]);
+    fprintf(stderr, " auto (default: picked from the ROM's code)\n");
+    fprintf(stderr, "Backends:\n");
+    list_backends(stderr);
+    exit(1);
+}
+
+// One frame is one timer tick. Without --turbo frames are paced at 60Hz
+// and the host sleeps for the rest of each one, which is most of it when
+// the ROM is waiting in an idle loop.
+static void* emulate(void *arg)
+{
+    emulator_t *emu = (emulator_t*) arg;
+    chip8_t *vm = emu->vm;
+    long last = now_ns(), deadline = last;
+    long frame_start = 0, key_time = 0;
+    int beeping = 0, held = 0;
+    metrics_shard_t *metrics = emu->metrics ? metrics_shard() : NULL;
+
+    if (emu->perf_frames > 0)
+        emu->perf = create_perf_counters(emu->perf_frames);
+    while (running && (emu->max_cycles == 0 || vm->cycles < emu->max_cycles)) {
+        const uint64_t cycles = vm->cycles;
+        if (metrics) {
+            const long now = now_ns();
+            if (frame_start)
+                metrics_observe(metrics, METRIC_FRAME_TIME, now - frame_start);
+            if (key_time)
+                metrics_observe(metrics, METRIC_INPUT_LATENCY, now - key_time);
+            frame_start = now;
+            key_time = 0;
+        }
+        if (emu->perf)
+            perf_begin(emu->perf, vm);
+        const int idle = emu->stub ? gdb_run_frame(emu->stub, vm) : chip8_run_frame(vm);
+        if (emu->perf)
+            perf_end(emu->perf, vm);
+        if (idle < 0)
+            break;
+        if (metrics) {
+            metrics_add(metrics, METRIC_INSTRUCTIONS, vm->cycles - cycles);
+            metrics_add(metrics, METRIC_FRAMES, 1);
+        }
+        emu->idle_frames += idle;
+        emu->frames_run++;
+        if (emu->probe_time && vm->key_reads != emu->probe_reads)
+            emu->probe_read = 1;
+
+        if ((vm->sound_timer > 0) != beeping) {
+            beeping = !beeping;
+            backend_sound(emu->backend, beeping, emulated_us(vm));
+        }
+
+        if (emu->turbo) {
+            if (emu->frames_run % FRAMES_PER_CHECK != 0)
+                continue;
+            const long now = now_ns();
+            if (now - last < FRAME_NS)
+                continue;
+            last = now;
+        } else {
+            // Don't try to catch up after being stopped in the debugger.
+            deadline += FRAME_NS;
+            if (now_ns() - deadline > FRAME_NS)
+                deadline = now_ns();
+            sleep_until(deadline);
+        }
+
+        if (emu->run_ahead > 0) {
+            run_ahead(emu, metrics);
+            vm->vRamChanged = 0;
+        } else if (vm->vRamChanged) {
+            present_frame(emu, metrics, 1);
+            vm->vRamChanged = 0;
+        }
+        if (!emu->frames && !backend_poll(emu->backend))
+            break;
+        key_event_t event;
+        while (key_ring_pop(&emu->keys, &event)) {
+            if (event.down) {
+                press_key(emu, event.key, event.time);
+                key_time = event.time;
+                held = 0;
+            } else if (vm->keycode == event.key) {
+                vm->keycode = NO_KEY;
+            }
+        }
+        const int key = read_key();
+        if (key >= 0) {
+            key_time = now_ns();
+            press_key(emu, key, key_time);
+            held = KEY_HOLD_FRAMES;
+        } else if (held > 0 && --held == 0) {
+            vm->keycode = NO_KEY;
+        }
+    }
+    running = 0;
+    return NULL;
+}
 
 int main(int argc, char* argv[])
 {
-    SDL_Event event;
-    SDL_Renderer *renderer;
-    SDL_Window *window;
+    const char* filename = "roms/pong.rom";
+    const char* spec = "sdl";
+    uint64_t max_cycles = 0;
+    int lazy_flags = 0;
+    int turbo = 0;
+    int skip_idle = 1;
+    const char* gdb = NULL;
+    int quirks = -1;
+    const char* pack_name = NULL;
+    int sync = 0;
+    size_t perf_frames = 0;
+    const char* perf_csv = NULL;
+    const char* metrics_spec = NULL;
+    int ahead = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+            spec = argv[++i];
+        } else if (!strcmp(argv[i], "--cycles") && i + 1 < argc) {
+            max_cycles = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--lazy-flags")) {
+            lazy_flags = 1;
+        } else if (!strcmp(argv[i], "--turbo")) {
+            turbo = 1;
+        } else if (!strcmp(argv[i], "--no-skip-idle")) {
+            skip_idle = 0;
+        } else if (!strcmp(argv[i], "--gdb") && i + 1 < argc) {
+            gdb = argv[++i];
+        } else if (!strcmp(argv[i], "--quirks") && i + 1 < argc) {
+            if (strcmp(argv[++i], "auto") != 0 && (quirks = chip8_find_quirks(argv[i])) < 0)
+                usage();
+        } else if (!strcmp(argv[i], "--pack") && i + 1 < argc) {
+            pack_name = argv[++i];
+        } else if (!strcmp(argv[i], "--perf")) {
+            perf_frames = PERF_FRAMES;
+        } else if (!strcmp(argv[i], "--perf-csv") && i + 1 < argc) {
+            perf_frames = PERF_FRAMES;
+            perf_csv = argv[++i];
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metrics_spec = argv[++i];
+        } else if (!strcmp(argv[i], "--run-ahead") && i + 1 < argc) {
+            ahead = atoi(argv[++i]);
+            if (ahead < 0 || ahead > MAX_RUN_AHEAD)
+                usage();
+        } else if (!strcmp(argv[i], "--sync")) {
+            sync = 1;
+        } else if (!strcmp(argv[i], "--term")) {
+            spec = "term";
+        } else if (!strcmp(argv[i], "--braille")) {
+            spec = "braille";
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            filename = argv[i];
+        }
+    }
 
     chip8_t vm;
+    chip8_frame_t frame;
 
-    chip8_initialize(&vm);
-    chip8_loadgame(&vm, "roms/pong.rom");
+    // The ROM is mapped once, from its own file or from the pack, and both
+    // analysed and copied into memory from there.
+    rom_pack_t *pack = NULL;
+    const uint8_t *rom;
+    size_t size;
+    if (pack_name) {
+        pack = open_rom_pack(pack_name);
+        rom = rom_pack_find(pack, strtoull(filename, NULL, 16), &size);
+        if (!rom) {
+            fprintf(stderr, "ROM %s not in pack %s\n", filename, pack_name);
+            exit(1);
+        }
+    } else {
+        rom = (const uint8_t*) mapfile(filename, &size);
+    }
 
-    chip8_renderScreen(&vm);
+    chip8_initialize_vm(&vm);
+    if (chip8_load_rom(&vm, rom, size) < 0) {
+        fprintf(stderr, "ROM too large: %s, %zu bytes, at most %d\n", filename, size, MAX_ROM_SIZE);
+        exit(1);
+    }
+    vm.lazy_flags = lazy_flags;
+    vm.skip_idle = skip_idle;
+    vm.quirks = quirks;
+    if (quirks < 0) {
+        // Pick the profile and engine from the ROM, flags given on the
+        // command line still win.
+        rom_analysis_t analysis;
+        const int cached = rom_analyse_cached(rom_cache_path(), rom, size, &analysis);
 
-    for (;;) {
-        chip8_emulateCycle(&vm);
+        char features[256];
+        rom_feature_names(analysis.features, features, sizeof(features));
+        fprintf(stderr, "ROM %016llx%s: %s profile%s%s (%s)\n", (unsigned long long) analysis.hash,
+                cached ? ", cached" : "", chip8_quirk_names[analysis.quirks],
+                analysis.lazy_flags ? ", lazy flags" : "", analysis.skip_idle ? ", idle skip" : "",
+                features);
+        rom_apply(&analysis, &vm);
+        vm.lazy_flags |= lazy_flags;
+        vm.skip_idle &= skip_idle;
+    }
+    if (pack)
+        close_rom_pack(pack);
+    else
+        unmapfile((const char*) rom, size);
+    vm.rng = time(NULL) | 1;
+    chip8_frame(&vm, &frame);
 
-        if (SDL_PollEvent(&event) && event.type == SDL_QUIT)
-            break;
+    chip8_backend_t *backend = create_backend(spec, frame.width, frame.height);
+    if (!backend) {
+        fprintf(stderr, "Unknown backend: %s\n", spec);
+        usage();
+    }
+    set_raw_input();
+
+    gdb_stub_t *stub = NULL;
+    if (gdb) {
+        stub = create_gdb_stub(gdb);
+        fprintf(stderr, "Waiting for gdb connections on %s\n", gdb);
     }
 
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    backend_present(backend, &frame);
+
+    metrics_server_t *metrics = metrics_spec ? create_metrics_server(metrics_spec) : NULL;
+    emulator_t emu = {
+        .vm = &vm,
+        .backend = backend,
+        .stub = stub,
+        .max_cycles = max_cycles,
+        .turbo = turbo,
+        .perf_frames = perf_frames,
+        .metrics = metrics != NULL,
+        .run_ahead = ahead,
+    };
+    backend->keys = &emu.keys;
+    if (ahead > 0) {
+        emu.snapshot = (chip8_snapshot_t*) aligned_alloc(RAM_PAGE_SIZE, sizeof(chip8_snapshot_t));
+        emu.snapshot->valid = 0;
+    }
+    const long start = now_ns();
+    if (sync) {
+        emulate(&emu);
+    } else {
+        // Emulation gets a thread of its own. This one, which created the
+        // window, presents the newest frame and handles host events, so a
+        // slow present or a vsync wait never holds up emulation.
+        static triple_buffer_t frames;
+        triple_buffer_init(&frames);
+        emu.frames = &frames;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, emulate, &emu) != 0) {
+            fprintf(stderr, "Couldn't start the emulation thread\n");
+            exit(1);
+        }
+        // A frame can carry the same key as the one before it, when it
+        // replaced one the renderer missed.
+        uint64_t tag, shown = 0;
+        while (running) {
+            if (triple_buffer_acquire(&frames, &frame, &tag)) {
+                backend_present(backend, &frame);
+                if (tag && tag != shown) {
+                    key_to_photon(tag);
+                    shown = tag;
+                }
+            } else
+                sleep_until(now_ns() + RENDER_POLL_NS);
+            if (!backend_poll(backend))
+                running = 0;
+        }
+        pthread_join(thread, NULL);
+        if (triple_buffer_acquire(&frames, &frame, &tag))
+            backend_present(backend, &frame);
+    }
+
+    const double elapsed = (now_ns() - start) / 1e9;
+    delete_backend(backend);
+    if (stub)
+        delete_gdb_stub(stub);
+    if (metrics)
+        delete_metrics_server(metrics);
+
+    fprintf(stderr, "%llu cycles in %.3fs (%.2f MIPS)\n",
+            (unsigned long long) vm.cycles, elapsed, elapsed > 0 ? vm.cycles / elapsed / 1e6 : 0);
+    fprintf(stderr, "%llu frames, %llu idle, %llu cycles skipped\n",
+            (unsigned long long) emu.frames_run, (unsigned long long) emu.idle_frames,
+            (unsigned long long) vm.idle_cycles);
+    if (emu.snapshot) {
+        fprintf(stderr, "Run-ahead: %llu frames speculated, %.2fus per snapshot and rollback\n",
+                (unsigned long long) emu.ahead_frames,
+                emu.ahead_frames ? emu.rollback_ns / 1e3 / (emu.ahead_frames / emu.run_ahead) : 0);
+        free(emu.snapshot);
+    }
+    if (metrics_count(METRIC_KEY_TO_PHOTON) > 0) {
+        fprintf(stderr, "Key to photon latency over %llu keys: p50 < %.1fms, p90 < %.1fms, p99 < %.1fms\n",
+                (unsigned long long) metrics_count(METRIC_KEY_TO_PHOTON),
+                metrics_quantile(METRIC_KEY_TO_PHOTON, 0.5) / 1e6,
+                metrics_quantile(METRIC_KEY_TO_PHOTON, 0.9) / 1e6,
+                metrics_quantile(METRIC_KEY_TO_PHOTON, 0.99) / 1e6);
+    }
+    if (emu.perf) {
+        perf_write_summary(emu.perf, stderr);
+        FILE *fp = perf_csv ? fopen(perf_csv, "w") : NULL;
+        if (fp) {
+            perf_write_csv(emu.perf, fp);
+            fclose(fp);
+        } else if (perf_csv) {
+            fprintf(stderr, "Couldn't create file: %s\n", perf_csv);
+        }
+        delete_perf_counters(emu.perf);
+    }
 
     return EXIT_SUCCESS;
 }
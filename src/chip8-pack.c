@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+#include "rompack.h"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: chip8-pack <pack> <rom>...   Write the ROMs to a new pack\n"
+                    "       chip8-pack -l <pack>         List the ROMs in a pack\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "-l")) {
+        rom_pack_t *pack = open_rom_pack(argv[2]);
+        for (size_t i = 0; i < pack->count; i++) {
+            const rom_pack_entry_t *entry = &pack->index[i];
+            printf("%016llx %6llu%s\n", (unsigned long long) entry->hash, (unsigned long long) entry->size,
+                   entry->size > MAX_ROM_SIZE ? " (too large)" : "");
+        }
+        close_rom_pack(pack);
+        return EXIT_SUCCESS;
+    }
+    if (argc < 3 || argv[1][0] == '-')
+        usage();
+
+    const size_t count = write_rom_pack(argv[1], (const char**) argv + 2, argc - 2);
+    fprintf(stderr, "%zu ROMs, %d duplicates\n", count, (int) (argc - 2 - count));
+    return EXIT_SUCCESS;
+}
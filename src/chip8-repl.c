@@ -4,12 +4,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "chip8-vm.h"
+#include "debugger.h"
 #include "parser.h"
 #include "util.h"
 
 #define PROMPT "> "
+// Cycles executed by .run without an argument.
+#define RUN_CYCLES 1000000
 
 enum Commands {
     SOURCE, DUMP, HELP, SAVE
@@ -17,19 +21,122 @@ enum Commands {
 
 static void help(chip8_t* vm, const char *args);
 
+static chip8_debugger_t debugger;
+// Bytes loaded at PC_START by the last .load.
+static size_t program_size;
+
+// Statistics of the last .run, .step or .continue, to compare the speed of
+// running under the debugger with .run.
+static struct {
+    uint64_t cycles;
+    uint64_t frames;
+    double seconds;
+} last_run;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int has_suffix(const char *str, const char *suffix)
+{
+    size_t len = strlen(str), n = strlen(suffix);
+    return len >= n && !strcmp(str + len - n, suffix);
+}
+
+static char* first_argument(const char *args)
+{
+    args += strspn(args, " \t");
+    return strndup(args, strcspn(args, " \t\r\n"));
+}
+
+// Load a ROM, or assemble a source file (.s, .asm), at PC_START. The VM is
+// reset, breakpoints and watchpoints are kept.
 static void load(chip8_t* vm, const char *args)
 {
-    char* filename = first_word((char*) args);
-    fprintf(stdout, "load %s\n", filename);
+    char* filename = first_argument(args);
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("Couldn't open %s\n", filename);
+        free(filename);
+        return;
+    }
+
+    const size_t capacity = RAM_MEMORY - PC_START;
+    uint8_t* buffer = (uint8_t*) malloc(RAM_MEMORY + 2);
+    size_t size = fread(buffer, 1, RAM_MEMORY, fp);
+    fclose(fp);
+
+    if (has_suffix(filename, ".s") || has_suffix(filename, ".asm")) {
+        uint8_t* output = (uint8_t*) malloc(size + 2);
+        size = assembler_assemble((const char*) buffer, size, output);
+        free(buffer);
+        buffer = output;
+    }
+
+    if (size > capacity) {
+        printf("Program too large: %zu bytes, at most %zu\n", size, capacity);
+    } else {
+        chip8_initialize_vm(vm);
+        memcpy(vm->ram + PC_START, buffer, size);
+        program_size = size;
+        printf("Loaded %zu bytes at 0x%x\n", size, PC_START);
+    }
+    free(buffer);
+    free(filename);
 }
 
+// Save the memory of the loaded program as a ROM.
 static void save(chip8_t* vm, const char *args)
 {
-    fprintf(stdout, "save %s\n", args);
+    char* filename = first_argument(args);
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Couldn't open %s\n", filename);
+    } else {
+        fwrite(vm->ram + PC_START, 1, program_size, fp);
+        fclose(fp);
+        printf("Saved %zu bytes to %s\n", program_size, filename);
+    }
+    free(filename);
+}
+
+// Run without breakpoints or a display, whole frames at a time.
+static void run(chip8_t* vm, const char *args)
+{
+    long long n = strtoll(args, NULL, 10);
+    const uint64_t start = vm->cycles;
+    const uint64_t end = start + (n > 0 ? n : RUN_CYCLES);
+    uint64_t frames = 0;
+
+    const double t0 = now();
+    while (end - vm->cycles >= (uint64_t) (vm->cycles_per_tick - vm->tick_cycles)) {
+        chip8_run_frame(vm);
+        frames++;
+    }
+    while (vm->cycles < end) {
+        chip8_emulateCycle(vm);
+    }
+
+    last_run.seconds = now() - t0;
+    last_run.cycles = vm->cycles - start;
+    last_run.frames = frames;
+    printf("PC: 0x%x\n", vm->PC);
+}
+
+static void timing(chip8_t* vm, const char *args)
+{
+    const double mips = last_run.seconds > 0 ? last_run.cycles / last_run.seconds / 1e6 : 0;
+    printf("%llu cycles, %llu frames in %.3fs (%.2f MIPS)\n",
+           (unsigned long long) last_run.cycles, (unsigned long long) last_run.frames,
+           last_run.seconds, mips);
 }
 
 static void dump(chip8_t* vm, const char *args)
 {
+    chip8_sync_flags(vm);
     printf("PC: 0x%x, SP: 0x%x, I: 0x%x\n", vm->PC, vm->SP, vm->I);
     // Count how many registers are set.
     uint8_t count = 0;
@@ -54,12 +161,101 @@ static void dump(chip8_t* vm, const char *args)
     }
 }
 
+// Addresses are always hexadecimal, with or without 0x. Returns the rest of
+// the arguments, or NULL if there is no valid address.
+static const char* parse_address(const char *args, uint16_t *addr)
+{
+    char *end;
+    long value = strtol(args, &end, 16);
+    if (end == args || value < 0 || value >= RAM_MEMORY) {
+        printf("Invalid address\n");
+        return NULL;
+    }
+    *addr = value;
+    return end + strspn(end, " \t");
+}
+
+static void report_stop(chip8_t* vm, debug_stop_t stop)
+{
+    switch (stop) {
+        case STOP_BREAKPOINT:
+            printf("Breakpoint at 0x%x\n", vm->PC);
+            break;
+        case STOP_WATCHPOINT:
+            printf("Watchpoint: %s 0x%x, PC: 0x%x\n",
+                   debugger.stop_access == WATCH_WRITE ? "write" : "read",
+                   debugger.stop_addr, vm->PC);
+            break;
+        case STOP_CYCLES:
+            printf("PC: 0x%x\n", vm->PC);
+            break;
+    }
+}
+
+static void breakpoint(chip8_t* vm, const char *args)
+{
+    uint16_t addr;
+    if (!parse_address(args, &addr))
+        return;
+
+    const int enabled = !debugger_has_breakpoint(&debugger, addr);
+    debugger_set_breakpoint(&debugger, addr, enabled);
+    printf("Breakpoint %s at 0x%x\n", enabled ? "set" : "removed", addr);
+}
+
+static void watch(chip8_t* vm, const char *args)
+{
+    uint16_t addr;
+    const char *mode = parse_address(args, &addr);
+    if (!mode)
+        return;
+
+    uint8_t access = WATCH_READ | WATCH_WRITE;
+    if (!strncmp(mode, "off", 3)) {
+        access = 0;
+    } else if (mode[0] == 'r' && mode[1] != 'w') {
+        access = WATCH_READ;
+    } else if (mode[0] == 'w') {
+        access = WATCH_WRITE;
+    }
+    debugger_set_watch(&debugger, addr, access);
+    printf("Watchpoint %s at 0x%x\n", access ? "set" : "removed", addr);
+}
+
+static void debug_run(chip8_t* vm, uint64_t max_cycles)
+{
+    const uint64_t start = vm->cycles;
+    const uint16_t tick_cycles = vm->tick_cycles;
+
+    const double t0 = now();
+    const debug_stop_t stop = debugger_run(vm, &debugger, max_cycles);
+    last_run.seconds = now() - t0;
+    last_run.cycles = vm->cycles - start;
+    last_run.frames = (tick_cycles + last_run.cycles) / vm->cycles_per_tick;
+    report_stop(vm, stop);
+}
+
+static void cont(chip8_t* vm, const char *args)
+{
+    debug_run(vm, 0);
+}
+
+static void step(chip8_t* vm, const char *args)
+{
+    long n = strtol(args, NULL, 10);
+    debug_run(vm, n > 0 ? n : 1);
+}
+
 static void eval(chip8_t* vm, const char* line)
 {
     instr_t instr = empty_instr;
 
-    assembler_parse_line(&instr, line);
-    vm->opcode.value = assembler_compile_instruction(&instr);
+    if (assembler_parse_line(&instr, line) < 0)
+        return;
+    const int opcode = assembler_compile_instruction(&instr);
+    if (opcode < 0)
+        return;
+    vm->opcode.value = opcode;
     if (DEBUG)
         fprintf(stderr, "opcode: 0x%.4x\n", vm->opcode.value);
     chip8_evaluate_opcode(vm);
@@ -74,10 +270,16 @@ typedef struct {
 } command_t;
 
 command_t commands[] = {
+    { ".break", breakpoint, "Toggle a breakpoint at an address." },
+    { ".continue", cont, "Run until a breakpoint or watchpoint is hit." },
     { ".dump", dump, "Print out state of VM." },
     { ".help", help, "Print out this help." },
-    { ".load", load, "Load a program from a file." },
-    { ".save", save, "Save current program to a file." }
+    { ".load", load, "Load a ROM or assembly source (.s, .asm) at 0x200." },
+    { ".run", run, "Run N cycles headless, 1000000 by default." },
+    { ".save", save, "Save current program to a file." },
+    { ".step", step, "Run N instructions, 1 by default." },
+    { ".time", timing, "Print out cycles, frames and speed of the last run, step or continue." },
+    { ".watch", watch, "Watch an address for r, w or rw access, off to remove." }
 };
 
 static void help(chip8_t* vm, const char *args)
@@ -110,6 +312,11 @@ void execute_command(chip8_t *vm, const command_t* cmd, char* line)
 
 void parse_line(chip8_t* vm, char *line, ssize_t len)
 {
+    // Skip blank lines and comments.
+    const char* start = line + strspn(line, " \t");
+    if (*start == '\0' || *start == '\n' || *start == ';')
+        return;
+
     command_t* cmd = lookup_command(line);
     if (cmd) {
         execute_command(vm, cmd, line);
@@ -118,21 +325,42 @@ void parse_line(chip8_t* vm, char *line, ssize_t len)
     }
 }
 
+// With a script argument, commands are read from that file without prompting
+// and the REPL exits at its end.
 int main(int argc, char* argv[])
 {
     size_t len = 256;
-    char filename[len];
+    FILE* input = stdin;
     chip8_t vm;
 
+    if (argc > 2) {
+        fprintf(stderr, "Usage: chip8-repl [<script>]\n");
+        exit(1);
+    }
+    if (argc == 2) {
+        input = fopen(argv[1], "r");
+        if (!input) {
+            fprintf(stderr, "Couldn't open %s\n", argv[1]);
+            exit(1);
+        }
+    }
+
     chip8_initialize_vm(&vm);
+    debugger_init(&debugger);
 
     char* line = (char*) calloc(len, sizeof(char));
     ssize_t linesize;
 
     for (;;) {
-        fprintf(stdout, "%s", PROMPT);
-        linesize = getline(&line, &len, stdin);
+        if (input == stdin)
+            fprintf(stdout, "%s", PROMPT);
+        linesize = getline(&line, &len, input);
+        if (linesize < 0)
+            break;
         parse_line(&vm, line, linesize);
     }
+    free(line);
+    if (input != stdin)
+        fclose(input);
     return 0;
 }
@@ -1,10 +1,28 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sys/un.h>
 
 #include "chip8-vm.h"
 #include "parser.h"
+#include "cfg.h"
+#include "debugger.h"
+#include "gdbstub.h"
+#include "sound-ring.h"
+#include "triple-buffer.h"
+#include "analyser.h"
+#include "rompack.h"
+#include "ram-image.h"
+#include "job.h"
+#include "scheduler.h"
+#include "perf.h"
+#include "metrics.h"
+#include "util.h"
 
 typedef void (*test_fn_t)(chip8_t*);
 
@@ -59,7 +77,7 @@ void test_call(chip8_t* vm)
 {
     vm->opcode.value = 0x0AAA;
     chip8_evaluate_opcode_name("CALL", vm);
-    assert(vm->SP == 1 && vm->stack[vm->SP] == 0x200 && vm->PC == 0xAAA);
+    assert(vm->SP == 1 && vm->stack[vm->SP] == 0x202 && vm->PC == 0xAAA);
 }
 
 void test_ske(chip8_t* vm)
@@ -260,7 +278,7 @@ void test_addi(chip8_t* vm)
     vm->V[0] = 0x1;
     vm->I = 0x0FFF;
     chip8_evaluate_opcode_name("ADDI", vm);
-    assert(vm->PC == 0x202 && vm->I == 0x0 && vm->V[0xF] == 1);
+    assert(vm->PC == 0x202 && vm->I == 0x1000 && vm->V[0xF] == 1);
 }
 
 void test_bcd(chip8_t* vm)
@@ -304,14 +322,71 @@ void test_pop(chip8_t* vm)
 
 void test_waitkey(chip8_t* vm)
 {
+    vm->opcode.value = 0xF30A;
     chip8_evaluate_opcode_name("KEYD", vm);
-    assert(vm->PC == 0x202);
+    assert(vm->PC == 0x200 && vm->key_wait && vm->key_reads == 0);
+    vm->keycode = 0x7;
+    chip8_evaluate_opcode_name("KEYD", vm);
+    assert(vm->PC == 0x202 && !vm->key_wait && vm->V[3] == 0x7 && vm->key_reads == 1);
 }
 
 void test_spritei(chip8_t* vm)
 {
+    vm->opcode.value = 0xF029;
+    vm->V[0] = 0xA;
     chip8_evaluate_opcode_name("LDSPR", vm);
-    assert(vm->PC == 0x202);
+    assert(vm->PC == 0x202 && vm->I == 50 && vm->ram[vm->I] == 0xF0);
+}
+
+// Drawing wraps around the packed rows and lores pixels cover 2x2.
+void test_draw(chip8_t* vm)
+{
+    chip8_frame_t frame;
+
+    vm->ram[0x300] = 0x81;
+    vm->I = 0x300;
+    vm->V[0] = 60;
+    vm->V[1] = 31;
+    vm->opcode.value = 0xD011;
+    chip8_evaluate_opcode_name("DRAW", vm);
+    assert(vm->PC == 0x202 && vm->V[0xF] == 0);
+    assert(vm->planes[0][62] == ((chip8_row_t) 0x3 << 120 | 0xC0) && vm->planes[0][63] == vm->planes[0][62]);
+
+    chip8_frame(vm, &frame);
+    assert(frame.width == 64 && frame.height == 32);
+    assert(frame.pixels[31 * 64 + 60] == 1 && frame.pixels[31 * 64 + 3] == 1);
+    assert(frame.pixels[31 * 64 + 61] == 0 && frame.pixels[31 * 64 + 4] == 0);
+
+    chip8_evaluate_opcode_name("DRAW", vm);
+    assert(vm->V[0xF] == 1 && vm->planes[0][62] == 0);
+}
+
+// 16x16 sprites in high resolution, then scrolled.
+void test_hires(chip8_t* vm)
+{
+    chip8_frame_t frame;
+
+    vm->opcode.value = 0x00FF;
+    chip8_evaluate_opcode_name("HIGH", vm);
+    chip8_frame(vm, &frame);
+    assert(vm->hires && frame.width == 128 && frame.height == 64);
+
+    memset(vm->ram + 0x300, 0xFF, 32);
+    vm->I = 0x300;
+    vm->V[0] = 120;
+    vm->V[1] = 0;
+    vm->opcode.value = 0xD010;
+    chip8_evaluate_opcode_name("DRAW", vm);
+    const chip8_row_t row = (chip8_row_t) 0xFF << 120 | 0xFF;
+    assert(vm->planes[0][0] == row && vm->planes[0][15] == row && vm->planes[0][16] == 0);
+
+    vm->opcode.value = 0x00C2;
+    chip8_evaluate_opcode_name("SCD", vm);
+    assert(vm->planes[0][1] == 0 && vm->planes[0][2] == row && vm->planes[0][17] == row);
+
+    vm->opcode.value = 0x00FC;
+    chip8_evaluate_opcode_name("SCL", vm);
+    assert(vm->planes[0][2] == (row << 4) && vm->PC == 0x208);
 }
 
 void test_opcode(const char* name, test_fn_t test_fn)
@@ -443,8 +518,10 @@ void opcode_tests()
     test_opcode("BCD", test_bcd);
     test_opcode("PUSH", test_push);
     test_opcode("POP", test_pop);
-    // test_opcode("WAITKEY", test_waitkey);
-    // test_opcode("SPRITEI", test_spritei);
+    test_opcode("WAITKEY", test_waitkey);
+    test_opcode("SPRITEI", test_spritei);
+    test_opcode("DRAW", test_draw);
+    test_opcode("HIGH", test_hires);
 }
 
 
@@ -500,12 +577,1017 @@ void parsing_tests()
     ));
 }
 
+void test_assemble(const char* source, const uint8_t* expected, size_t size)
+{
+    uint8_t output[256];
+
+    printf("Assemble '%.*s': ", (int) strcspn(source, "\n"), source);
+    size_t actual = assembler_assemble(source, strlen(source), output);
+    if (actual != size || memcmp(output, expected, size) != 0) {
+        printf("Error\n");
+        for (size_t i = 0; i < actual; i++)
+            printf("%02x", output[i]);
+        printf("\n");
+        exit(1);
+    }
+    printf("Ok\n");
+}
+
+void assembler_tests()
+{
+    printf("\nAssembler tests\n");
+
+    printf("Lookup mnemonics: ");
+    for (size_t i = 0; i < NUM_INSTRUCTIONS; i++) {
+        assert(assembler_lookup_mnemonic(instructions[i], strlen(instructions[i])) == i);
+    }
+    assert(assembler_lookup_mnemonic("NOPE", 4) == -1);
+    assert(assembler_lookup_mnemonic("LOADX", 5) == -1);
+    assert(assembler_lookup_mnemonic("LOAD", 3) == -1);
+    printf("Ok\n");
+
+    test_assemble("LOAD #a, 0x02", (uint8_t[]) { 0x6a, 0x02 }, 2);
+    test_assemble("0x0200 LOAD #a, 0x02    ; 0x6a02\n", (uint8_t[]) { 0x6a, 0x02 }, 2);
+    test_assemble("DRAW #a, #b, 0x06\nRET\n", (uint8_t[]) { 0xda, 0xb6, 0x00, 0xee }, 4);
+    test_assemble("; comment\n\n  SUBB #1, #2\r\nLOADD #3", (uint8_t[]) { 0x81, 0x27, 0xf3, 0x15 }, 4);
+    test_assemble("CALL 0x2d4\nJUMP 21a\n", (uint8_t[]) { 0x22, 0xd4, 0x12, 0x1a }, 4);
+    test_assemble("loop: CALL draw\nJUMP loop\ndraw:\n  RET\n",
+                  (uint8_t[]) { 0x22, 0x04, 0x12, 0x00, 0x00, 0xee }, 6);
+    test_assemble("LOADI sprite\nJUMP end\nsprite: SYS 0x0ff\nend: JUMPI end",
+                  (uint8_t[]) { 0xa2, 0x04, 0x12, 0x06, 0x00, 0xff, 0xb2, 0x06 }, 8);
+    test_assemble("HIGH\nLONGI sprite\nSCD 0x4\nsprite: PLANE 0x3",
+                  (uint8_t[]) { 0x00, 0xff, 0xf0, 0x00, 0x02, 0x08, 0x00, 0xc4, 0xf3, 0x01 }, 10);
+}
+
+// Deterministic generator so failures can be reproduced.
+static uint32_t test_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Random opcode that doesn't block, branch or depend on the host.
+static uint16_t random_opcode(uint32_t *state)
+{
+    static const uint16_t templates[] = {
+        0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x8001, 0x8002,
+        0x8003, 0x8004, 0x8005, 0x8006, 0x8007, 0x800E, 0x9000, 0xA000,
+        0xD000, 0xF007, 0xF015, 0xF018, 0xF01E, 0xF033, 0xF055, 0xF065,
+        0x00E0,
+    };
+    // Bias towards the flag-producing operations.
+    static const uint16_t alu[] = { 0x8004, 0x8005, 0x8006, 0x8007, 0x800E };
+    const size_t n = sizeof(templates) / sizeof(templates[0]);
+
+    uint32_t r = test_random(state);
+    uint16_t opcode = (r & 1) ? alu[(r >> 1) % 5] : templates[(r >> 1) % n];
+    uint16_t operands = test_random(state) & 0x0FFF;
+
+    if (opcode == 0x00E0)
+        return opcode;
+    if ((opcode & 0xF000) == 0x8000 || (opcode & 0xF000) == 0x5000 || (opcode & 0xF000) == 0x9000)
+        return opcode | (operands & 0x0FF0);
+    if ((opcode & 0xF000) == 0xF000)
+        return opcode | (operands & 0x0F00);
+    return opcode | operands;
+}
+
+static void assert_same_state(const chip8_t* eager, const chip8_t* lazy, uint16_t opcode, int step)
+{
+    chip8_t synced = *lazy;
+    chip8_sync_flags(&synced);
+
+    if (memcmp(eager->V, synced.V, sizeof(eager->V)) || eager->I != synced.I ||
+        eager->PC != synced.PC || memcmp(eager->ram, synced.ram, sizeof(eager->ram)) ||
+        memcmp(eager->planes, synced.planes, sizeof(eager->planes)) ||
+        eager->delay_timer != synced.delay_timer || eager->sound_timer != synced.sound_timer) {
+        fatal("Error\nState differs after step %d (opcode 0x%.4x)\n", step, opcode);
+    }
+}
+
+void test_lazy_flags_differential(uint32_t seed, int steps)
+{
+    chip8_t eager, lazy;
+
+    chip8_initialize_vm(&eager);
+    chip8_initialize_vm(&lazy);
+    lazy.lazy_flags = 1;
+
+    printf("Lazy flags, seed 0x%x: ", seed);
+    for (int i = 0; i < steps; i++) {
+        uint16_t opcode = random_opcode(&seed);
+
+        // Keep I within RAM for the memory instructions.
+        eager.I &= 0x7FF;
+        lazy.I &= 0x7FF;
+        eager.PC = lazy.PC = PC_START;
+        eager.opcode.value = lazy.opcode.value = opcode;
+
+        chip8_evaluate_opcode(&eager);
+        chip8_evaluate_opcode(&lazy);
+        assert_same_state(&eager, &lazy, opcode, i);
+    }
+    printf("Ok\n");
+}
+
+void lazy_flags_tests()
+{
+    printf("\nLazy flags tests\n");
+
+    test_lazy_flags_differential(0x2545F491, 200000);
+    test_lazy_flags_differential(0xC0FFEE, 200000);
+    test_lazy_flags_differential(0x1, 200000);
+}
+
+void test_idle_skip_differential(uint16_t cycles_per_tick)
+{
+    const char* source =
+        "LOAD #0, 0x20\n"
+        "LOADD #0\n"
+        "wait: MOVED #1\n"
+        "SKE #1, 0x05\n"
+        "JUMP wait\n"
+        "ADD #2, 0x01\n"
+        "LOAD #0, 0x07\n"
+        "LOADD #0\n"
+        "wait2: MOVED #f\n"
+        "SKE #f, 0x00\n"
+        "JUMP wait2\n"
+        "end: JUMP end\n";
+    chip8_t normal, skipping;
+
+    printf("Idle skip, %d cycles per tick: ", cycles_per_tick);
+    chip8_initialize_vm(&normal);
+    assembler_assemble(source, strlen(source), normal.ram + PC_START);
+    normal.cycles_per_tick = cycles_per_tick;
+    skipping = normal;
+    skipping.skip_idle = 1;
+
+    int idle_frames = 0;
+    for (int frame = 0; frame < 200; frame++) {
+        chip8_run_frame(&normal);
+        idle_frames += chip8_run_frame(&skipping);
+        if (memcmp(normal.V, skipping.V, sizeof(normal.V)) || normal.PC != skipping.PC ||
+            normal.I != skipping.I || normal.delay_timer != skipping.delay_timer ||
+            normal.cycles != skipping.cycles || normal.tick_cycles != skipping.tick_cycles) {
+            fatal("Error\nState differs after frame %d\n", frame);
+        }
+    }
+    assert(normal.V[2] == 1 && normal.PC == 0x216);
+    assert(idle_frames > 150 && skipping.idle_cycles > 0 && normal.idle_cycles == 0);
+    printf("Ok\n");
+}
+
+void idle_tests()
+{
+    printf("\nIdle loop tests\n");
+
+    test_idle_skip_differential(CYCLES_PER_TICK);
+    test_idle_skip_differential(7);
+    test_idle_skip_differential(1000);
+
+    printf("Key poll: ");
+    const char* source = "LOAD #0, 0x05\nwait: SKPR #0\nJUMP wait\nend: JUMP end\n";
+    chip8_t normal, skipping;
+    chip8_initialize_vm(&normal);
+    assembler_assemble(source, strlen(source), normal.ram + PC_START);
+    skipping = normal;
+    skipping.skip_idle = 1;
+    for (int frame = 0; frame < 10; frame++) {
+        if (frame == 7)
+            normal.keycode = skipping.keycode = 0x5;
+        chip8_run_frame(&normal);
+        chip8_run_frame(&skipping);
+        assert(normal.key_reads == skipping.key_reads && normal.PC == skipping.PC);
+    }
+    assert(normal.PC == 0x206 && skipping.idle_cycles > 0 && normal.key_reads > 7 * CYCLES_PER_TICK / 3);
+    printf("Ok\n");
+}
+
+#define NUM_TASKS 16
+
+void scheduler_tests()
+{
+    const char* spin = "loop: ADD #1, 0x01\nJUMP loop\n";
+    const char* wait = "KEYD #3\nend: JUMP end\n";
+    static chip8_t vms[NUM_TASKS];
+
+    printf("\nScheduler tests\n");
+
+    printf("Run until yield: ");
+    for (int i = 0; i < NUM_TASKS; i++) {
+        chip8_initialize_vm(&vms[i]);
+        const char* source = i % 2 ? wait : spin;
+        assembler_assemble(source, strlen(source), vms[i].ram + PC_START);
+    }
+    chip8_t vm = vms[0];
+    assert(chip8_run(&vm, 4) == YIELD_SLICE && vm.cycles == 4 && vm.V[1] == 2);
+    assert(chip8_run(&vm, 100) == YIELD_FRAME && vm.cycles == CYCLES_PER_TICK);
+    vm = vms[1];
+    assert(chip8_run(&vm, 100) == YIELD_KEY && vm.PC == PC_START && vm.cycles == 1);
+    assert(chip8_run(&vm, 100) == YIELD_KEY && vm.cycles == 2);
+    printf("Ok\n");
+
+    printf("Tasks: ");
+    scheduler_t* sched = create_scheduler(3);
+    for (int i = 0; i < NUM_TASKS; i++)
+        assert(scheduler_add(sched, &vms[i]) == i);
+    // Spinning tasks take 3 + 3 + 3 + 1 cycles, waiting ones a single one.
+    assert(scheduler_run_frame(sched) == NUM_TASKS / 2 * 4 + NUM_TASKS / 2);
+    assert(scheduler_state(sched, 0) == TASK_FRAME_DONE && vms[0].cycles == CYCLES_PER_TICK);
+    assert(scheduler_state(sched, 1) == TASK_KEY_WAIT && vms[1].cycles == CYCLES_PER_TICK);
+    scheduler_key(sched, 1, 0x7);
+    assert(scheduler_state(sched, 1) == TASK_READY);
+    scheduler_run_frame(sched);
+    assert(vms[1].V[3] == 0x7 && vms[1].PC == PC_START + 2 && vms[1].cycles == 2 * CYCLES_PER_TICK);
+    assert(vms[0].cycles == 2 * CYCLES_PER_TICK && vms[3].cycles == 2 * CYCLES_PER_TICK);
+    scheduler_remove(sched, 2);
+    assert(scheduler_state(sched, 2) == TASK_FREE && scheduler_add(sched, &vms[2]) == 2);
+    delete_scheduler(sched);
+    printf("Ok\n");
+
+    printf("Timers while parked: ");
+    const char* timed = "LOAD #0, 0x05\nLOADD #0\nKEYD #3\nend: JUMP end\n";
+    chip8_t reference;
+    chip8_initialize_vm(&reference);
+    assembler_assemble(timed, strlen(timed), reference.ram + PC_START);
+    vm = reference;
+    sched = create_scheduler(3);
+    scheduler_add(sched, &vm);
+    for (int frame = 0; frame < 4; frame++) {
+        chip8_run_frame(&reference);
+        scheduler_run_frame(sched);
+        assert(scheduler_state(sched, 0) == TASK_KEY_WAIT && vm.delay_timer == 4 - frame &&
+               vm.delay_timer == reference.delay_timer && vm.cycles == reference.cycles);
+    }
+    scheduler_key(sched, 0, 0x2);
+    reference.keycode = 0x2;
+    chip8_run_frame(&reference);
+    scheduler_run_frame(sched);
+    assert(vm.V[3] == 0x2 && vm.PC == reference.PC && vm.cycles == reference.cycles);
+    delete_scheduler(sched);
+    printf("Ok\n");
+}
+
+// The same program under each profile, which sees every quirk.
+void test_quirks(int quirks, uint8_t vf, uint8_t v0, uint16_t i, int wrapped, uint16_t pc)
+{
+    const char* source =
+        "LOAD #1, 0x81\n"
+        "LOAD #f, 0x01\n"
+        "OR #2, #3\n"
+        "MOVE #4, #f\n"
+        "SHR #0, #1\n"
+        "LOADI 0x000\n"
+        "LOAD #6, 0x3e\n"
+        "DRAW #6, #7, 0x01\n"
+        "LOADI 0x300\n"
+        "PUSH #2\n"
+        "LOAD #5, 0x04\n"
+        "JUMPI 0x510\n";
+    chip8_t vm;
+    chip8_frame_t frame;
+
+    printf("Quirks %s: ", chip8_quirk_names[quirks]);
+    assert(chip8_find_quirks(chip8_quirk_names[quirks]) == quirks);
+    chip8_initialize_vm(&vm);
+    vm.quirks = quirks;
+    assembler_assemble(source, strlen(source), vm.ram + PC_START);
+    for (int step = 0; step < 12; step++) {
+        chip8_emulateCycle(&vm);
+    }
+    chip8_frame(&vm, &frame);
+    assert(vm.V[4] == vf && vm.V[0] == v0 && vm.I == i && vm.PC == pc);
+    assert(frame.pixels[63] == 1 && frame.pixels[0] == wrapped);
+    printf("Ok\n");
+}
+
+static void analyse_source(const char* source, rom_analysis_t* analysis)
+{
+    uint8_t rom[256];
+    size_t size = assembler_assemble(source, strlen(source), rom);
+    rom_analyse(rom, size, analysis);
+}
+
+void analyser_tests()
+{
+    rom_analysis_t analysis, cached;
+
+    printf("\nAnalyser tests\n");
+
+    printf("Plain ROM: ");
+    analyse_source("LOAD #0, 0x01\nADDR #0, #1\nloop: JUMP loop\n", &analysis);
+    assert(analysis.features == (ROM_FLAGS | ROM_BACKWARD_JUMP));
+    assert(analysis.quirks == QUIRKS_CHIP8 && analysis.lazy_flags && analysis.skip_idle);
+    // Drawing clips or wraps by profile, with or without quirky opcodes.
+    analyse_source("DRAW #0, #1, 0x5\nloop: JUMP loop\n", &analysis);
+    assert(analysis.quirks == QUIRKS_CHIP8);
+    analyse_source("DRAW #0, #1, 0x5\nPUSH #1\nloop: JUMP loop\n", &analysis);
+    assert(analysis.quirks == QUIRKS_CHIP8);
+    printf("Ok\n");
+
+    printf("Quirks: ");
+    analyse_source("LOADI 0x300\nPUSH #3\nSHR #0, #1\nEXIT\n", &analysis);
+    assert(analysis.features == (ROM_LOAD_STORE | ROM_SHIFT_XY | ROM_FLAGS | ROM_SCHIP));
+    assert(analysis.quirks == QUIRKS_SCHIP && !analysis.skip_idle);
+    analyse_source("LOADI 0x300\nPUSH #3\nJUMP end\nend: JUMPI 0x000\n", &analysis);
+    assert(analysis.quirks == QUIRKS_CHIP8);
+    printf("Ok\n");
+
+    printf("Stores: ");
+    analyse_source("LOADI 0x204\nBCD #0\nCLS\nADDI #1\nPUSH #0\nRET\n", &analysis);
+    assert(analysis.features & ROM_SELF_MODIFY && analysis.features & ROM_INDIRECT_STORE);
+    analyse_source("LOADI data\nBCD #0\nRET\ndata: SYS 0x000\n", &analysis);
+    assert(!(analysis.features & (ROM_SELF_MODIFY | ROM_INDIRECT_STORE)));
+    printf("Ok\n");
+
+    printf("Cache: ");
+    char path[] = "/tmp/chip8-quirks-XXXXXX";
+    close(mkstemp(path));
+    const uint8_t rom[] = { 0x80, 0x14, 0x12, 0x02 };
+    assert(!rom_analyse_cached(path, rom, sizeof(rom), &analysis));
+    assert(rom_analyse_cached(path, rom, sizeof(rom), &cached));
+    assert(cached.hash == analysis.hash && cached.features == analysis.features &&
+           cached.quirks == analysis.quirks && cached.lazy_flags == analysis.lazy_flags &&
+           cached.skip_idle == analysis.skip_idle);
+    // Entries from another analyser version, or without one, are stale.
+    FILE* fp = fopen(path, "w");
+    fprintf(fp, "%016llx xochip 0 0 0\nv%u %016llx xochip 0 0 0\n", (unsigned long long) analysis.hash,
+            ANALYSER_VERSION - 1, (unsigned long long) analysis.hash);
+    fclose(fp);
+    assert(!rom_analyse_cached(path, rom, sizeof(rom), &cached) && cached.quirks == analysis.quirks);
+    assert(rom_analyse_cached(path, rom, sizeof(rom), &cached) && cached.quirks == analysis.quirks);
+    unlink(path);
+    printf("Ok\n");
+}
+
+static void write_temp(char* path, const void* data, size_t size)
+{
+    const int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, data, size) == (ssize_t) size);
+    close(fd);
+}
+
+void loader_tests()
+{
+    chip8_t vm;
+    size_t size;
+    const uint8_t rom[] = { 0x60, 0x01, 0x12, 0x02 }, other[] = { 0x00, 0xE0 };
+    static uint8_t large[MAX_ROM_SIZE + 1];
+
+    printf("\nLoader tests\n");
+
+    printf("File: ");
+    char rom_path[] = "/tmp/chip8-rom-XXXXXX", other_path[] = "/tmp/chip8-rom-XXXXXX";
+    write_temp(rom_path, rom, sizeof(rom));
+    write_temp(other_path, other, sizeof(other));
+    chip8_initialize_vm(&vm);
+    chip8_loadgame(&vm, rom_path);
+    assert(!memcmp(vm.ram + PC_START, rom, sizeof(rom)) && vm.ram[PC_START - 1] == 0);
+    assert(chip8_load_rom(&vm, large, sizeof(large)) == -1 && vm.ram[PC_START] == 0x60);
+    assert(chip8_load_rom(&vm, large, MAX_ROM_SIZE) == 0 && vm.ram[PC_START] == 0);
+    uint8_t buffer[4];
+    assert(readbin(buffer, sizeof(buffer), rom_path) == sizeof(rom));
+    assert(readbin(buffer, sizeof(buffer) - 1, rom_path) == 0);
+    printf("Ok\n");
+
+    printf("Pack: ");
+    char pack_path[] = "/tmp/chip8-pack-XXXXXX";
+    close(mkstemp(pack_path));
+    const char* roms[] = { rom_path, other_path, rom_path };
+    assert(write_rom_pack(pack_path, roms, 3) == 2);
+    rom_pack_t* pack = open_rom_pack(pack_path);
+    assert(pack->count == 2 && pack->index[0].hash < pack->index[1].hash);
+    const uint8_t* found = rom_pack_find(pack, hash_bytes(rom, sizeof(rom)), &size);
+    assert(found && size == sizeof(rom) && !memcmp(found, rom, size));
+    found = rom_pack_find(pack, hash_bytes(other, sizeof(other)), &size);
+    assert(found && size == sizeof(other) && !memcmp(found, other, size));
+    assert(!rom_pack_find(pack, 0, &size));
+    close_rom_pack(pack);
+    unlink(pack_path);
+    unlink(rom_path);
+    unlink(other_path);
+    printf("Ok\n");
+
+    printf("Shared RAM image: ");
+    chip8_t a, b;
+    const int fd = create_ram_image(rom, sizeof(rom));
+    assert(fd >= 0 && create_ram_image(large, sizeof(large)) == -1);
+    chip8_initialize_vm(&a);
+    chip8_initialize_vm(&b);
+    assert(chip8_map_ram_image(&a, fd) == 0 && chip8_map_ram_image(&b, fd) == 0);
+    assert(!memcmp(a.ram + PC_START, rom, sizeof(rom)) && !memcmp(a.ram, vm.ram, PC_START));
+    // Writes go to a private copy of the page.
+    a.ram[PC_START] = 0x61;
+    chip8_emulateCycle(&a);
+    chip8_emulateCycle(&b);
+    assert(a.V[1] == 0x01 && b.V[0] == 0x01 && b.V[1] == 0);
+    chip8_unmap_ram_image(&a);
+    chip8_unmap_ram_image(&b);
+    assert(a.ram[PC_START] == 0x61 && b.ram[PC_START] == 0x60);
+    delete_ram_image(fd);
+    printf("Ok\n");
+}
+
+void snapshot_tests()
+{
+    // Stores random values at 0x3FF and 0x400, across two RAM blocks, and
+    // draws them.
+    const uint8_t rom[] = { 0xA3, 0xFF, 0xC0, 0xFF, 0x71, 0x01, 0xF1, 0x55, 0xD0, 0x15, 0x12, 0x02 };
+    static chip8_t vm, saved;
+    static chip8_snapshot_t snapshot;
+
+    printf("\nSnapshot tests\n");
+
+    printf("Save and restore: ");
+    chip8_initialize_vm(&vm);
+    chip8_load_rom(&vm, rom, sizeof(rom));
+    chip8_run_frame(&vm);
+    chip8_save(&vm, &snapshot);
+    memcpy(&saved, &vm, sizeof(vm));
+    for (int i = 0; i < 3; i++)
+        chip8_run_frame(&vm);
+    assert(memcmp(&saved, &vm, sizeof(vm)) != 0 && vm.ram_dirty == (3ULL << (0x3FF >> RAM_BLOCK_SHIFT)));
+    chip8_restore(&vm, &snapshot);
+    assert(!memcmp(&saved, &vm, sizeof(vm)));
+    printf("Ok\n");
+
+    printf("Rollback after real frames: ");
+    // Saving again only copies the blocks written since the restore.
+    for (int i = 0; i < 2; i++)
+        chip8_run_frame(&vm);
+    vm.ram[0x3FF] = 0x42;
+    chip8_ram_written(&vm, 0x3FF, 1);
+    chip8_save(&vm, &snapshot);
+    memcpy(&saved, &vm, sizeof(vm));
+    for (int n = 0; n < 2; n++) {
+        for (int i = 0; i < 4; i++)
+            chip8_run_frame(&vm);
+        chip8_restore(&vm, &snapshot);
+        assert(!memcmp(&saved, &vm, sizeof(vm)) && vm.ram[0x3FF] == 0x42);
+    }
+    printf("Ok\n");
+}
+
+static void run_job(const char* line, char* out)
+{
+    // V1 counts loops while the key pressed isn't 0.
+    const uint8_t rom[] = { 0xE0, 0x9E, 0x71, 0x01, 0x12, 0x00 };
+    const rom_analysis_t analysis = { 0, 0, QUIRKS_DEFAULT, 0, 0 };
+    static chip8_t vm;
+    emulation_job_t job;
+    const char* error;
+
+    assert(job_parse(line, &job, &error) == 0);
+    out[job_run(&job, &vm, rom, sizeof(rom), &analysis, -1, out)] = '\0';
+    job_free(&job);
+}
+
+void job_tests()
+{
+    emulation_job_t job;
+    const char* error;
+    char out[MAX_JOB_REPLY], again[MAX_JOB_REPLY];
+
+    printf("\nJob tests\n");
+
+    printf("Parse: ");
+    assert(job_parse("j1 00ff 1000 frame,regs 0:5,30:- ", &job, &error) == 0);
+    assert(!strcmp(job.id, "j1") && job.hash == 0xFF && job.cycles == 1000);
+    assert(job.outputs == (JOB_FRAME | JOB_REGS) && job.numevents == 2);
+    assert(job.events[0].frame == 0 && job.events[0].key == 5 && job.events[1].key == NO_KEY);
+    job_free(&job);
+    assert(job_parse("j2 ff 10 -", &job, &error) == 0 && job.outputs == 0 && job.numevents == 0);
+    assert(job_parse("j3 zz 10 -", &job, &error) == -1 && !strcmp(job.id, "j3"));
+    assert(job_parse("j4 ff 10 pixels", &job, &error) == -1);
+    assert(job_parse("j5 ff 10 - 5:1,2:3", &job, &error) == -1);
+    job_free(&job);
+    assert(job_parse("j6 ff 10 - 0:g", &job, &error) == -1);
+    job_free(&job);
+    printf("Ok\n");
+
+    printf("Run: ");
+    run_job("a 0 25 regs 0:0", out);
+    assert(!strcmp(out, "a ok cycles=25 regs=00000000000000000000000000000000,0000,0204,00,00,00\n"));
+    run_job("b 0 30 regs 0:5", out);
+    assert(!strncmp(out, "b ok cycles=30 regs=000a", 24));
+    run_job("c 0 30 frame,state,screen 0:5", out);
+    run_job("c 0 30 frame,state,screen 0:5", again);
+    assert(!strcmp(out, again) && strstr(out, " screen=64x32:0000"));
+    run_job("c 0 31 frame,state,screen 0:5", again);
+    assert(strcmp(out, again) != 0 && !strncmp(strstr(out, "frame="), strstr(again, "frame="), 22));
+    printf("Ok\n");
+
+    printf("Shared RAM image: ");
+    // Counts in V1 and stores it over the second font byte, so a job that
+    // doesn't start from the image's memory hashes differently.
+    const uint8_t rom[] = { 0x71, 0x01, 0xF1, 0x55, 0x12, 0x00 };
+    const rom_analysis_t analysis = { 0, 0, QUIRKS_DEFAULT, 0, 0 };
+    static chip8_t vm;
+    const int image = create_ram_image(rom, sizeof(rom));
+    assert(image >= 0 && job_parse("d 0 99 state,regs", &job, &error) == 0);
+    out[job_run(&job, &vm, rom, sizeof(rom), &analysis, -1, out)] = '\0';
+    for (int i = 0; i < 2; i++) {
+        again[job_run(&job, &vm, rom, sizeof(rom), &analysis, image, again)] = '\0';
+        assert(!strcmp(out, again) && vm.ram[1] == vm.V[1]);
+    }
+    job_free(&job);
+    chip8_unmap_ram_image(&vm);
+    delete_ram_image(image);
+    printf("Ok\n");
+
+    printf("Return address: ");
+    // 0x200: LOAD #0, 0x05; SKPR #0; CALL 0x20a; CALL 0x20a; JUMP 0x208;
+    // 0x20a: JUMP 0x20a. Key 5 only changes the return address pushed.
+    const uint8_t calls[] = { 0x60, 0x05, 0xE0, 0x9E, 0x22, 0x0A, 0x22, 0x0A, 0x12, 0x08, 0x12, 0x0A };
+    assert(job_parse("e 0 10 state,regs", &job, &error) == 0);
+    out[job_run(&job, &vm, calls, sizeof(calls), &analysis, -1, out)] = '\0';
+    job_free(&job);
+    assert(job_parse("e 0 10 state,regs 0:5", &job, &error) == 0);
+    again[job_run(&job, &vm, calls, sizeof(calls), &analysis, -1, again)] = '\0';
+    job_free(&job);
+    assert(!strcmp(strstr(out, "regs="), strstr(again, "regs=")) && strcmp(out, again) != 0);
+    printf("Ok\n");
+}
+
+void quirk_tests()
+{
+    printf("\nQuirk profile tests\n");
+
+    test_quirks(QUIRKS_DEFAULT, 1, 0x00, 0x300, 1, 0x510);
+    test_quirks(QUIRKS_CHIP8, 0, 0x40, 0x303, 0, 0x550);
+    test_quirks(QUIRKS_SCHIP, 1, 0x00, 0x300, 0, 0x514);
+    test_quirks(QUIRKS_XOCHIP, 1, 0x40, 0x303, 1, 0x550);
+    assert(chip8_find_quirks("nope") == -1);
+}
+
+void cfg_tests()
+{
+    printf("\nControl-flow graph tests\n");
+
+    // 0x200: CALL 0x208; JUMP 0x206; (data 0xF0, 0x90); JUMP 0x206; RET
+    const uint8_t rom[] = { 0x22, 0x08, 0x12, 0x06, 0xF0, 0x90, 0x12, 0x06, 0x00, 0xEE };
+    cfg_t *cfg = cfg_build(rom, sizeof(rom), PC_START, PC_START);
+
+    printf("Code and data: ");
+    assert(cfg->map[0x200] & CFG_CODE && cfg->map[0x208] & CFG_CODE);
+    assert(!(cfg->map[0x204] & CFG_CODE) && !(cfg->map[0x205] & CFG_CODE));
+    printf("Ok\n");
+
+    printf("Blocks and edges: ");
+    assert(cfg->numblocks == 4);
+    assert(cfg->blocks[0].start == 0x200 && cfg->blocks[0].end == 0x202);
+    assert(cfg->blocks[3].start == 0x208 && cfg->blocks[3].flags & BLOCK_RETURN);
+    assert(cfg_find_block(cfg, 0x207) == 2 && cfg_find_block(cfg, 0x204) == -1);
+    assert(cfg->numedges == 4);
+    assert(cfg->edges[0].to == 0x208 && cfg->edges[0].kind == EDGE_CALL);
+    assert(cfg->edges[1].to == 0x202 && cfg->edges[1].kind == EDGE_FALLTHROUGH);
+    printf("Ok\n");
+    cfg_free(cfg);
+
+    printf("Overlapping blocks: ");
+    // 0x200: CALL 0x201; JUMP 0x206; RET; CLS; RET. The call lands inside
+    // the CALL itself, and blocks after it must still be found.
+    const uint8_t overlap[] = { 0x22, 0x01, 0x12, 0x06, 0x00, 0xEE, 0x00, 0xE0, 0x00, 0xEE };
+    cfg = cfg_build(overlap, sizeof(overlap), PC_START, PC_START);
+    assert(cfg->numblocks == 4);
+    assert(cfg->blocks[1].start == 0x201 && cfg->blocks[1].flags & BLOCK_OVERLAP);
+    assert(cfg->blocks[2].start == 0x202 && cfg->blocks[2].end == 0x204);
+    assert(cfg->blocks[3].start == 0x206 && cfg->blocks[3].flags & BLOCK_RETURN);
+    assert(cfg->edges[cfg->numedges - 1].from == 0x202 && cfg->edges[cfg->numedges - 1].to == 0x206);
+    assert(!(cfg->map[0x204] & CFG_CODE) && cfg->map[0x206] & CFG_CODE);
+    printf("Ok\n");
+    cfg_free(cfg);
+
+    printf("Full memory: ");
+    // ADDR #0, #1 up to the last byte: one block ending past 0xFFFF.
+    static uint8_t full[MAX_ROM_SIZE];
+    for (size_t i = 0; i < sizeof(full); i += 2) {
+        full[i] = 0x80;
+        full[i + 1] = 0x14;
+    }
+    cfg = cfg_build(full, sizeof(full), PC_START, PC_START);
+    assert(cfg->numblocks == 1 && cfg->blocks[0].end == RAM_MEMORY && cfg->numedges == 0);
+    assert(cfg_find_block(cfg, 0xFFFE) == 0);
+    cfg_free(cfg);
+    rom_analysis_t analysis;
+    rom_analyse(full, sizeof(full), &analysis);
+    assert(analysis.features == ROM_FLAGS && analysis.lazy_flags);
+    printf("Ok\n");
+}
+
+#define FAST_PATH_CYCLES 100000
+
+void debugger_tests()
+{
+    // 0x200: ADD #1, 0x01; LOADI 0x300; PUSH #1; JUMP 0x200
+    const uint8_t rom[] = { 0x71, 0x01, 0xA3, 0x00, 0xF1, 0x55, 0x12, 0x00 };
+    chip8_debugger_t dbg;
+    chip8_t vm;
+
+    printf("\nDebugger tests\n");
+    chip8_initialize_vm(&vm);
+    memcpy(vm.ram + PC_START, rom, sizeof(rom));
+    debugger_init(&dbg);
+
+    printf("Breakpoint: ");
+    debugger_set_breakpoint(&dbg, 0x204, 1);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_BREAKPOINT);
+    assert(vm.PC == 0x204 && vm.cycles == 2);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_BREAKPOINT);
+    assert(vm.PC == 0x204 && vm.cycles == 6 && vm.V[1] == 2);
+    printf("Ok\n");
+
+    printf("Step: ");
+    assert(debugger_run(&vm, &dbg, 3) == STOP_CYCLES);
+    assert(vm.PC == 0x202 && vm.cycles == 9);
+    printf("Ok\n");
+
+    printf("Watchpoint: ");
+    debugger_set_breakpoint(&dbg, 0x204, 0);
+    debugger_set_watch(&dbg, 0x301, WATCH_READ);
+    assert(debugger_run(&vm, &dbg, 100) == STOP_CYCLES);
+    debugger_set_watch(&dbg, 0x301, WATCH_WRITE);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_WATCHPOINT);
+    assert(vm.PC == 0x206 && dbg.stop_addr == 0x301 && dbg.stop_access == WATCH_WRITE);
+    assert(vm.ram[0x301] == vm.V[1]);
+    debugger_set_watch(&dbg, 0x301, 0);
+    assert(dbg.watch_pages[0x301 >> WATCH_PAGE_SHIFT] == 0);
+    printf("Ok\n");
+
+    printf("Skips and jumps: ");
+    // 0x200: LOAD #0, 0x01; SKE #0, 0x01; ADD #1, 0x01; ADD #2, 0x01; JUMP 0x200
+    const uint8_t skip[] = { 0x60, 0x01, 0x30, 0x01, 0x71, 0x01, 0x72, 0x01, 0x12, 0x00 };
+    chip8_initialize_vm(&vm);
+    memcpy(vm.ram + PC_START, skip, sizeof(skip));
+    debugger_init(&dbg);
+    debugger_set_breakpoint(&dbg, 0x203, 1);
+    debugger_set_breakpoint(&dbg, 0x204, 1);
+    debugger_set_breakpoint(&dbg, 0x206, 1);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_BREAKPOINT && vm.PC == 0x206 && vm.cycles == 2);
+    debugger_set_breakpoint(&dbg, 0x202, 1);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_BREAKPOINT && vm.PC == 0x202 && vm.cycles == 5);
+    debugger_set_breakpoint(&dbg, 0x202, 0);
+    debugger_set_breakpoint(&dbg, 0x206, 0);
+    assert(!debugger_has_breakpoint(&dbg, 0x200) && debugger_has_breakpoint(&dbg, 0x203));
+    assert(debugger_run(&vm, &dbg, 100) == STOP_CYCLES && vm.V[1] == 0 && vm.V[2] == 26);
+    printf("Ok\n");
+
+    printf("Watch across pages: ");
+    // 0x200: LOADI 0x33e; PUSH #3; JUMP 0x200
+    const uint8_t store[] = { 0xA3, 0x3E, 0xF3, 0x55, 0x12, 0x00 };
+    chip8_initialize_vm(&vm);
+    memcpy(vm.ram + PC_START, store, sizeof(store));
+    debugger_init(&dbg);
+    debugger_set_watch(&dbg, 0x380, WATCH_WRITE);
+    assert(debugger_run(&vm, &dbg, 100) == STOP_CYCLES);
+    debugger_set_watch(&dbg, 0x341, WATCH_WRITE);
+    assert(debugger_run(&vm, &dbg, 0) == STOP_WATCHPOINT && vm.PC == 0x204 && dbg.stop_addr == 0x341);
+    printf("Ok\n");
+
+    printf("Fast path: ");
+    // Stores through I among ALU instructions, with a breakpoint and a watch
+    // that are never hit, run as chip8_run_frame would. Timing is left to
+    // .step and .time in chip8-repl.
+    // 0x200: ADD #1, 0x01; ADD #2, 0x03; OR #3, #1; XOR #4, #2; LOADI 0x300;
+    //        PUSH #4; JUMP 0x200
+    const uint8_t alu[] = { 0x71, 0x01, 0x72, 0x03, 0x83, 0x11, 0x84, 0x23, 0xA3, 0x00, 0xF4, 0x55, 0x12, 0x00 };
+    chip8_t debugged;
+    chip8_initialize_vm(&vm);
+    memcpy(vm.ram + PC_START, alu, sizeof(alu));
+    debugged = vm;
+    debugger_init(&dbg);
+    debugger_set_breakpoint(&dbg, 0x400, 1);
+    debugger_set_watch(&dbg, 0x500, WATCH_WRITE);
+    while (vm.cycles < FAST_PATH_CYCLES)
+        chip8_run_frame(&vm);
+    assert(debugger_run(&debugged, &dbg, vm.cycles) == STOP_CYCLES);
+    assert(debugged.cycles == vm.cycles && debugged.PC == vm.PC && debugged.I == vm.I &&
+           debugged.delay_timer == vm.delay_timer && !memcmp(debugged.V, vm.V, sizeof(vm.V)) &&
+           !memcmp(debugged.ram, vm.ram, sizeof(vm.ram)));
+    printf("Ok\n");
+}
+
+static void gdb_send(int fd, const char* data)
+{
+    char packet[256];
+    uint8_t checksum = 0;
+    for (const char* p = data; *p; p++)
+        checksum += *p;
+    int len = snprintf(packet, sizeof(packet), "$%s#%02x", data, checksum);
+    assert(write(fd, packet, len) == len);
+}
+
+static void gdb_expect(int fd, const char* reply)
+{
+    char buffer[256], packet[256];
+    size_t len = 0;
+
+    // Skip acks, then read up to the checksum.
+    while (len < sizeof(buffer) - 1 && read(fd, buffer + len, 1) == 1) {
+        if (len == 0 && buffer[0] == '+')
+            continue;
+        if (++len >= 3 && buffer[len - 3] == '#')
+            break;
+    }
+    buffer[len] = '\0';
+    snprintf(packet, sizeof(packet), "$%s#", reply);
+    if (strncmp(buffer, packet, strlen(packet)))
+        fatal("Error\nExpected %s, got %s\n", packet, buffer);
+}
+
+void gdb_tests()
+{
+    // 0x200: ADD #1, 0x01; LOADI 0x300; PUSH #1; JUMP 0x200
+    const uint8_t rom[] = { 0x71, 0x01, 0xA3, 0x00, 0xF1, 0x55, 0x12, 0x00 };
+    chip8_t vm;
+    int fds[2];
+
+    printf("\nGDB stub tests\n");
+    chip8_initialize_vm(&vm);
+    memcpy(vm.ram + PC_START, rom, sizeof(rom));
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    gdb_stub_t *stub = create_gdb_stub(NULL);
+    gdb_attach(stub, fds[0]);
+
+    printf("Registers and memory: ");
+    gdb_send(fds[1], "p11");
+    gdb_send(fds[1], "P1=2a");
+    gdb_send(fds[1], "m200,4");
+    gdb_send(fds[1], "Mfffffffffffffff0,20:00");
+    gdb_send(fds[1], "Mfff0,ffffffffffffff00:00");
+    gdb_send(fds[1], "M400,3:aabb");
+    gdb_send(fds[1], "M400,2:aabb");
+    gdb_send(fds[1], "Z0,204,2");
+    gdb_send(fds[1], "c");
+    assert(gdb_run_frame(stub, &vm) == 0);
+    gdb_expect(fds[1], "0002");
+    gdb_expect(fds[1], "OK");
+    gdb_expect(fds[1], "7101a300");
+    gdb_expect(fds[1], "E01");
+    gdb_expect(fds[1], "E01");
+    gdb_expect(fds[1], "E01");
+    gdb_expect(fds[1], "OK");
+    assert(vm.ram[0x400] == 0xaa && vm.ram[0x401] == 0xbb && vm.ram[0x402] == 0);
+    gdb_expect(fds[1], "OK");
+    printf("Ok\n");
+
+    printf("Breakpoint and step: ");
+    gdb_expect(fds[1], "S05");
+    assert(vm.PC == 0x204 && vm.V[1] == 0x2b);
+    gdb_send(fds[1], "s");
+    gdb_send(fds[1], "k");
+    assert(gdb_run_frame(stub, &vm) == -1);
+    gdb_expect(fds[1], "S05");
+    assert(vm.PC == 0x206 && vm.ram[0x301] == 0x2b);
+    printf("Ok\n");
+
+    delete_gdb_stub(stub);
+    close(fds[1]);
+}
+
+void sound_ring_tests()
+{
+    static sound_ring_t ring;
+    sound_edge_t edge;
+
+    printf("\nSound ring tests\n");
+
+    printf("Push and pop: ");
+    assert(!sound_ring_peek(&ring, &edge));
+    assert(sound_ring_push(&ring, 100, 1) && sound_ring_push(&ring, 200, 0));
+    assert(sound_ring_peek(&ring, &edge) && edge.time == 100 && edge.on == 1);
+    sound_ring_pop(&ring);
+    assert(sound_ring_peek(&ring, &edge) && edge.time == 200 && edge.on == 0);
+    sound_ring_pop(&ring);
+    assert(!sound_ring_peek(&ring, &edge));
+    printf("Ok\n");
+
+    printf("Full ring drops edges: ");
+    for (int i = 0; i < SOUND_RING_SIZE; i++)
+        assert(sound_ring_push(&ring, i, i & 1));
+    assert(!sound_ring_push(&ring, SOUND_RING_SIZE, 0));
+    for (int i = 0; i < SOUND_RING_SIZE; i++) {
+        assert(sound_ring_peek(&ring, &edge) && edge.time == i);
+        sound_ring_pop(&ring);
+    }
+    assert(!sound_ring_peek(&ring, &edge));
+    printf("Ok\n");
+}
+
+void perf_tests()
+{
+    const uint8_t rom[] = { 0x71, 0x01, 0x12, 0x00 };
+    chip8_t vm;
+    char* text;
+    size_t len;
+
+    printf("\nPerformance counter tests\n");
+
+    printf("Ring and reports: ");
+    perf_counters_t* perf = create_perf_counters(4);
+    if (!perf) {
+        printf("skipped\n");
+        return;
+    }
+    chip8_initialize_vm(&vm);
+    chip8_load_rom(&vm, rom, sizeof(rom));
+    for (int frame = 0; frame < 10; frame++) {
+        perf_begin(perf, &vm);
+        chip8_run_frame(&vm);
+        perf_end(perf, &vm);
+    }
+
+    FILE* fp = open_memstream(&text, &len);
+    perf_write_csv(perf, fp);
+    fclose(fp);
+    // The header, then the last 4 frames.
+    assert(!strncmp(text, "frame,engine,vm_cycles,", 23) && strstr(text, "\n6,default,10,"));
+    assert(!strstr(text, "\n5,") && strstr(text, "\n9,default,10,"));
+    free(text);
+
+    fp = open_memstream(&text, &len);
+    perf_write_summary(perf, fp);
+    fclose(fp);
+    assert(strstr(text, "perf default: 10 frames, 100 instructions emulated"));
+    free(text);
+    delete_perf_counters(perf);
+    printf("Ok\n");
+}
+
+void metrics_tests()
+{
+    char* text;
+    size_t len;
+
+    printf("\nMetrics tests\n");
+
+    printf("Buckets: ");
+    assert(metrics_bucket(0) == 0 && metrics_bucket(1023) == 0 && metrics_bucket(1024) == 1);
+    assert(metrics_bucket_bound(0) == 1024 && metrics_bucket_bound(1) == 1280);
+    assert(metrics_bucket(~0ULL) == NUM_BUCKETS - 1);
+    for (uint64_t ns = 1000; ns < (1ULL << METRICS_MAX_SHIFT); ns = ns * 3 / 2 + 7) {
+        const int b = metrics_bucket(ns);
+        assert(ns < metrics_bucket_bound(b) && ns >= metrics_bucket_bound(b - 1));
+        // Within 25%.
+        assert(metrics_bucket_bound(b) - metrics_bucket_bound(b - 1) <= ns / 4 + 1);
+    }
+    printf("Ok\n");
+
+    printf("Prometheus text: ");
+    metrics_shard_t* shard = metrics_shard();
+    metrics_add(shard, METRIC_FRAMES, 3);
+    metrics_observe(shard, METRIC_FRAME_TIME, 2000);
+    metrics_observe(shard, METRIC_FRAME_TIME, 16000000);
+    FILE* fp = open_memstream(&text, &len);
+    metrics_write(fp);
+    fclose(fp);
+    assert(strstr(text, "# TYPE chip8_frames_total counter\nchip8_frames_total 3\n"));
+    assert(strstr(text, "\nchip8_frame_time_seconds_bucket{le=\"2.048e-06\"} 1\n"));
+    assert(strstr(text, "\nchip8_frame_time_seconds_bucket{le=\"+Inf\"} 2\n"));
+    assert(strstr(text, "\nchip8_frame_time_seconds_sum 0.016002000\nchip8_frame_time_seconds_count 2\n"));
+    assert(strstr(text, "\nchip8_job_duration_seconds_count 0\n"));
+    free(text);
+    // The MIPS gauge belongs to the server thread: scrapes don't move it.
+    metrics_add(shard, METRIC_INSTRUCTIONS, 1000000);
+    for (int i = 0; i < 2; i++) {
+        fp = open_memstream(&text, &len);
+        metrics_write(fp);
+        fclose(fp);
+        assert(strstr(text, "\nchip8_mips 0.000\n"));
+        free(text);
+    }
+    printf("Ok\n");
+
+    printf("Quantiles: ");
+    assert(metrics_count(METRIC_KEY_TO_PHOTON) == 0 && metrics_quantile(METRIC_KEY_TO_PHOTON, 0.5) == 0);
+    for (int i = 0; i < 100; i++)
+        metrics_observe(shard, METRIC_KEY_TO_PHOTON, i < 90 ? 1000000 : 100000000);
+    assert(metrics_count(METRIC_KEY_TO_PHOTON) == 100);
+    const uint64_t p50 = metrics_quantile(METRIC_KEY_TO_PHOTON, 0.5);
+    const uint64_t p99 = metrics_quantile(METRIC_KEY_TO_PHOTON, 0.99);
+    assert(p50 > 1000000 && p50 <= 1250000 && metrics_quantile(METRIC_KEY_TO_PHOTON, 0.9) == p50);
+    assert(p99 > 100000000 && p99 <= 125000000);
+    printf("Ok\n");
+
+    printf("HTTP: ");
+    char path[] = "/tmp/chip8-metrics-XXXXXX";
+    close(mkstemp(path));
+    metrics_server_t* server = create_metrics_server(path);
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    const char request[] = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    assert(write(fd, request, strlen(request)) == (ssize_t) strlen(request));
+    static char response[65536];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(fd, response + got, sizeof(response) - 1 - got)) > 0)
+        got += n;
+    response[got] = '\0';
+    close(fd);
+    assert(!strncmp(response, "HTTP/1.0 200 OK\r\n", 17) && strstr(response, "\nchip8_frames_total 3\n"));
+    delete_metrics_server(server);
+    assert(access(path, F_OK) != 0);
+    printf("Ok\n");
+}
+
+#define NUM_PUBLISHED 100000
+
+static triple_buffer_t frames;
+
+// Publishes frames whose pixels all hold the frame number, low byte.
+static void* publish_frames(void* arg)
+{
+    static uint8_t pixels[VIDEO_WIDTH * VIDEO_HEIGHT];
+    chip8_frame_t frame = { VIDEO_WIDTH, VIDEO_HEIGHT, pixels };
+
+    for (int i = 1; i <= NUM_PUBLISHED; i++) {
+        memset(pixels, i, sizeof(pixels));
+        triple_buffer_publish(&frames, &frame, 0);
+    }
+    return NULL;
+}
+
+void triple_buffer_tests()
+{
+    static uint8_t pixels[VIDEO_WIDTH * VIDEO_HEIGHT];
+    chip8_frame_t in = { VIDEO_WIDTH, VIDEO_HEIGHT, pixels }, out;
+    uint64_t tag;
+
+    printf("\nTriple buffer tests\n");
+
+    printf("Newest frame: ");
+    triple_buffer_init(&frames);
+    assert(!triple_buffer_acquire(&frames, &out, &tag));
+    pixels[0] = 1;
+    triple_buffer_publish(&frames, &in, 0);
+    pixels[0] = 2;
+    triple_buffer_publish(&frames, &in, 0);
+    assert(triple_buffer_acquire(&frames, &out, &tag) && out.pixels[0] == 2 && out.width == VIDEO_WIDTH);
+    assert(!triple_buffer_acquire(&frames, &out, &tag) && out.pixels[0] == 2);
+    printf("Ok\n");
+
+    printf("Tags: ");
+    triple_buffer_init(&frames);
+    triple_buffer_publish(&frames, &in, 5);
+    // Dropping the tagged frame passes its tag on.
+    assert(triple_buffer_publish(&frames, &in, 0));
+    assert(triple_buffer_acquire(&frames, &out, &tag) && tag == 5);
+    triple_buffer_publish(&frames, &in, 0);
+    assert(triple_buffer_acquire(&frames, &out, &tag) && tag == 0);
+    // Unless the frame replacing it has a tag of its own.
+    triple_buffer_publish(&frames, &in, 5);
+    assert(triple_buffer_publish(&frames, &in, 7));
+    assert(triple_buffer_acquire(&frames, &out, &tag) && tag == 7);
+    printf("Ok\n");
+
+    printf("Threads: ");
+    triple_buffer_init(&frames);
+    pthread_t thread;
+    pthread_create(&thread, NULL, publish_frames, NULL);
+    int presented = 0;
+    uint8_t last = 0;
+    while (last != (uint8_t) NUM_PUBLISHED) {
+        if (!triple_buffer_acquire(&frames, &out, &tag))
+            continue;
+        // A frame is never seen half written.
+        for (int i = 0; i < VIDEO_WIDTH * VIDEO_HEIGHT; i++)
+            assert(out.pixels[i] == out.pixels[0]);
+        last = out.pixels[0];
+        presented++;
+    }
+    pthread_join(thread, NULL);
+    assert(presented > 0 && presented <= NUM_PUBLISHED);
+    printf("Ok\n");
+}
+
 int main(int argc, char* argv[])
 {
     printf("chip8: selftest\n");
 
     opcode_tests();
     parsing_tests();
+    assembler_tests();
+    cfg_tests();
+    lazy_flags_tests();
+    idle_tests();
+    scheduler_tests();
+    quirk_tests();
+    analyser_tests();
+    loader_tests();
+    snapshot_tests();
+    job_tests();
+    debugger_tests();
+    gdb_tests();
+    sound_ring_tests();
+    triple_buffer_tests();
+    perf_tests();
+    metrics_tests();
 
     printf("chip8: Ok\n");
 
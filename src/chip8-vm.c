@@ -1,14 +1,18 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include <time.h>
-
-#include <SDL2/SDL.h>
 
 #include "chip8-vm.h"
+#include "util.h"
+
+// Fonts are loaded at the start of memory: the 4x5 one for FX29 and the 8x10
+// SUPER-CHIP/XO-CHIP one for FX30.
+#define FONT_START 0x00
+#define BIG_FONT_START 0x50
 
 unsigned char chip8_fontset[80] =
 {
@@ -30,12 +34,37 @@ unsigned char chip8_fontset[80] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+unsigned char chip8_big_fontset[160] =
+{
+  0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+  0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+  0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+  0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+  0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+  0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+  0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+  0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+  0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+  0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, // A
+  0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+  0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+  0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
 const uint16_t opcodes[] = {
     0x0000,  0x00E0,  0x00EE, 0x1000,  0x2000, 0x3000,  0x4000, 0x5000,
     0x6000,  0x7000,  0x8000, 0x8001,  0x8002, 0x8003,  0x8004, 0x8005,
     0x8006,  0x8007,  0x800E, 0x9000,  0xA000, 0xB000,  0xC000, 0xD000,
     0xE09E,  0xE0A1,  0xF007, 0xF00A,  0xF015, 0xF018,  0xF01E, 0xF029,
-    0xF033,  0xF055,  0xF065
+    0xF033,  0xF055,  0xF065,
+    // SUPER-CHIP.
+    0x00C0,  0x00FB,  0x00FC, 0x00FD,  0x00FE, 0x00FF,  0xF030, 0xF075,
+    0xF085,
+    // XO-CHIP.
+    0x00D0,  0x5002,  0x5003, 0xF000,  0xF001, 0xF002,  0xF03A
 };
 
 const char* instructions[] = {
@@ -43,7 +72,10 @@ const char* instructions[] = {
     "LOAD", "ADD"  , "MOVE" , "OR"  , "AND"  , "XOR"  , "ADDR", "SUB",
     "SHR" , "SUBB" , "SHL"  , "JNEQ", "LOADI", "JUMPI", "RAND", "DRAW",
     "SKPR", "SKUP" , "MOVED", "KEYD", "LOADD", "LOADS", "ADDI", "LDSPR",
-    "BCD" , "PUSH" , "POP"
+    "BCD" , "PUSH" , "POP"  ,
+    "SCD" , "SCR"  , "SCL"  , "EXIT", "LOW"  , "HIGH" , "LDBIG", "SRPL",
+    "LRPL",
+    "SCU" , "PUSHR", "POPR" , "LONGI", "PLANE", "AUDIO", "PITCH"
 };
 const size_t NUM_INSTRUCTIONS = sizeof(instructions) / sizeof(instructions[0]);
 
@@ -52,123 +84,273 @@ const uint8_t num_operands_per_instruction[] = {
     2, 2, 2, 2, 2, 2, 2, 2,
     2, 2, 2, 1, 1, 1, 2, 3,
     1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1
+    1, 1, 1,
+    1, 0, 0, 0, 0, 0, 1, 1,
+    1,
+    1, 2, 2, 1, 1, 0, 1
 };
 
-const size_t filesize(FILE* fp)
+uint16_t chip8_opcode_template(uint16_t value)
+{
+    const uint8_t msb = value >> 12;
+
+    switch (msb) {
+        case 0x0:
+            if ((value & 0xFFF0) == 0x00C0 || (value & 0xFFF0) == 0x00D0)
+                return value & 0xFFF0;
+            return (value == 0x00E0 || value == 0x00EE || value >= 0x00FB) && value <= 0x00FF ? value : 0x0000;
+        case 0x5:
+            return (value & 0xF) == 2 || (value & 0xF) == 3 ? value & 0xF00F : 0x5000;
+        case 0x8:
+            return value & 0xF00F;
+        case 0xE:
+        case 0xF:
+            return value == 0xF000 ? value : value & 0xF0FF;
+        default:
+            return value & 0xF000;
+    }
+}
+
+int chip8_load_rom(chip8_t *vm, const uint8_t *rom, size_t size)
 {
-    fseek(fp, 0, SEEK_END);
-    size_t pos = ftell(fp);
-    rewind(fp);
-    return pos;
+    if (size > MAX_ROM_SIZE)
+        return -1;
+    memcpy(vm->ram + PC_START, rom, size);
+    vm->ram_dirty = ~0ULL;
+    return 0;
 }
 
 void chip8_loadgame(chip8_t *vm, const char* filename)
 {
-    FILE *fp;
+    size_t size;
+    const char *rom = mapfile(filename, &size);
 
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        fprintf(stderr, "Could not load game '%s'\n", filename);
+    if (chip8_load_rom(vm, (const uint8_t*) rom, size) < 0) {
+        fprintf(stderr, "ROM too large: %s, %zu bytes, at most %d\n", filename, size, MAX_ROM_SIZE);
         exit(1);
     }
-
-    size_t size = filesize(fp);
-    fprintf(stderr, "size: %zd\n", size);
-    uint8_t *buffer = (uint8_t*) malloc(size);
-    fread(buffer, 1, size, fp);
-    for (int i = 0; i < size; i++) {
-        vm->ram[i + 0x80] = buffer[i];
-    }
-    free(buffer);
-    fprintf(stderr, "game loaded: %s\n", filename);
+    unmapfile(rom, size);
 }
 
-void chip8_initialize_vm(chip8_t *vm)
+void chip8_reset_vm(chip8_t *vm)
 {
     vm->PC = 0x200;
     vm->opcode.value = 0;
     vm->I = 0;
     vm->SP = 0;
-
-    memset(&vm->vRam, 0, sizeof(vm->vRam));
+    vm->vRamChanged = 0;
+    vm->hires = 0;
+    vm->plane_mask = 1;
+    vm->keycode = NO_KEY;
+    vm->key_wait = 0;
+    vm->key_reads = 0;
+    vm->delay_timer = 0;
+    vm->sound_timer = 0;
+    vm->lazy_flags = 0;
+    vm->flag_op = FLAG_NONE;
+    vm->cycles = 0;
+    vm->cycles_per_tick = CYCLES_PER_TICK;
+    vm->tick_cycles = 0;
+    vm->skip_idle = 0;
+    vm->idle_cycles = 0;
+    vm->quirks = QUIRKS_DEFAULT;
+    vm->rng = RNG_SEED;
+
+    memset(&vm->planes, 0, sizeof(vm->planes));
+    memset(&vm->pixels, 0, sizeof(vm->pixels));
+    memset(&vm->rpl, 0, sizeof(vm->rpl));
     memset(&vm->stack, 0, sizeof(vm->stack));
     memset(&vm->V, 0, sizeof(vm->V));
+}
+
+void chip8_initialize_vm(chip8_t *vm)
+{
+    chip8_reset_vm(vm);
     memset(&vm->ram, 0, sizeof(vm->ram));
 
-    for (int i = 0; i < 80; i++) {
-        vm->ram[i] = chip8_fontset[i];
+    memcpy(vm->ram + FONT_START, chip8_fontset, sizeof(chip8_fontset));
+    memcpy(vm->ram + BIG_FONT_START, chip8_big_fontset, sizeof(chip8_big_fontset));
+    vm->ram_dirty = ~0ULL;
+}
+
+void chip8_frame(chip8_t *vm, chip8_frame_t *frame)
+{
+    const int scale = vm->hires ? 1 : 2;
+    uint8_t *pixel = vm->pixels;
+
+    frame->width = vm->hires ? HIRES_WIDTH : VIDEO_WIDTH;
+    frame->height = vm->hires ? HIRES_HEIGHT : VIDEO_HEIGHT;
+    for (int y = 0; y < HIRES_HEIGHT; y += scale) {
+        const chip8_row_t row0 = vm->planes[0][y], row1 = vm->planes[1][y];
+        for (int bit = HIRES_WIDTH - 1; bit >= 0; bit -= scale) {
+            *pixel++ = ((row0 >> bit) & 1) | ((row1 >> bit) & 1) << 1;
+        }
+    }
+    frame->pixels = vm->pixels;
+}
+
+// Everything from ram_dirty on is small enough to copy whole on each save
+// and restore. RAM_MEMORY holds 64 blocks, one per bit of ram_dirty.
+#define VM_STATE_OFFSET offsetof(chip8_t, ram_dirty)
+
+static void copy_blocks(uint8_t *to, const uint8_t *from, uint64_t blocks)
+{
+    while (blocks) {
+        const size_t start = (size_t) __builtin_ctzll(blocks) << RAM_BLOCK_SHIFT;
+        memcpy(to + start, from + start, 1 << RAM_BLOCK_SHIFT);
+        blocks &= blocks - 1;
     }
 }
 
-static void chip8_initialize_be(chip8_t *vm)
+void chip8_save(chip8_t *vm, chip8_snapshot_t *snapshot)
 {
-  SDL_Init(SDL_INIT_VIDEO);
-  SDL_CreateWindowAndRenderer(WINDOW_WIDTH, WINDOW_HEIGHT, 0, &vm->window, &vm->renderer);
-  SDL_SetRenderDrawColor(vm->renderer, 0, 0, 0, 255);
-  SDL_RenderClear(vm->renderer);
+    copy_blocks(snapshot->vm.ram, vm->ram, snapshot->valid ? vm->ram_dirty : ~0ULL);
+    vm->ram_dirty = 0;
+    memcpy((uint8_t*) &snapshot->vm + VM_STATE_OFFSET, (const uint8_t*) vm + VM_STATE_OFFSET,
+           sizeof(chip8_t) - VM_STATE_OFFSET);
+    snapshot->valid = 1;
+}
 
-  // Set keyboard as non-buffered input.
-  struct termios info;
-  tcgetattr(0, &info);          /* get current terminal attirbutes; 0 is the file descriptor for stdin */
-  info.c_lflag &= ~ICANON;      /* disable canonical mode */
-  info.c_cc[VMIN] = 1;          /* wait until at least one keystroke available */
-  info.c_cc[VTIME] = 0;         /* no timeout */
-  tcsetattr(0, TCSANOW, &info); /* set immediately */
+void chip8_restore(chip8_t *vm, chip8_snapshot_t *snapshot)
+{
+    // The snapshot's ram_dirty is 0, as both now hold the same RAM.
+    copy_blocks(vm->ram, snapshot->vm.ram, vm->ram_dirty);
+    memcpy((uint8_t*) vm + VM_STATE_OFFSET, (const uint8_t*) &snapshot->vm + VM_STATE_OFFSET,
+           sizeof(chip8_t) - VM_STATE_OFFSET);
 }
 
-void chip8_initialize(chip8_t *vm)
+static inline uint16_t address(opcode_t opcode)
 {
-    chip8_initialize_vm(vm);
-    chip8_initialize_be(vm);
+    return opcode.value & 0xFFF;
 }
 
-static void chip8_setRandomColor(chip8_t *vm)
+static inline uint16_t read_opcode(const chip8_t *vm, uint16_t addr)
 {
-    uint32_t color = rand() % (1 << 32 - 1);
-    uint8_t r = color >> 16 & 0xff, g = color >> 8 & 0xff, b = color & 0xff;
-    SDL_SetRenderDrawColor(vm->renderer, r, g, b, 255);
+    return vm->ram[addr % RAM_MEMORY] << 8 | vm->ram[(addr + 1) % RAM_MEMORY];
 }
 
-static void chip8_setWhiteColor(chip8_t *vm)
+// Move PC past the next instruction, which is four bytes long if it is an
+// XO-CHIP F000 NNNN.
+static inline void skip_next(chip8_t *vm)
 {
-    SDL_SetRenderDrawColor(vm->renderer, 255, 255, 255, 255);
+    vm->PC += read_opcode(vm, vm->PC) == 0xF000 ? 4 : 2;
 }
 
-void chip8_renderPixel(chip8_t *vm, uint8_t x, uint8_t y)
+static inline uint8_t flag_value(uint8_t op, uint8_t a, uint8_t b)
 {
-    chip8_setWhiteColor(vm);
-    for (uint16_t i = y * PIXEL_SIZE; i < (y + 1) * PIXEL_SIZE; i++) {
-        for (uint16_t j = x * PIXEL_SIZE; j < (x + 1) * PIXEL_SIZE; j++) {
-            SDL_RenderDrawPoint(vm->renderer, j, i);
-        }
+    switch (op) {
+        case FLAG_ADD:  return (a + b) > 0xFF ? 1 : 0;
+        case FLAG_SUB:  return (uint8_t) (a - b) > a ? 1 : 0;
+        case FLAG_SUBB: return (uint8_t) (b - a) > a ? 1 : 0;
+        case FLAG_SHR:  return a & 0x1;
+        case FLAG_SHL:  return a >> 7;
+        default:        return 0;
     }
 }
 
-void chip8_renderScreen(chip8_t *vm)
+// Set VF from the operands of a flag-producing operation, or defer it.
+static inline void set_flag(chip8_t *vm, uint8_t op, uint8_t a, uint8_t b)
 {
-    for (int i = 0; i < VIDEO_HEIGHT; i++) {
-        for (int j = 0; j < VIDEO_WIDTH; j++) {
-            chip8_renderPixel(vm, j, i);
-        }
+    if (vm->lazy_flags) {
+        vm->flag_op = op;
+        vm->flag_a = a;
+        vm->flag_b = b;
+    } else {
+        vm->V[0xF] = flag_value(op, a, b);
     }
-    SDL_RenderPresent(vm->renderer);
 }
 
-static inline uint16_t address(opcode_t opcode)
+// VF overwritten by the VF_RESET quirk: any pending flag is dropped.
+static inline void reset_flag(chip8_t *vm)
 {
-    return opcode.value & 0xFFF;
+    vm->flag_op = FLAG_NONE;
+    vm->V[0xF] = 0;
+}
+
+void chip8_sync_flags(chip8_t *vm)
+{
+    if (vm->flag_op != FLAG_NONE) {
+        vm->V[0xF] = flag_value(vm->flag_op, vm->flag_a, vm->flag_b);
+        vm->flag_op = FLAG_NONE;
+    }
+}
+
+// Whether an opcode may read or write VF. X or Y being F covers register
+// operands (including FX55/FX65 ranges); DRAW and ADDI write VF implicitly.
+static inline int touches_vf(opcode_t opcode)
+{
+    return (opcode.hi & 0x0F) == 0xF || (opcode.lo >> 4) == 0xF ||
+           (opcode.hi >> 4) == 0xD || ((opcode.hi >> 4) == 0xF && opcode.lo == 0x1E);
 }
 
 // 00E0: Clear the screen.
 static inline void cls(chip8_t *vm) {
-    // NYI
+    for (int p = 0; p < NUM_PLANES; p++) {
+        if (vm->plane_mask & (1 << p))
+            memset(vm->planes[p], 0, sizeof(vm->planes[p]));
+    }
+    vm->vRamChanged = 1;
+    vm->PC += 2;
+}
+
+// Scrolling moves whole rows, or shifts them, on the selected planes. In low
+// resolution the distances are doubled.
+
+// 00CN: Scroll the display down N lines.
+static inline void scroll_down(chip8_t *vm) {
+    const int n = (vm->opcode.lo & 0xF) * (vm->hires ? 1 : 2);
+
+    for (int p = 0; p < NUM_PLANES; p++) {
+        if (!(vm->plane_mask & (1 << p)))
+            continue;
+        memmove(vm->planes[p] + n, vm->planes[p], (HIRES_HEIGHT - n) * sizeof(chip8_row_t));
+        memset(vm->planes[p], 0, n * sizeof(chip8_row_t));
+    }
+    vm->vRamChanged = 1;
+    vm->PC += 2;
+}
+
+// 00DN: Scroll the display up N lines.
+static inline void scroll_up(chip8_t *vm) {
+    const int n = (vm->opcode.lo & 0xF) * (vm->hires ? 1 : 2);
+
+    for (int p = 0; p < NUM_PLANES; p++) {
+        if (!(vm->plane_mask & (1 << p)))
+            continue;
+        memmove(vm->planes[p], vm->planes[p] + n, (HIRES_HEIGHT - n) * sizeof(chip8_row_t));
+        memset(vm->planes[p] + HIRES_HEIGHT - n, 0, n * sizeof(chip8_row_t));
+    }
+    vm->vRamChanged = 1;
+    vm->PC += 2;
+}
+
+// 00FB and 00FC: Scroll the display 4 pixels right or left.
+static inline void scroll_sideways(chip8_t *vm, int right) {
+    const int n = 4 * (vm->hires ? 1 : 2);
+
+    for (int p = 0; p < NUM_PLANES; p++) {
+        if (!(vm->plane_mask & (1 << p)))
+            continue;
+        for (int y = 0; y < HIRES_HEIGHT; y++) {
+            chip8_row_t *row = &vm->planes[p][y];
+            *row = right ? *row >> n : *row << n;
+        }
+    }
+    vm->vRamChanged = 1;
+    vm->PC += 2;
+}
+
+// 00FE and 00FF: Switch to low or high resolution, clearing the display.
+static inline void resolution(chip8_t *vm, int hires) {
+    vm->hires = hires;
+    memset(vm->planes, 0, sizeof(vm->planes));
+    vm->vRamChanged = 1;
+    vm->PC += 2;
 }
 // 00EE: Return from a subroutine.
 static inline void ret(chip8_t *vm) {
-    assert(vm->SP >= 0 && vm->SP < NUM_STACK_FRAMES);
-    vm->PC = vm->stack[vm->SP];
-    vm->SP--;
+    vm->PC = vm->stack[vm->SP % NUM_STACK_FRAMES];
+    vm->SP = (vm->SP + NUM_STACK_FRAMES - 1) % NUM_STACK_FRAMES;
 }
 
 // 0NNN: Call program at address NNN.
@@ -185,8 +367,8 @@ static inline void jmp(chip8_t* vm)
 // 2NNN: Call subroutine at NNN.
 static inline void call(chip8_t* vm)
 {
-    vm->SP++;
-    vm->stack[vm->SP] = vm->PC;
+    vm->SP = (vm->SP + 1) % NUM_STACK_FRAMES;
+    vm->stack[vm->SP] = vm->PC + 2;
     vm->PC = address(vm->opcode);
 }
 
@@ -196,10 +378,10 @@ static inline void ske(chip8_t* vm)
     const uint8_t x = vm->opcode.hi & 0xF;
     const uint8_t value = vm->opcode.lo;
 
+    vm->PC += 2;
     if (vm->V[x] == value) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // 4XNN: Skip the next instruction if V[X] != NN.
@@ -208,10 +390,10 @@ static inline void skne(chip8_t* vm)
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t value = vm->opcode.lo;
 
+    vm->PC += 2;
     if (vm->V[x] != value) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // 5XY0: Skip the next instruction if V[X] == V[Y].
@@ -220,10 +402,10 @@ static inline void skre(chip8_t* vm)
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t y = vm->opcode.lo >> 4;
 
+    vm->PC += 2;
     if (vm->V[x] == vm->V[y]) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // 6XNN: Set V[X] to NN.
@@ -255,40 +437,14 @@ static inline void setr(chip8_t *vm) {
     vm->PC += 2;
 }
 
-// 8XY1 Sets VX to VX or VY.
-static inline void or(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
-    const uint8_t y = vm->opcode.lo >> 4;
-
-    vm->V[x] = vm->V[x] | vm->V[y];
-    vm->PC += 2;
-}
-
-// 8XY2 Sets VX to VX and VY.
-static inline void and(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
-    const uint8_t y = vm->opcode.lo >> 4;
-
-    vm->V[x] = vm->V[x] & vm->V[y];
-    vm->PC += 2;
-}
-
-// 8XY3 Sets VX to VX xor VY.
-static inline void xor(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
-    const uint8_t y = vm->opcode.lo >> 4;
-
-    vm->V[x] = vm->V[x] ^ vm->V[y];
-    vm->PC += 2;
-}
-
 // 8XY4 Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
 static inline void addr(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t y = vm->opcode.lo >> 4;
-    uint8_t temp = vm->V[x];
-    vm->V[x] += vm->V[y];
-    vm->V[0xF] = vm->V[x] < temp ? 1 : 0;
+    const uint8_t a = vm->V[x], b = vm->V[y];
+
+    vm->V[x] = a + b;
+    set_flag(vm, FLAG_ADD, a, b);
     vm->PC += 2;
 }
 
@@ -297,18 +453,10 @@ static inline void sub(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t y = vm->opcode.lo >> 4;
 
-    uint8_t temp = vm->V[x];
-    vm->V[x] -= vm->V[y];
-    vm->V[0xF] = vm->V[x] > temp ? 1 : 0;
-    vm->PC += 2;
-}
-
-// 8X06 Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
-static inline void shr(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t a = vm->V[x], b = vm->V[y];
 
-    vm->V[0xF] = vm->V[x] & 0x1 ? 1 : 0;
-    vm->V[x] >>= 1;
+    vm->V[x] = a - b;
+    set_flag(vm, FLAG_SUB, a, b);
     vm->PC += 2;
 }
 
@@ -317,18 +465,10 @@ static inline void subb(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t y = vm->opcode.lo >> 4;
 
-    uint8_t temp = vm->V[x];
-    vm->V[x] = vm->V[y] - vm->V[x];
-    vm->V[0xF] = vm->V[x] > temp ? 1 : 0;
-    vm->PC += 2;
-}
-
-// 8X0E Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
-static inline void shl(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t a = vm->V[x], b = vm->V[y];
 
-    vm->V[0xF] = vm->V[x] & 0x80 ? 1 : 0;
-    vm->V[x] <<= 1;
+    vm->V[x] = b - a;
+    set_flag(vm, FLAG_SUBB, a, b);
     vm->PC += 2;
 }
 
@@ -337,10 +477,10 @@ static inline void jneq(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t y = vm->opcode.lo >> 4;
 
+    vm->PC += 2;
     if (vm->V[x] != vm->V[y]) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // ANNN: Set I to the address of NNN.
@@ -349,61 +489,63 @@ static inline void seti(chip8_t *vm) {
     vm->PC += 2;
 }
 
-// BNNN: Jump to the address NNN + V[0].
-static inline void jmpv0(chip8_t *vm) {
-    vm->PC = address(vm->opcode) + vm->V[0];
-}
-
 // CXNN: Set V[X] to the result of a bitwise 'and' operation on a random number (0-255) and NN.
 static inline void rrand(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
     const uint8_t value = vm->opcode.lo;
 
-    srand(time(NULL));
-    vm->V[x] = rand() % 256 & value;
+    // xorshift32, so runs are reproducible from the seed.
+    vm->rng ^= vm->rng << 13;
+    vm->rng ^= vm->rng >> 17;
+    vm->rng ^= vm->rng << 5;
+    vm->V[x] = (vm->rng & 0xFF) & value;
     vm->PC += 2;
 }
 
-// DXYN: Draw a sprite at coordinate (V[X], V[Y]) that has a width of 8 pixels and a height of N pixels.
-static inline void draw(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0xf;
-    const uint8_t y = vm->opcode.lo & 0xf0;
-    const uint8_t n = vm->opcode.lo & 0xf;
+// Spread the bits of a sprite byte so that each covers two pixels.
+static inline uint16_t double_bits(uint8_t byte)
+{
+    uint16_t x = byte;
+    x = (x | x << 4) & 0x0F0F;
+    x = (x | x << 2) & 0x3333;
+    x = (x | x << 1) & 0x5555;
+    return x | x << 1;
+}
 
-    vm->V[0xF] = 0;
-    for (int row = x; row < x + n; row++) {
-        uint8_t *ptr = (uint8_t*) vm->ram + vm->I;
-        for (int col = y; col < y + 8; col++) {
-            uint8_t oldpixel = vm->vRam[row * 8 + col];
-            uint8_t newpixel = oldpixel ^ *(ptr + col);
-            vm->vRam[row * 8 + col] = newpixel & 0x1;
-            if (oldpixel > 0) {
-                vm->V[0xF] = 1;
-            }
-        }
-    }
-    vm->vRamChanged = 1;
-    vm->PC += 2;
+// Sprite row of width bits placed at column x of a display row, wrapping
+// around the right edge.
+static inline chip8_row_t place_sprite(uint32_t bits, int width, unsigned x)
+{
+    const chip8_row_t row = (chip8_row_t) bits << (HIRES_WIDTH - width);
+    return x ? row >> x | row << (HIRES_WIDTH - x) : row;
+}
+
+// Same, but cut at the right edge.
+static inline chip8_row_t clip_sprite(uint32_t bits, int width, unsigned x)
+{
+    return ((chip8_row_t) bits << (HIRES_WIDTH - width)) >> x;
 }
 
 // EX9E: Skips the next instruction if the key stored in VX is pressed.
 static inline void jkey(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
 
+    vm->PC += 2;
+    vm->key_reads++;
     if (vm->keycode == vm->V[x]) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // EXA1: Skips the next instruction if the key stored in VX isn't pressed.
 static inline void jnkey(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
 
+    vm->PC += 2;
+    vm->key_reads++;
     if (vm->keycode != vm->V[x]) {
-        vm->PC += 2;
+        skip_next(vm);
     }
-    vm->PC += 2;
 }
 
 // Sets VX to the value of the delay timer.
@@ -414,12 +556,17 @@ static inline void getdelay(chip8_t *vm) {
     vm->PC += 2;
 }
 
-// A key press is awaited, and then stored in VX. (Blocking Operation. All instruction
-// halted until next key event).
+// A key press is awaited, and then stored in VX. Until a key is pressed the
+// instruction runs again every cycle, halting all others, and key_wait tells
+// the host the VM is blocked on input.
 static inline void waitkey(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
 
-    vm->V[x] = getchar();;
+    vm->key_wait = vm->keycode > 0xF;
+    if (vm->key_wait)
+        return;
+    vm->key_reads++;
+    vm->V[x] = vm->keycode;
     vm->PC += 2;
 }
 
@@ -440,20 +587,80 @@ static inline void setsound(chip8_t *vm) {
 }
 
 // Adds VX to I. VF is set to 1 when there is a range overflow (I+VX>0xFFF), and to
-// 0 when there isn't.
+// 0 when there isn't. I itself wraps at the end of the XO-CHIP address space.
 static inline void addi(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint32_t sum = vm->I + vm->V[x];
 
-    uint8_t old = vm->I;
-    vm->I = (vm->I + vm->V[x]) & 0xFFF;
-    vm->V[0xF] = (old > vm->I) ? 1 : 0;
+    vm->I = sum % RAM_MEMORY;
+    vm->V[0xF] = sum > 0xFFF ? 1 : 0;
     vm->PC += 2;
 }
 
 // Sets I to the location of the sprite for the character in VX. Characters 0x0-0xF
 // are represented by a 4x5 font.
 static inline void spritei(chip8_t *vm) {
-    // NYI:
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    vm->I = FONT_START + (vm->V[x] & 0xF) * 5;
+    vm->PC += 2;
+}
+
+// FX30: Sets I to the 8x10 sprite for the character in VX.
+static inline void bigspritei(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    vm->I = BIG_FONT_START + (vm->V[x] & 0xF) * 10;
+    vm->PC += 2;
+}
+
+// F000 NNNN: Sets I to the 16-bit address in the next two bytes.
+static inline void longi(chip8_t *vm) {
+    vm->I = read_opcode(vm, vm->PC + 2);
+    vm->PC += 4;
+}
+
+// FN01: Selects the planes drawn on, as a bit mask.
+static inline void plane(chip8_t *vm) {
+    vm->plane_mask = (vm->opcode.hi & 0x0F) & ((1 << NUM_PLANES) - 1);
+    vm->PC += 2;
+}
+
+// FX75: Stores V0 to VX in the flag registers.
+static inline void saverpl(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    memcpy(vm->rpl, vm->V, x + 1);
+    vm->PC += 2;
+}
+
+// FX85: Fills V0 to VX from the flag registers.
+static inline void loadrpl(chip8_t *vm) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+
+    memcpy(vm->V, vm->rpl, x + 1);
+    vm->PC += 2;
+}
+
+// 5XY2 and 5XY3: Store or load VX to VY, in either order, at I. I itself is
+// left unmodified.
+static inline void range(chip8_t *vm, int store) {
+    const uint8_t x = vm->opcode.hi & 0x0F;
+    const uint8_t y = vm->opcode.lo >> 4;
+    const int step = x <= y ? 1 : -1;
+
+    chip8_ram_written(vm, vm->I, (x <= y ? y - x : x - y) + 1);
+    for (int i = 0, r = x; ; i++, r += step) {
+        uint8_t *mem = &vm->ram[(vm->I + i) % RAM_MEMORY];
+        if (store) {
+            *mem = vm->V[r];
+        } else {
+            vm->V[r] = *mem;
+        }
+        if (r == y)
+            break;
+    }
+    vm->PC += 2;
 }
 
 // Stores the binary-coded decimal representation of VX, with the most significant
@@ -465,153 +672,182 @@ static inline void bcd(chip8_t *vm) {
     const uint8_t x = vm->opcode.hi & 0x0F;
 
     uint8_t value = vm->V[x];
-    vm->ram[vm->I + 0] = value / 100;
-    vm->ram[vm->I + 1] = (value / 10) % 10;
-    vm->ram[vm->I + 2] = (value % 100) % 10;
+    chip8_ram_written(vm, vm->I, 3);
+    vm->ram[(vm->I + 0) % RAM_MEMORY] = value / 100;
+    vm->ram[(vm->I + 1) % RAM_MEMORY] = (value / 10) % 10;
+    vm->ram[(vm->I + 2) % RAM_MEMORY] = (value % 100) % 10;
     vm->PC += 2;
 }
 
-// Stores V0 to VX (including VX) in memory starting at address I. The offset from I
-// is increased by 1 for each value written, but I itself is left unmodified.
-static inline void push(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
+static void chip8_fetch_instruction(chip8_t *vm)
+{
+    vm->opcode.hi = vm->ram[vm->PC % RAM_MEMORY];
+    vm->opcode.lo = vm->ram[(vm->PC + 1) % RAM_MEMORY];
+}
 
-    for (uint8_t i = 0; i <= x; i++) {
-        vm->ram[vm->I + i] = vm->V[i];
+// 60Hz timer event.
+static void chip8_tick(chip8_t *vm)
+{
+    vm->tick_cycles = 0;
+    if (vm->delay_timer > 0)
+        vm->delay_timer--;
+    if (vm->sound_timer > 0)
+        vm->sound_timer--;
+}
+
+// Length in instructions of the idle loop starting at PC, or 0 if there is
+// none. Idle loops have no side effects, and only a timer tick or a key
+// change can make them exit:
+//
+//   a: JUMP a                              ; spin forever
+//   a: MOVED #x; SKE #x, NN; JUMP a        ; wait for delay timer == NN
+//   a: SKPR #x; JUMP a                     ; wait for key #x
+//   a: SKUP #x; JUMP a                     ; wait for key #x release
+//   a: KEYD #x                             ; wait for a key, none pressed
+static int idle_loop_length(const chip8_t *vm)
+{
+    const uint16_t a = vm->PC;
+    const uint16_t first = read_opcode(vm, a);
+    const uint16_t jump = 0x1000 | a;
+    const uint8_t x = (first >> 8) & 0xF;
+
+    if (first == jump || (vm->key_wait && (first & 0xF0FF) == 0xF00A))
+        return 1;
+
+    if ((first & 0xF0FF) == 0xF007) {
+        const uint16_t skip = read_opcode(vm, a + 2);
+        if ((skip & 0xFF00) == (0x3000 | x << 8) && read_opcode(vm, a + 4) == jump &&
+            vm->delay_timer != (skip & 0xFF))
+            return 3;
+        return 0;
     }
-    vm->PC += 2;
-}
 
-// Fills V0 to VX (including VX) with values from memory starting at address I. The
-// offset from I is increased by 1 for each value written, but I itself is left
-// unmodified.
-static inline void pop(chip8_t *vm) {
-    const uint8_t x = vm->opcode.hi & 0x0F;
+    if (read_opcode(vm, a + 2) != jump)
+        return 0;
+    if ((first & 0xF0FF) == 0xE09E && vm->keycode != vm->V[x])
+        return 2;
+    if ((first & 0xF0FF) == 0xE0A1 && vm->keycode == vm->V[x])
+        return 2;
+    return 0;
+}
 
-    for (uint8_t i = 0; i <= x; i++) {
-        vm->V[i] = vm->ram[vm->I + i];
+// Skip whole iterations of the idle loop at PC up to the next tick. The
+// state after the skip is the same as executing them, since the delay timer
+// can't change before the tick.
+static int chip8_skip_idle(chip8_t *vm)
+{
+    const int len = idle_loop_length(vm);
+    if (len == 0)
+        return 0;
+
+    const uint16_t remaining = vm->cycles_per_tick - vm->tick_cycles;
+    const uint16_t skipped = remaining - remaining % len;
+    if (len == 3 && skipped > 0) {
+        vm->V[vm->ram[vm->PC % RAM_MEMORY] & 0xF] = vm->delay_timer;
     }
-    vm->PC += 2;
-}
+    // Each iteration of a SKPR/SKUP loop reads the keypad once.
+    if (len == 2)
+        vm->key_reads += skipped / 2;
+    vm->cycles += skipped;
+    vm->idle_cycles += skipped;
+    vm->tick_cycles += skipped;
+    if (vm->tick_cycles >= vm->cycles_per_tick)
+        chip8_tick(vm);
+    return 1;
+}
+
+// Opcode groups with instructions that access memory through I: 5XY2, 5XY3,
+// DXYN, FX33, FX55 and FX65. A bit per top nibble.
+#define MEMORY_GROUPS (1 << 0x5 | 1 << 0xD | 1 << 0xF)
+
+// Whether an access through I can reach a page flagged in pages. Accesses
+// take at most a page, DXY0 on both planes, so they end in I's page or the next.
+static inline int in_pages(const chip8_t *vm, const uint8_t *pages)
+{
+    const uint16_t last = (vm->I + (1 << DEBUG_PAGE_SHIFT) - 1) % RAM_MEMORY;
+
+    return pages[vm->I >> DEBUG_PAGE_SHIFT] | pages[last >> DEBUG_PAGE_SHIFT];
+}
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+// Quirks of each profile as constants, e.g. QUIRK_CHIP8_SHIFT_VY.
+#define X(id, name, shift_vy, load_store_i, jump_vx, vf_reset, clip) \
+    enum { QUIRK_##id##_SHIFT_VY = shift_vy, QUIRK_##id##_LOAD_STORE_I = load_store_i, \
+           QUIRK_##id##_JUMP_VX = jump_vx, QUIRK_##id##_VF_RESET = vf_reset, QUIRK_##id##_CLIP = clip };
+CHIP8_QUIRK_PROFILES(X)
+#undef X
+
+// One interpreter per profile. A profile added to CHIP8_QUIRK_PROFILES needs
+// its instance here too.
+#define PROFILE DEFAULT
+#include "chip8-interp.h"
+#define PROFILE CHIP8
+#include "chip8-interp.h"
+#define PROFILE SCHIP
+#include "chip8-interp.h"
+#define PROFILE XOCHIP
+#include "chip8-interp.h"
+
+typedef struct {
+    void (*evaluate)(chip8_t *vm);
+    void (*emulate_cycle)(chip8_t *vm);
+    int (*run_frame)(chip8_t *vm);
+    chip8_yield_t (*run)(chip8_t *vm, uint32_t slice);
+    void (*run_debug)(chip8_t *vm, uint32_t slice, const uint16_t *next_break, const uint8_t *watch_pages);
+} interpreter_t;
+
+static const interpreter_t interpreters[NUM_QUIRK_PROFILES] = {
+#define X(id, ...) { evaluate_##id, emulate_cycle_##id, run_frame_##id, run_##id, run_debug_##id },
+    CHIP8_QUIRK_PROFILES(X)
+#undef X
+};
 
-static void chip8_fetch_instruction(chip8_t *vm)
+const char* chip8_quirk_names[NUM_QUIRK_PROFILES] = {
+#define X(id, name, ...) name,
+    CHIP8_QUIRK_PROFILES(X)
+#undef X
+};
+
+int chip8_find_quirks(const char *name)
 {
-    vm->opcode.hi = vm->ram[vm->PC] << 8;
-    vm->opcode.lo = vm->ram[vm->PC];
+    for (int i = 0; i < NUM_QUIRK_PROFILES; i++) {
+        if (!strcmp(chip8_quirk_names[i], name))
+            return i;
+    }
+    return -1;
 }
 
+// The profile is looked up once per call, so chip8_run_frame runs a whole
+// frame in the specialised interpreter.
 void chip8_evaluate_opcode(chip8_t *vm)
 {
-    switch (MSB(vm->opcode.hi)) {
-        case 0x0: {
-                      const uint8_t lo = vm->opcode.lo;
-
-                      if (lo == 0xE0) {
-                          cls(vm);
-                      } else if (lo == 0xEE) {
-                          ret(vm);
-                      } else {
-                          ecall(vm);
-                      }
-                  }
-                  break;
-        case 0x1: jmp(vm);
-                  break;
-        case 0x2: call(vm);
-                  break;
-        case 0x3: ske(vm);
-                  break;
-        case 0x4: skne(vm);
-                  break;
-        case 0x5: skre(vm);
-                  break;
-        case 0x6: load(vm);
-                  break;
-        case 0x7: add(vm);
-                  break;
-        case 0x8: {
-                      const uint8_t lsb = vm->opcode.lo & 0x0F;
-
-                      // Bitwise operations.
-                      if (lsb == 0x0) {
-                          setr(vm);
-                      } else if (lsb == 0x1) {
-                          or(vm);
-                      } else if (lsb == 0x2) {
-                          and(vm);
-                      } else if (lsb == 0x3) {
-                          xor(vm);
-                      } else if (lsb == 0x4) {
-                          addr(vm);
-                      } else if (lsb == 0x5) {
-                          sub(vm);
-                      } else if (lsb == 0x6) {
-                          shr(vm);
-                      } else if (lsb == 0x7) {
-                          subb(vm);
-                      } else if (lsb == 0xE) {
-                          shl(vm);
-                      } else {
-                          // Unreachable.
-                      }
-                  }
-                  break;
-        case 0x9: jneq(vm);
-                  break;
-        case 0xA: seti(vm);
-                  break;
-        case 0xB: jmpv0(vm);
-                  break;
-        case 0xC: rrand(vm);
-                  break;
-        case 0xD: draw(vm);
-                  break;
-        case 0xE: {
-                      const uint8_t lo = vm->opcode.lo;
-
-                      if (lo == 0x9E) {
-                          jkey(vm);
-                      } else if (lo == 0xA1) {
-                          jnkey(vm);
-                      } else {
-                          // Unreachable.
-                      }
-                  }
-                  break;
-        case 0xF: {
-                      const uint8_t lo = vm->opcode.lo;
-
-                      if (lo == 0x07) {
-                          getdelay(vm);
-                      } else if (lo == 0x0A) {
-                          waitkey(vm);
-                      } else if (lo == 0x15) {
-                          setdelay(vm);
-                      } else if (lo == 0x18) {
-                          setsound(vm);
-                      } else if (lo == 0x1E) {
-                          addi(vm);
-                      } else if (lo == 0x29) {
-                          spritei(vm);
-                      } else if (lo == 0x33) {
-                          bcd(vm);
-                      } else if (lo == 0x55) {
-                          push(vm);
-                      } else if (lo == 0x65) {
-                          pop(vm);
-                      } else {
-                          // Unreachable.
-                      }
-                  }
-                  break;
-        default: {
-                     // Unreachable.
-                 }
-    }
+    interpreters[vm->quirks].evaluate(vm);
 }
 
 void chip8_emulateCycle(chip8_t *vm)
 {
-    chip8_fetch_instruction(vm);
-    chip8_evaluate_opcode(vm);
+    interpreters[vm->quirks].emulate_cycle(vm);
+}
+
+int chip8_run_frame(chip8_t *vm)
+{
+    return interpreters[vm->quirks].run_frame(vm);
+}
+
+chip8_yield_t chip8_run(chip8_t *vm, uint32_t slice)
+{
+    return interpreters[vm->quirks].run(vm, slice);
+}
+
+void chip8_run_debug(chip8_t *vm, uint32_t slice, const uint16_t *next_break, const uint8_t *watch_pages)
+{
+    interpreters[vm->quirks].run_debug(vm, slice, next_break, watch_pages);
+}
+
+void chip8_wait_frame(chip8_t *vm)
+{
+    if (vm->key_wait && vm->keycode > 0xF)
+        chip8_skip_idle(vm);
 }
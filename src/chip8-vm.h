@@ -5,20 +5,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <termios.h>
 
-#include <SDL2/SDL.h>
+#include "backend.h"
 
-#define RAM_MEMORY 4096
+// XO-CHIP address space.
+#define RAM_MEMORY 0x10000
+// RAM is page aligned so it can be mapped from a shared image, see ram-image.h.
+#define RAM_PAGE_SIZE 4096
+// RAM writes are tracked in blocks of 1 << RAM_BLOCK_SHIFT bytes, one bit of
+// ram_dirty each, so snapshots only copy what changed.
+#define RAM_BLOCK_SHIFT 10
 #define NUM_REGISTERS 16
+// Low resolution, and SUPER-CHIP/XO-CHIP high resolution (00FF).
 #define VIDEO_WIDTH 64
 #define VIDEO_HEIGHT 32
-#define VIDEO_MEMORY (VIDEO_WIDTH * VIDEO_HEIGHT)
-#define PIXEL_SIZE 16
-#define WINDOW_WIDTH (VIDEO_WIDTH * PIXEL_SIZE)
-#define WINDOW_HEIGHT (VIDEO_HEIGHT * PIXEL_SIZE)
+#define HIRES_WIDTH 128
+#define HIRES_HEIGHT 64
+// XO-CHIP bit-planes, selected with FN01.
+#define NUM_PLANES 2
 #define NUM_STACK_FRAMES 16
 #define PC_START 0x200
+// Pages of 1 << DEBUG_PAGE_SHIFT bytes, which chip8_run_debug() checks for
+// memory accesses.
+#define DEBUG_PAGE_SHIFT 6
+// keycode when no key is pressed.
+#define NO_KEY 0xFF
+// Largest ROM, filling memory from PC_START.
+#define MAX_ROM_SIZE (RAM_MEMORY - PC_START)
+// Instructions executed per 60Hz timer tick by default.
+#define CYCLES_PER_TICK 10
+// Initial state of the random number generator used by RAND.
+#define RNG_SEED 0x2545F491
 
 #define MSB(val) ((val & 0xF0) >> 4)
 
@@ -29,32 +46,150 @@ typedef union {
     uint16_t value;
 } opcode_t;
 
+// One display row of HIRES_WIDTH pixels, bit 127 being the leftmost, so that
+// sprite blits and horizontal scrolls are shifts of a whole row.
+__extension__ typedef unsigned __int128 chip8_row_t;
+
+// Behaviours that differ between CHIP-8 interpreters, one profile per row:
+//   shift_vy      8XY6/8XYE shift VY into VX, instead of shifting VX.
+//   load_store_i  FX55/FX65 leave I past the last register accessed.
+//   jump_vx       BXNN jumps to XNN + VX, instead of BNNN to NNN + V0.
+//   vf_reset      8XY1/8XY2/8XY3 clear VF.
+//   clip          Sprites are cut at the edges of the display, not wrapped.
+// Each profile has its own interpreter, see chip8-interp.h.
+#define CHIP8_QUIRK_PROFILES(X) \
+    /* id,     name,      shift_vy, load_store_i, jump_vx, vf_reset, clip */ \
+    X(DEFAULT, "default", 0,        0,            0,       0,        0) \
+    X(CHIP8,   "chip8",   1,        1,            0,       1,        1) \
+    X(SCHIP,   "schip",   0,        0,            1,       0,        1) \
+    X(XOCHIP,  "xochip",  1,        1,            0,       0,        0)
+
+enum {
+#define X(id, ...) QUIRKS_##id,
+    CHIP8_QUIRK_PROFILES(X)
+#undef X
+    NUM_QUIRK_PROFILES
+};
+
+// Flag-producing operation whose VF result is still pending (lazy flags).
+enum { FLAG_NONE, FLAG_ADD, FLAG_SUB, FLAG_SUBB, FLAG_SHR, FLAG_SHL };
+
 typedef struct {
-    uint8_t ram[RAM_MEMORY];
+    uint8_t ram[RAM_MEMORY] __attribute__((aligned(RAM_PAGE_SIZE)));
+    // Blocks written since the last chip8_save or chip8_restore. Code that
+    // writes RAM from outside the VM marks them too, see chip8_ram_written.
+    uint64_t ram_dirty;
     uint8_t V[NUM_REGISTERS];
     opcode_t opcode;
     uint16_t I;
     uint16_t PC;
-    uint8_t vRam[VIDEO_MEMORY];
+    // Display planes. Always kept at high resolution: in low resolution
+    // every pixel is drawn as a 2x2 block.
+    chip8_row_t planes[NUM_PLANES][HIRES_HEIGHT];
+    uint8_t hires;
+    uint8_t plane_mask;     // Planes drawn, cleared and scrolled.
     uint8_t vRamChanged;
+    // Frame handed to backends by chip8_frame, one byte per pixel.
+    uint8_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+    // SUPER-CHIP flag registers (FX75, FX85).
+    uint8_t rpl[NUM_REGISTERS];
     uint16_t stack[NUM_STACK_FRAMES];
     uint16_t SP;
-    uint8_t keycode;
+    uint8_t keycode;        // Key held, 0-F, or NO_KEY.
+    uint8_t key_wait;       // FX0A is waiting for a key.
+    // Keypad reads by EX9E, EXA1 and FX0A taking a key, so the host can tell
+    // when a key it pressed was seen.
+    uint32_t key_reads;
     uint8_t delay_timer;
     uint8_t sound_timer;
+    uint32_t rng;
+
+    // Lazy flags mode: ADDR, SUB, SUBB, SHR and SHL record their operands
+    // instead of writing VF, which is computed when an instruction touches it.
+    uint8_t lazy_flags;
+    uint8_t flag_op;
+    uint8_t flag_a, flag_b;
+
+    // Emulated time: timers tick every cycles_per_tick instructions.
+    uint64_t cycles;
+    uint16_t cycles_per_tick;
+    uint16_t tick_cycles;
 
-    SDL_Renderer *renderer;
-    SDL_Window *window;
+    // Fast-forward idle loops to the next tick (see chip8_run_frame).
+    uint8_t skip_idle;
+    uint64_t idle_cycles;
+
+    uint8_t quirks;         // Profile, one of QUIRKS_*.
 } chip8_t;
 
+// Saved state to roll a VM back to. Keeps a whole copy of the VM, brought up
+// to date on each save and restore by copying the registers and display,
+// and only the RAM blocks written since the previous one.
+typedef struct {
+    chip8_t vm;
+    uint8_t valid;          // Zero until the first save, which copies all RAM.
+} chip8_snapshot_t;
+
 extern const uint16_t opcodes[];
 extern const char* instructions[];
 extern const size_t NUM_INSTRUCTIONS;
 extern const uint8_t num_operands_per_instruction[];
+extern const char* chip8_quirk_names[NUM_QUIRK_PROFILES];
+
+// Why chip8_run returned.
+typedef enum {
+    YIELD_FRAME,            // A timer tick ended the frame.
+    YIELD_KEY,              // FX0A is waiting for a key.
+    YIELD_SLICE,            // The cycle slice is used up.
+} chip8_yield_t;
 
 void chip8_emulateCycle(chip8_t *vm);
+// Run until the next timer tick. Returns 1 if the VM was found spinning in an
+// idle loop, i.e. it is waiting for the timer or for input.
+int chip8_run_frame(chip8_t *vm);
+// Run at most slice cycles, stopping early at the end of the frame or on a
+// key wait. All the state is in the VM, so the next call resumes where this
+// one stopped: a VM is a task that a host can switch away from at any yield
+// (see scheduler.h).
+chip8_yield_t chip8_run(chip8_t *vm, uint32_t slice);
+// Run at most slice cycles for a debugger, in the specialised interpreter.
+// Stops before the instruction at PC if next_break[PC] == PC, and before an
+// instruction that may access memory through I in a page flagged in
+// watch_pages. next_break[a] is the first address that straight-line code
+// from a stops at: a breakpoint among a, a + 2, ..., or an address it never
+// reaches (see debugger.c).
+void chip8_run_debug(chip8_t *vm, uint32_t slice, const uint16_t *next_break, const uint8_t *watch_pages);
+// Take a VM that chip8_run left waiting for a key, with none held, to the end
+// of its frame, or through the next one if it is at a frame boundary. Same
+// as executing FX0A until then, timers included, in constant time.
+void chip8_wait_frame(chip8_t *vm);
 void chip8_evaluate_opcode(chip8_t *vm);
-void chip8_initialize(chip8_t *vm);
 void chip8_initialize_vm(chip8_t *vm);
+// Same, leaving RAM alone, for callers that set it up themselves.
+void chip8_reset_vm(chip8_t *vm);
+// Copy a ROM at PC_START. Returns -1, and leaves memory alone, if it doesn't fit.
+int chip8_load_rom(chip8_t *vm, const uint8_t *rom, size_t size);
+// Map a ROM file and load it. Exits on error.
 void chip8_loadgame(chip8_t *vm, const char* filename);
-void chip8_renderScreen(chip8_t *vm);
+// Unpack the planes into vm->pixels at the current resolution. Pixels hold
+// the plane bits, 0 being off.
+void chip8_frame(chip8_t *vm, chip8_frame_t *frame);
+// Strip operands from an opcode, leaving the instruction template found in
+// opcodes[]. Unknown opcodes give a template that isn't there.
+uint16_t chip8_opcode_template(uint16_t value);
+// Profile named name, or -1.
+int chip8_find_quirks(const char *name);
+// Snapshot the VM, and restore a snapshot. A snapshot can be restored any
+// number of times, but a VM only has one snapshot: saving it to another one
+// breaks the tracking of the first.
+void chip8_save(chip8_t *vm, chip8_snapshot_t *snapshot);
+void chip8_restore(chip8_t *vm, chip8_snapshot_t *snapshot);
+// Write any pending flag to VF. Needed before reading VF from outside the VM.
+void chip8_sync_flags(chip8_t *vm);
+
+// Mark len bytes of RAM from addr, at most a block, as written.
+static inline void chip8_ram_written(chip8_t *vm, uint16_t addr, unsigned len)
+{
+    vm->ram_dirty |= 1ULL << (addr >> RAM_BLOCK_SHIFT) |
+                     1ULL << (((addr + len - 1) % RAM_MEMORY) >> RAM_BLOCK_SHIFT);
+}
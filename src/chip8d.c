@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "chip8-vm.h"
+#include "analyser.h"
+#include "rompack.h"
+#include "job.h"
+#include "ram-image.h"
+#include "metrics.h"
+
+// Jobs waiting for a worker. Readers block when it is full, which stops them
+// reading and pushes back on clients: a client must read replies while it
+// sends requests, or both sides end up waiting on each other.
+#define QUEUE_SIZE 4096
+
+// A client connection, freed once its reader has seen the end of input and
+// the replies to all its jobs have been written.
+typedef struct {
+    int fd;
+    int refs;                   // Reader plus jobs in flight.
+    pthread_mutex_t write_lock; // Replies are whole lines.
+} connection_t;
+
+typedef struct {
+    connection_t *conn;
+    long rom;                   // Position in the pack.
+    emulation_job_t job;
+} queued_job_t;
+
+static struct {
+    queued_job_t jobs[QUEUE_SIZE];
+    size_t head, tail;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER,
+            .not_full = PTHREAD_COND_INITIALIZER };
+
+// ROMs served, and the profile and engine picked for each at startup.
+static rom_pack_t *pack;
+static rom_analysis_t *analyses;
+// With --shared-ram, a RAM image per ROM that jobs map instead of copying the
+// ROM, or -1 where one couldn't be made.
+static int *images;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum)
+{
+    running = 0;
+}
+
+static void push(const queued_job_t *item)
+{
+    pthread_mutex_lock(&queue.lock);
+    while (queue.head - queue.tail == QUEUE_SIZE)
+        pthread_cond_wait(&queue.not_full, &queue.lock);
+    queue.jobs[queue.head++ % QUEUE_SIZE] = *item;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void pop(queued_job_t *item)
+{
+    pthread_mutex_lock(&queue.lock);
+    while (queue.head == queue.tail)
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+    *item = queue.jobs[queue.tail++ % QUEUE_SIZE];
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void reply(connection_t *conn, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&conn->write_lock);
+    while (len > 0) {
+        const ssize_t n = write(conn->fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // The client went away, its remaining replies are dropped.
+        if (n < 0)
+            break;
+        buf += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void release(connection_t *conn)
+{
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->write_lock);
+        free(conn);
+    }
+}
+
+static void submit(connection_t *conn, char *line)
+{
+    char error[MAX_JOB_ID + 64];
+    const char *reason;
+    queued_job_t item;
+
+    line[strcspn(line, "\r")] = '\0';
+    if (!line[0])
+        return;
+    if (job_parse(line, &item.job, &reason) < 0) {
+        reply(conn, error, job_error(item.job.id, reason, error));
+        job_free(&item.job);
+        return;
+    }
+    item.rom = rom_pack_index(pack, item.job.hash);
+    if (item.rom < 0) {
+        reply(conn, error, job_error(item.job.id, "unknown ROM", error));
+        job_free(&item.job);
+        return;
+    }
+    item.conn = conn;
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+    push(&item);
+}
+
+// Reads requests and queues them without waiting for replies, so that a
+// client can keep many jobs in flight on one connection.
+static void* reader(void *arg)
+{
+    connection_t *conn = (connection_t*) arg;
+    char *line = (char*) malloc(MAX_JOB_LINE);
+    size_t len = 0;
+
+    for (;;) {
+        const ssize_t n = read(conn->fd, line + len, MAX_JOB_LINE - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+
+        char *start = line, *end;
+        while ((end = (char*) memchr(start, '\n', line + len - start))) {
+            *end = '\0';
+            submit(conn, start);
+            start = end + 1;
+        }
+        len -= start - line;
+        memmove(line, start, len);
+        if (len == MAX_JOB_LINE) {
+            char error[64];
+            reply(conn, error, job_error("", "request too long", error));
+            break;
+        }
+    }
+    free(line);
+    release(conn);
+    return NULL;
+}
+
+// Workers are started once and keep their VM, so a job costs a reset and a
+// ROM copy, or with --shared-ram a remap of the ROM's image.
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void* worker(void *arg)
+{
+    chip8_t *vm = (chip8_t*) aligned_alloc(RAM_PAGE_SIZE, sizeof(chip8_t));
+    char *out = (char*) malloc(MAX_JOB_REPLY);
+    metrics_shard_t *metrics = metrics_shard();
+    queued_job_t item;
+
+    for (;;) {
+        pop(&item);
+        const rom_pack_entry_t *entry = &pack->index[item.rom];
+        const long start = now_ns();
+        const size_t len = job_run(&item.job, vm, (const uint8_t*) pack->data + entry->offset, entry->size,
+                                   &analyses[item.rom], images ? images[item.rom] : -1, out);
+        metrics_observe(metrics, METRIC_JOB_DURATION, now_ns() - start);
+        metrics_add(metrics, METRIC_JOBS, 1);
+        metrics_add(metrics, METRIC_INSTRUCTIONS, vm->cycles);
+        metrics_add(metrics, METRIC_FRAMES, vm->cycles / vm->cycles_per_tick);
+        reply(item.conn, out, len);
+        job_free(&item.job);
+        release(item.conn);
+    }
+    return NULL;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: chip8d [-j <threads>] [--metrics <port|path>] [--shared-ram] --pack <file>\n"
+                    "              <socket path>\n");
+    fprintf(stderr, "Runs emulation jobs for ROMs in a pack (see chip8-pack), sent over a unix socket.\n");
+    fprintf(stderr, "With --shared-ram, workers map a shared image of each ROM's memory and only\n"
+                    "copy the pages a job writes.\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    long numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *pack_name = NULL, *path = NULL, *metrics_spec = NULL;
+    int shared_ram = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            numthreads = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metrics_spec = argv[++i];
+        } else if (!strcmp(argv[i], "--shared-ram")) {
+            shared_ram = 1;
+        } else if (!strcmp(argv[i], "--pack") && i + 1 < argc) {
+            pack_name = argv[++i];
+        } else if (argv[i][0] == '-' || path) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!pack_name || !path || numthreads < 1)
+        usage();
+
+    pack = open_rom_pack(pack_name);
+    analyses = (rom_analysis_t*) calloc(pack->count ? pack->count : 1, sizeof(rom_analysis_t));
+    for (size_t i = 0; i < pack->count; i++) {
+        const rom_pack_entry_t *entry = &pack->index[i];
+        rom_analyse((const uint8_t*) pack->data + entry->offset, entry->size, &analyses[i]);
+    }
+    if (shared_ram) {
+        images = (int*) calloc(pack->count ? pack->count : 1, sizeof(int));
+        for (size_t i = 0; i < pack->count; i++) {
+            const rom_pack_entry_t *entry = &pack->index[i];
+            images[i] = create_ram_image((const uint8_t*) pack->data + entry->offset, entry->size);
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on %s\n", path);
+        exit(1);
+    }
+
+    metrics_server_t *metrics = metrics_spec ? create_metrics_server(metrics_spec) : NULL;
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for (long i = 0; i < numthreads; i++) {
+        pthread_t thread;
+        pthread_create(&thread, &detached, worker, NULL);
+    }
+
+    // No SA_RESTART, so that a signal interrupts accept.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "%zu ROMs, %ld workers, listening on %s\n", pack->count, numthreads, path);
+    while (running) {
+        const int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        connection_t *conn = (connection_t*) calloc(1, sizeof(connection_t));
+        conn->fd = fd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->write_lock, NULL);
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, reader, conn) != 0)
+            release(conn);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    if (metrics)
+        delete_metrics_server(metrics);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+#include "debugger.h"
+
+// next_break entry of an address with no breakpoint ahead: the last one of
+// the other parity, which PC, going up two at a time, doesn't reach.
+#define NO_BREAK(addr) ((RAM_MEMORY - 1) ^ ((addr) & 1))
+
+void debugger_init(chip8_debugger_t *dbg)
+{
+    memset(dbg, 0, sizeof(chip8_debugger_t));
+    for (uint32_t a = 0; a < RAM_MEMORY; a++)
+        dbg->next_break[a] = NO_BREAK(a);
+}
+
+// Addresses below a breakpoint lead to it, down to the previous one of the
+// same parity.
+void debugger_set_breakpoint(chip8_debugger_t *dbg, uint16_t addr, int enabled)
+{
+    addr %= RAM_MEMORY;
+    if (debugger_has_breakpoint(dbg, addr) == !!enabled)
+        return;
+
+    const uint16_t next = enabled ? addr :
+                          addr + 2 < RAM_MEMORY ? dbg->next_break[addr + 2] : NO_BREAK(addr);
+    for (int32_t a = addr; a >= 0; a -= 2) {
+        if (a != addr && (enabled ? dbg->next_break[a] == a : dbg->next_break[a] != addr))
+            break;
+        dbg->next_break[a] = next;
+    }
+}
+
+int debugger_has_breakpoint(const chip8_debugger_t *dbg, uint16_t addr)
+{
+    addr %= RAM_MEMORY;
+    return dbg->next_break[addr] == addr;
+}
+
+void debugger_set_watch(chip8_debugger_t *dbg, uint16_t addr, uint8_t access)
+{
+    addr %= RAM_MEMORY;
+    dbg->watch[addr] = access;
+
+    const uint16_t page = addr >> WATCH_PAGE_SHIFT;
+    const uint8_t *first = dbg->watch + (page << WATCH_PAGE_SHIFT);
+    dbg->watch_pages[page] = 0;
+    for (int i = 0; i < 1 << WATCH_PAGE_SHIFT; i++)
+        dbg->watch_pages[page] |= first[i];
+}
+
+// Memory range [*addr, *addr + *len) accessed through I by opcode, and the
+// kind of access. Returns 0 for opcodes that don't touch memory.
+static uint8_t memory_access(const chip8_t *vm, uint16_t opcode, uint16_t *addr, uint16_t *len)
+{
+    *addr = vm->I;
+    switch (opcode & 0xF0FF) {
+        case 0xF033:
+            *len = 3;
+            return WATCH_WRITE;
+        case 0xF055:
+            *len = ((opcode >> 8) & 0xF) + 1;
+            return WATCH_WRITE;
+        case 0xF065:
+            *len = ((opcode >> 8) & 0xF) + 1;
+            return WATCH_READ;
+    }
+    if ((opcode & 0xF000) == 0xD000) {
+        // Sprite data for each selected plane, 16x16 sprites taking 32 bytes.
+        const int planes = __builtin_popcount(vm->plane_mask);
+        *len = ((opcode & 0xF) ? (opcode & 0xF) : 32) * planes;
+        return WATCH_READ;
+    }
+    if ((opcode & 0xF00E) == 0x5002) {
+        const int x = (opcode >> 8) & 0xF, y = (opcode >> 4) & 0xF;
+        *len = (x > y ? x - y : y - x) + 1;
+        return (opcode & 1) ? WATCH_READ : WATCH_WRITE;
+    }
+    return 0;
+}
+
+// Check the page flags first, so unwatched accesses cost one lookup per page.
+static int check_watch(chip8_debugger_t *dbg, uint16_t addr, uint16_t len, uint8_t access)
+{
+    uint32_t end = (uint32_t) addr + len;
+    if (end > RAM_MEMORY)
+        end = RAM_MEMORY;
+
+    for (uint32_t a = addr; a < end; ) {
+        const uint32_t page = a >> WATCH_PAGE_SHIFT;
+        const uint32_t next = (page + 1) << WATCH_PAGE_SHIFT;
+        if (!(dbg->watch_pages[page] & access)) {
+            a = next;
+            continue;
+        }
+        for (; a < end && a < next; a++) {
+            if (dbg->watch[a] & access) {
+                dbg->stop_addr = a;
+                dbg->stop_access = access;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Run the instruction at PC, checking its accesses against the watchpoints
+// first. Returns 1 if it hit one.
+static int step(chip8_t *vm, chip8_debugger_t *dbg)
+{
+    const uint16_t pc = vm->PC % RAM_MEMORY;
+    const uint16_t opcode = vm->ram[pc] << 8 | vm->ram[(pc + 1) % RAM_MEMORY];
+    uint16_t addr, len;
+    const uint8_t access = memory_access(vm, opcode, &addr, &len);
+    const int hit = access && check_watch(dbg, addr, len, access);
+
+    chip8_emulateCycle(vm);
+    return hit;
+}
+
+// Instructions run in the specialised interpreter, which hands back those
+// that may hit a breakpoint or a watchpoint to be checked here.
+debug_stop_t debugger_run(chip8_t *vm, chip8_debugger_t *dbg, uint64_t max_cycles)
+{
+    const uint64_t end = vm->cycles + max_cycles;
+
+    if (step(vm, dbg))
+        return STOP_WATCHPOINT;
+    while (max_cycles == 0 || vm->cycles < end) {
+        const uint64_t left = max_cycles == 0 ? UINT32_MAX : end - vm->cycles;
+        chip8_run_debug(vm, left < UINT32_MAX ? left : UINT32_MAX, dbg->next_break, dbg->watch_pages);
+        if (max_cycles != 0 && vm->cycles >= end)
+            break;
+        if (debugger_has_breakpoint(dbg, vm->PC))
+            return STOP_BREAKPOINT;
+        if (step(vm, dbg))
+            return STOP_WATCHPOINT;
+    }
+    return STOP_CYCLES;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "chip8-vm.h"
+
+// Watchpoint access kinds.
+#define WATCH_READ  0x01
+#define WATCH_WRITE 0x02
+
+// Watchpoints are looked up per address only when the page of an access has
+// any watch set.
+#define WATCH_PAGE_SHIFT DEBUG_PAGE_SHIFT
+#define WATCH_PAGES (RAM_MEMORY >> WATCH_PAGE_SHIFT)
+
+typedef enum {
+    STOP_CYCLES,        // Ran the requested number of cycles.
+    STOP_BREAKPOINT,    // PC reached a breakpoint, not yet executed.
+    STOP_WATCHPOINT,    // The last instruction accessed a watched address.
+} debug_stop_t;
+
+// Breakpoints are kept as the next one straight-line code runs into from
+// each address, so debugger_run only looks one up after a change of control
+// flow, and only accesses to watched pages are decoded.
+typedef struct {
+    uint16_t next_break[RAM_MEMORY];    // See chip8_run_debug().
+    uint8_t watch[RAM_MEMORY];
+    uint8_t watch_pages[WATCH_PAGES];   // Union of the watches in each page.
+
+    // Set on STOP_WATCHPOINT.
+    uint16_t stop_addr;
+    uint8_t stop_access;
+} chip8_debugger_t;
+
+void debugger_init(chip8_debugger_t *dbg);
+void debugger_set_breakpoint(chip8_debugger_t *dbg, uint16_t addr, int enabled);
+int debugger_has_breakpoint(const chip8_debugger_t *dbg, uint16_t addr);
+// Watch addr for the given WATCH_* accesses, 0 removes the watchpoint.
+void debugger_set_watch(chip8_debugger_t *dbg, uint16_t addr, uint8_t access);
+// Run up to max_cycles instructions, 0 means no limit. The instruction at the
+// current PC always runs, so continuing from a breakpoint makes progress.
+debug_stop_t debugger_run(chip8_t *vm, chip8_debugger_t *dbg, uint64_t max_cycles);
@@ -1,11 +1,52 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "chip8-vm.h"
+#include "cfg.h"
+#include "analyser.h"
 #include "util.h"
 
+// Longest line: "0xffff " + "DRAW #f, #f, 0x0f" + "\t\t\t" + "; 0xffff\n".
+#define MAX_LINE_SIZE 48
+// Longest block header or graph node, plus room per edge.
+#define MAX_BLOCK_SIZE 96
+#define MAX_EDGE_SIZE 48
+#define MAX_ANALYSIS_SIZE 384
+#define DATA_PER_LINE 8
+#define MAX_KEYWORDS 64
+#define UNKNOWN 0xFF
+
+// How operands are laid out in the opcode and printed.
+enum operand_format {
+    FMT_NONE,           // CLS
+    FMT_ADDR,           // JUMP 0xNNN
+    FMT_REG,            // SKPR #X
+    FMT_REG_BYTE,       // LOAD #X, 0xNN
+    FMT_REG_REG,        // MOVE #X, #Y
+    FMT_REG_REG_NIBBLE, // DRAW #X, #Y, 0x0N
+    FMT_NIBBLE,         // SCD 0x0N
+    FMT_X_NIBBLE,       // PLANE 0x0X
+    FMT_LONG,           // LONGI 0xNNNN, from the next word
+};
+
+typedef struct {
+    uint8_t index;      // Position in instructions[], UNKNOWN if not an instruction.
+    uint8_t format;
+} decode_t;
+
+// Decoded instruction for every possible 16-bit opcode.
+static decode_t decode_table[1 << 16];
+static uint8_t keyword_len[MAX_KEYWORDS];
+
+static const char hex_digits[] = "0123456789abcdef";
+
 int lookup_operand(uint16_t opcode)
 {
     int i = 0;
@@ -31,158 +72,462 @@ int get_num_operands_per_instruction(int pos)
     return num_operands_per_instruction[pos];
 }
 
-static void print_addr(uint16_t addr)
+static uint8_t operand_format(uint16_t template, uint8_t num_operands)
 {
-    fprintf(stdout, "0x%.4x ", addr);
+    const uint8_t msb = template >> 12;
+
+    switch (template) {
+        case 0x00C0:
+        case 0x00D0:
+            return FMT_NIBBLE;
+        case 0xF000:
+            return FMT_LONG;
+        case 0xF001:
+            return FMT_X_NIBBLE;
+    }
+    switch (num_operands) {
+        case 0:
+            return FMT_NONE;
+        case 1:
+            return (msb == 0 || msb == 1 || msb == 2 || msb == 0xa || msb == 0xb) ? FMT_ADDR : FMT_REG;
+        case 2:
+            return (msb == 3 || msb == 4 || msb == 6 || msb == 7) ? FMT_REG_BYTE : FMT_REG_REG;
+        default:
+            return FMT_REG_REG_NIBBLE;
+    }
 }
 
-static void print_instr(uint16_t value)
+static void build_decode_table()
+{
+    assert(NUM_INSTRUCTIONS <= MAX_KEYWORDS);
+    for (size_t i = 0; i < NUM_INSTRUCTIONS; i++) {
+        keyword_len[i] = strlen(instructions[i]);
+    }
+
+    for (uint32_t value = 0; value <= 0xFFFF; value++) {
+        const uint16_t template = chip8_opcode_template(value);
+        int pos = lookup_operand(template);
+        decode_t *entry = &decode_table[value];
+        if (pos < 0) {
+            entry->index = UNKNOWN;
+            entry->format = FMT_NONE;
+        } else {
+            entry->index = pos;
+            entry->format = operand_format(template, get_num_operands_per_instruction(pos));
+        }
+    }
+}
+
+static inline char* put_hex(char *ptr, uint16_t value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--) {
+        *ptr++ = hex_digits[(value >> (i * 4)) & 0xF];
+    }
+    return ptr;
+}
+
+// Hex without leading zeros, as printed by "%x".
+static inline char* put_hex_min(char *ptr, uint16_t value)
+{
+    int digits = 1;
+    while (digits < 4 && (value >> (digits * 4)) != 0) {
+        digits++;
+    }
+    return put_hex(ptr, value, digits);
+}
+
+static inline char* put_reg(char *ptr, uint8_t reg)
+{
+    *ptr++ = '#';
+    *ptr++ = hex_digits[reg & 0xF];
+    return ptr;
+}
+
+static inline char* put_sep(char *ptr)
 {
-    opcode_t opcode, ret;
+    *ptr++ = ',';
+    *ptr++ = ' ';
+    return ptr;
+}
+
+// Size in bytes of the instruction starting with value.
+static inline size_t instruction_size(uint16_t value)
+{
+    return decode_table[value].format == FMT_LONG ? 4 : 2;
+}
 
-    opcode.value = value;
-    uint8_t msb = opcode.hi >> 4;
-    switch (msb) {
-        case 0x0:
-            ret.value = (opcode.lo > 0) ? opcode.lo : 0;
+static inline int is_instruction(uint16_t value)
+{
+    return decode_table[value].index != UNKNOWN;
+}
+
+// Write "0xAAAA KEYWORD operands<tabs>; 0xopcode\n" and return the new end.
+// next is the word following the opcode, used by four-byte instructions.
+// value must be an instruction.
+static char* format_line(char *ptr, uint16_t addr, uint16_t value, uint16_t next)
+{
+    const decode_t entry = decode_table[value];
+    const uint8_t x = (value >> 8) & 0xF, y = (value >> 4) & 0xF;
+
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    ptr = put_hex(ptr, addr, 4);
+    *ptr++ = ' ';
+
+    char *line = ptr;
+    memcpy(ptr, instructions[entry.index], keyword_len[entry.index]);
+    ptr += keyword_len[entry.index];
+    *ptr++ = ' ';
+    switch (entry.format) {
+        case FMT_ADDR:
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, value & 0xFFF, 3);
             break;
-        case 0x1:
-        case 0x2:
-        case 0x3:
-        case 0x4:
-        case 0x5:
-        case 0x6:
-        case 0x7:
-        case 0x9:
-        case 0xA:
-        case 0xB:
-        case 0xC:
-        case 0xD:
-            ret.value = (opcode.hi & 0xF0) << 8;
+        case FMT_REG:
+            ptr = put_reg(ptr, x);
             break;
-        case 0x8:
-            ret.value = (opcode.hi & 0xF0) << 8 | opcode.lo & 0x0F;
+        case FMT_REG_BYTE:
+            ptr = put_sep(put_reg(ptr, x));
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, value & 0xFF, 2);
             break;
-        case 0xE:
-        case 0xF:
-            ret.value = (opcode.hi & 0xF0) << 8 | opcode.lo;
+        case FMT_REG_REG:
+            ptr = put_reg(put_sep(put_reg(ptr, x)), y);
             break;
-        default:
-            // Unreachable
+        case FMT_REG_REG_NIBBLE:
+            ptr = put_sep(put_reg(put_sep(put_reg(ptr, x)), y));
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, value & 0xF, 2);
+            break;
+        case FMT_NIBBLE:
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, value & 0xF, 2);
+            break;
+        case FMT_X_NIBBLE:
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, x, 2);
+            break;
+        case FMT_LONG:
+            *ptr++ = '0';
+            *ptr++ = 'x';
+            ptr = put_hex(ptr, next, 4);
             break;
     }
 
-    uint8_t pos = lookup_operand(ret.value);
-    if (pos == 255) {
-        fprintf(stderr, "Unknown instruction: 0x%.4x\n", ret.value);
-        return;
+    // Adjust tabs.
+    const size_t len = ptr - line;
+    const int tabs = len < 9 ? 3 : (len > 13 ? 1 : 2);
+    for (int i = 0; i < tabs; i++) {
+        *ptr++ = '\t';
     }
-    const char* keyword = get_keyword(pos);
-    uint8_t num_operands = get_num_operands_per_instruction(pos);
 
-    char line[80];
-    if (num_operands == 0) {
-        sprintf(line, "%s ", keyword);
-    } else if (num_operands == 1) {
-        uint16_t op1;
-        if (msb == 0 | msb == 1 || msb == 2 || msb == 0xa || msb == 0xb) {
-            op1 = opcode.value & 0xFFF;
-            sprintf(line, "%s 0x%.3x", keyword, op1);
+    // Comment with the opcode.
+    memcpy(ptr, "; 0x", 4);
+    ptr = put_hex_min(ptr + 4, value);
+    *ptr++ = '\n';
+
+    return ptr;
+}
+
+// Disassemble a whole ROM into out, which must hold at least
+// (size / 2 + 1) * MAX_LINE_SIZE bytes. Returns the number of bytes written.
+static size_t disassemble(const uint8_t *rom, size_t size, char *out)
+{
+    char *ptr = out;
+
+    size_t i = 0;
+    while (i + 1 < size) {
+        const uint16_t value = rom[i] << 8 | rom[i + 1];
+        if (!is_instruction(value)) {
+            fprintf(stderr, "Unknown instruction: 0x%.4x\n", value);
+            i += 2;
+        } else if (instruction_size(value) == 4 && i + 3 < size) {
+            ptr = format_line(ptr, PC_START + i, value, rom[i + 2] << 8 | rom[i + 3]);
+            i += 4;
         } else {
-            op1 = opcode.hi & 0x0F;
-            sprintf(line, "%s #%x", keyword, op1);
+            ptr = format_line(ptr, PC_START + i, value, 0);
+            i += 2;
         }
-    } else if (num_operands == 2) {
-        uint8_t op1, op2;
-        if (msb == 3 || msb == 4 || msb == 6 || msb == 7) {
-            op1 = opcode.hi & 0xf;
-            op2 = opcode.lo;
-            sprintf(line, "%s #%x, 0x%.2x",keyword, op1, op2);
-        } else {
-            op1 = opcode.hi & 0xf;
-            op2 = (opcode.lo & 0xf0) >> 4;
-            sprintf(line, "%s #%x, #%x", keyword, op1, op2);
+    }
+    // Trailing odd byte.
+    if (i < size && is_instruction(rom[i] << 8)) {
+        ptr = format_line(ptr, PC_START + i, rom[i] << 8, 0);
+    } else if (i < size) {
+        fprintf(stderr, "Unknown instruction: 0x%.4x\n", rom[i] << 8);
+    }
+    return ptr - out;
+}
+
+static char* format_block(char *ptr, const cfg_t *cfg, size_t i, const cfg_edge_t **edge)
+{
+    const cfg_block_t *block = &cfg->blocks[i];
+    const cfg_edge_t *end = cfg->edges + cfg->numedges;
+
+    ptr += sprintf(ptr, "\n; block 0x%.4x-0x%.4x", block->start, block->end);
+    if (block->flags & BLOCK_RETURN)
+        ptr += sprintf(ptr, " ret");
+    if (block->flags & BLOCK_INDIRECT)
+        ptr += sprintf(ptr, " indirect");
+    if (block->flags & BLOCK_EXIT)
+        ptr += sprintf(ptr, " exit");
+    if (block->flags & BLOCK_INVALID)
+        ptr += sprintf(ptr, " invalid");
+    if (block->flags & BLOCK_OVERLAP)
+        ptr += sprintf(ptr, " overlap");
+    for (const char *sep = " ->"; *edge < end && (*edge)->from == block->start; (*edge)++, sep = ",") {
+        ptr += sprintf(ptr, "%s 0x%.4x (%s)", sep, (*edge)->to, cfg_edge_name((*edge)->kind));
+    }
+    *ptr++ = '\n';
+    return ptr;
+}
+
+static char* format_data(char *ptr, uint16_t addr, const uint8_t *bytes, size_t len)
+{
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    ptr = put_hex(ptr, addr, 4);
+    memcpy(ptr, " ; data", 7);
+    ptr += 7;
+    for (size_t i = 0; i < len; i++) {
+        *ptr++ = ' ';
+        ptr = put_hex(ptr, bytes[i], 2);
+    }
+    *ptr++ = '\n';
+    return ptr;
+}
+
+// Bytes [from, to) as data lines.
+static char* format_data_range(char *ptr, const uint8_t *rom, uint32_t from, uint32_t to)
+{
+    for (uint32_t addr = from; addr < to; addr += DATA_PER_LINE) {
+        const uint32_t len = to - addr < DATA_PER_LINE ? to - addr : DATA_PER_LINE;
+        ptr = format_data(ptr, addr, rom + addr - PC_START, len);
+    }
+    return ptr;
+}
+
+// Disassemble only the code reached from the entry point, block by block.
+// A block starting inside an instruction of the one before it, at another
+// alignment, is printed on its own and leaves the bytes it shares to the
+// blocks around it. Bytes no other block covers are printed as data.
+static size_t disassemble_recursive(const uint8_t *rom, size_t size, const cfg_t *cfg, char *out)
+{
+    char *ptr = out;
+    const cfg_edge_t *edge = cfg->edges;
+    uint32_t pos = PC_START;    // End of the last block that didn't overlap.
+
+    for (size_t b = 0; b < cfg->numblocks; b++) {
+        const cfg_block_t *block = &cfg->blocks[b];
+        if (block->start >= pos) {
+            ptr = format_data_range(ptr, rom, pos, block->start);
+            pos = block->end;
+        }
+        ptr = format_block(ptr, cfg, b, &edge);
+
+        for (uint32_t addr = block->start; addr < block->end;) {
+            const size_t i = addr - PC_START;
+            const uint16_t value = rom[i] << 8 | rom[i + 1];
+            if (!is_instruction(value)) {
+                // Reached, but not an instruction: the block ends invalid.
+                ptr = format_data(ptr, addr, rom + i, 2);
+                addr += 2;
+                continue;
+            }
+            const int wide = instruction_size(value) == 4 && i + 3 < size;
+            ptr = format_line(ptr, addr, value, wide ? rom[i + 2] << 8 | rom[i + 3] : 0);
+            addr += wide ? 4 : 2;
         }
-    } else if (num_operands == 3) {
-            uint8_t op1 = opcode.hi & 0xf;
-            uint8_t op2 = opcode.lo >> 4;
-            uint8_t op3 = opcode.lo & 0xf;
-            sprintf(line, "%s #%x, #%x, 0x%.2x", keyword, op1, op2, op3);
-    } else {
-        // Unreachable.
     }
+    if (pos < PC_START + size)
+        ptr = format_data_range(ptr, rom, pos, PC_START + size);
+    return ptr - out;
+}
 
-    // Adjust tabs.
-    char tabs[4];
-    if (strlen(line) < 9) {
-        strcpy(tabs, "\t\t\t");
-    } else if (strlen(line) > 13) {
-        strcpy(tabs, "\t");
-    } else {
-        strcpy(tabs, "\t\t");
+// Control-flow graph in Graphviz dot format.
+static size_t disassemble_graph(const cfg_t *cfg, char *out)
+{
+    char *ptr = out;
+
+    ptr += sprintf(ptr, "digraph chip8 {\n  node [shape=box];\n");
+    for (size_t i = 0; i < cfg->numblocks; i++) {
+        const cfg_block_t *block = &cfg->blocks[i];
+        ptr += sprintf(ptr, "  b%.4x [label=\"0x%.4x-0x%.4x\"%s];\n", block->start,
+                block->start, block->end, block->flags & BLOCK_RETURN ? ", peripheries=2" : "");
+    }
+    for (size_t i = 0; i < cfg->numedges; i++) {
+        const cfg_edge_t *edge = &cfg->edges[i];
+        ptr += sprintf(ptr, "  b%.4x -> b%.4x [label=\"%s\"];\n", edge->from, edge->to,
+                cfg_edge_name(edge->kind));
     }
+    ptr += sprintf(ptr, "}\n");
+    return ptr - out;
+}
 
-    // Print instruction plus comment with the opcode.
-    printf("%s", line);
-    printf("%s; 0x%x\n", tabs, opcode.value);
+static void print_instr(uint16_t value)
+{
+    char line[MAX_LINE_SIZE];
+    char *end = format_line(line, 0, value, 0);
+    // Skip address.
+    fwrite(line + 7, 1, end - line - 7, stdout);
 }
 
 void selftest() {
-    print_instr(0x0000);
-    print_instr(0x00E0);
-    print_instr(0x00EE);
-    print_instr(0x1000);
-    print_instr(0x2000);
-    print_instr(0x3000);
-    print_instr(0x4000);
-    print_instr(0x5000);
-    print_instr(0x6000);
-    print_instr(0x7000);
-    print_instr(0x8000);
-    print_instr(0x8001);
-    print_instr(0x8002);
-    print_instr(0x8003);
-    print_instr(0x8004);
-    print_instr(0x8005);
-    print_instr(0x8006);
-    print_instr(0x8007);
-    print_instr(0x800E);
-    print_instr(0x9000);
-    print_instr(0xA000);
-    print_instr(0xB000);
-    print_instr(0xC000);
-    print_instr(0xD000);
-    print_instr(0xE09E);
-    print_instr(0xE0A1);
-    print_instr(0xF007);
-    print_instr(0xF00A);
-    print_instr(0xF015);
-    print_instr(0xF018);
-    print_instr(0xF01E);
-    print_instr(0xF029);
-    print_instr(0xF033);
-    print_instr(0xF055);
-    print_instr(0xF065);
+    for (size_t i = 0; i < NUM_INSTRUCTIONS; i++) {
+        print_instr(opcodes[i]);
+    }
+}
+
+// Batch mode: each file is mapped and disassembled by a pool of threads into
+// its own buffer. The main thread writes buffers out in argument order as
+// soon as they are ready.
+
+enum mode { MODE_LINEAR, MODE_RECURSIVE, MODE_GRAPH, MODE_ANALYSE };
+
+typedef struct {
+    const char *filename;
+    enum mode mode;
+    char *out;
+    size_t len;
+    int done;
+} job_t;
+
+typedef struct {
+    job_t *jobs;
+    size_t numjobs;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} batch_t;
+
+static void disassemble_file(job_t *job)
+{
+    size_t size;
+    const uint8_t *rom = (const uint8_t*) mapfile(job->filename, &size);
+
+    if (job->mode == MODE_ANALYSE) {
+        rom_analysis_t analysis;
+        char features[256];
+        rom_analyse(rom, size, &analysis);
+        rom_feature_names(analysis.features, features, sizeof(features));
+        job->out = (char*) malloc(MAX_ANALYSIS_SIZE);
+        job->len = snprintf(job->out, MAX_ANALYSIS_SIZE, "; hash %016llx, %s profile%s%s\n; features: %s\n",
+                (unsigned long long) analysis.hash, chip8_quirk_names[analysis.quirks],
+                analysis.lazy_flags ? ", lazy flags" : "", analysis.skip_idle ? ", idle skip" : "",
+                features);
+    } else if (job->mode == MODE_LINEAR) {
+        job->out = (char*) malloc((size / 2 + 1) * MAX_LINE_SIZE);
+        job->len = disassemble(rom, size, job->out);
+    } else {
+        cfg_t *cfg = cfg_build(rom, size, PC_START, PC_START);
+        // Overlapping blocks print the bytes they share a second time.
+        job->out = (char*) malloc(2 * (size + 2) * MAX_LINE_SIZE +
+                cfg->numblocks * MAX_BLOCK_SIZE + cfg->numedges * MAX_EDGE_SIZE);
+        if (job->mode == MODE_RECURSIVE) {
+            job->len = disassemble_recursive(rom, cfg->size, cfg, job->out);
+        } else {
+            job->len = disassemble_graph(cfg, job->out);
+        }
+        cfg_free(cfg);
+    }
+    unmapfile((const char*) rom, size);
+}
+
+static void* worker(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->numjobs)
+            break;
+        disassemble_file(&batch->jobs[i]);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->jobs[i].done = 1;
+        pthread_cond_signal(&batch->ready);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: chip8-disasm [-j <threads>] [-r|-g|-a] <filename>...\n");
+    fprintf(stderr, "  -r  recursive traversal from 0x%x, code in basic blocks, rest as data\n", PC_START);
+    fprintf(stderr, "  -g  control-flow graph in dot format\n");
+    fprintf(stderr, "  -a  features used, and the quirk profile and engine picked for them\n");
+    exit(1);
 }
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: chip8-disasm <filename>\n");
-        exit(1);
+    long numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    enum mode mode = MODE_LINEAR;
+    int first = 1;
+
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp(argv[first], "-j") && first + 1 < argc) {
+            numthreads = strtol(argv[++first], NULL, 10);
+        } else if (!strcmp(argv[first], "-r")) {
+            mode = MODE_RECURSIVE;
+        } else if (!strcmp(argv[first], "-g")) {
+            mode = MODE_GRAPH;
+        } else if (!strcmp(argv[first], "-a")) {
+            mode = MODE_ANALYSE;
+        } else {
+            usage();
+        }
+    }
+    if (first >= argc || numthreads < 1) {
+        usage();
+    }
+
+    build_decode_table();
+
+    batch_t batch;
+    batch.numjobs = argc - first;
+    batch.next = 0;
+    batch.jobs = (job_t*) calloc(batch.numjobs, sizeof(job_t));
+    for (size_t i = 0; i < batch.numjobs; i++) {
+        batch.jobs[i].filename = argv[first + i];
+        batch.jobs[i].mode = mode;
     }
 
-    const char* filename = argv[1];
-    uint8_t buffer[4096];
-    size_t size = readbin(buffer, filename);
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.ready, NULL);
 
+    if (numthreads > batch.numjobs)
+        numthreads = batch.numjobs;
+    pthread_t threads[numthreads];
+    for (long i = 0; i < numthreads; i++) {
+        pthread_create(&threads[i], NULL, worker, &batch);
+    }
+
+    for (size_t i = 0; i < batch.numjobs; i++) {
+        job_t *job = &batch.jobs[i];
+
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done) {
+            pthread_cond_wait(&batch.ready, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        if (batch.numjobs > 1) {
+            fprintf(stdout, "; %s\n", job->filename);
+        }
+        fwrite(job->out, 1, job->len, stdout);
+        free(job->out);
+    }
 
-    uint8_t *ptr = buffer, *end = buffer + size;
-    while (ptr != end) {
-        print_addr(PC_START + (ptr - buffer));
-        print_instr(bswap(((uint16_t*) ptr)[0]));
-        ptr += 2;
+    for (long i = 0; i < numthreads; i++) {
+        pthread_join(threads[i], NULL);
     }
+    free(batch.jobs);
 
     return 0;
 }
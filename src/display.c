@@ -1,6 +1,15 @@
-#include "backend.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdarg.h>
 
+#include "backend.h"
+
+#define WIDTH   64
+#define HEIGHT  32
+
 uint8_t fonts[] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -34,14 +43,22 @@ void _log(const char* str,...)
 #endif
 }
 
-void draw_font(display_t *display, uint16_t x, uint16_t y, const uint8_t *sprite)
+static uint8_t pixels[WIDTH * HEIGHT];
+
+void draw_pixel(uint16_t x, uint16_t y, uint8_t value)
+{
+    if (x < WIDTH && y < HEIGHT)
+        pixels[y * WIDTH + x] = value;
+}
+
+void draw_font(uint16_t x, uint16_t y, const uint8_t *sprite)
 {
     for (size_t col = 0; col < MAX_COLUMNS; col++) {
         uint8_t nibble = sprite[col] >> FONT_WIDTH;
         uint8_t x_offset = x + (FONT_WIDTH - 1);
         for (uint8_t mask = 0x01, i = 0; i < FONT_WIDTH; mask <<= 1, i++) {
             if (nibble & mask) {
-                draw_pixel(display, x_offset - i, y, colors[black]);
+                draw_pixel(x_offset - i, y, 1);
             }
         }
         y++;
@@ -49,7 +66,7 @@ void draw_font(display_t *display, uint16_t x, uint16_t y, const uint8_t *sprite
 
 }
 
-void draw_fonts(display_t *display)
+void draw_fonts()
 {
     uint8_t *sprite;
     uint16_t x = 0, y = 0;
@@ -60,34 +77,36 @@ void draw_fonts(display_t *display)
             x = 0;
             y = y + (FONT_HEIGHT + 1);
         }
-        draw_font(display, x, y, sprite);
+        draw_font(x, y, sprite);
         x += (FONT_WIDTH + 1);
     }
 }
 
-int main(void)
+int main(int argc, char* argv[])
 {
-    uint8_t byte = 0xF0;
-    uint16_t x = 0, y = 0;
-    display_t *display = create_display(WIDTH, HEIGHT);
-
-    // Clean display.
-    clean_display(display, colors[white]);
+    const char *spec = argc > 1 ? argv[1] : "sdl";
+    chip8_backend_t *backend = create_backend(spec, WIDTH, HEIGHT);
+    if (!backend) {
+        fprintf(stderr, "Usage: display [<backend>]\n");
+        list_backends(stderr);
+        exit(1);
+    }
 
-    draw_fonts(display);
+    draw_fonts();
 
-    // Paint horizontal line on top.
+    // Paint horizontal line on the bottom.
     for (uint16_t i = 0; i < WIDTH; i++) {
-        draw_pixel(display, i, HEIGHT - 1, colors[red]);
+        draw_pixel(i, HEIGHT - 1, 1);
     }
 
     // Do paint.
-    refresh(display);
+    chip8_frame_t frame = { WIDTH, HEIGHT, pixels };
+    backend_present(backend, &frame);
 
-    SDL_Delay(3000);
+    sleep(3);
 
     // Close.
-    delete_display(display);
+    delete_backend(backend);
 
     return 0;
 }
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+
+// Fuzz target for assembler_parse_line and assembler_compile_instruction.
+// The input is split in lines, each parsed and compiled on its own.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *text = (char*) malloc(size + 1);
+    memcpy(text, data, size);
+    text[size] = '\0';
+
+    for (char *line = text; line; ) {
+        char *eol = strchr(line, '\n');
+        if (eol)
+            *eol = '\0';
+
+        instr_t instr;
+        if (assembler_parse_line(&instr, line) == 0) {
+            if (instr.numops > 3) {
+                abort();
+            }
+            const int opcode = assembler_compile_instruction(&instr);
+            if (opcode > 0xFFFF) {
+                abort();
+            }
+        }
+        line = eol ? eol + 1 : NULL;
+    }
+
+    free(text);
+    return 0;
+}
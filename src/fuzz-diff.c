@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+#include "debugger.h"
+
+// Differential fuzzer: runs a ROM through the reference interpreter and
+// every optimised way of executing it, comparing the full state after each
+// frame. The input is:
+//   byte 0     instructions per frame, 1 to 32, in the low bits, and the
+//              quirk profile in the top three bits
+//   byte 1     frames to run, 1 to 64
+//   bytes 2-17 key held down in each frame, cycling
+//   rest       ROM loaded at PC_START
+
+#define HEADER_SIZE 18
+#define NUM_KEYS 16
+
+typedef enum {
+    ENGINE_REFERENCE,
+    ENGINE_LAZY_FLAGS,
+    ENGINE_SKIP_IDLE,
+    ENGINE_LAZY_SKIP_IDLE,
+    ENGINE_DEBUGGER,
+    NUM_ENGINES
+} engine_t;
+
+static const char* engine_names[] = {
+    "reference", "lazy flags", "idle skip", "lazy flags and idle skip", "debugger"
+};
+
+static chip8_t vms[NUM_ENGINES];
+static chip8_debugger_t debugger;
+
+static void run_frame(engine_t engine, chip8_t *vm)
+{
+    switch (engine) {
+        case ENGINE_REFERENCE:
+            do {
+                chip8_emulateCycle(vm);
+            } while (vm->tick_cycles != 0);
+            break;
+        case ENGINE_DEBUGGER: {
+            // Stops at breakpoints and watchpoints when they are hit, then
+            // carries on.
+            const uint64_t end = vm->cycles + vm->cycles_per_tick - vm->tick_cycles;
+            while (vm->cycles < end)
+                debugger_run(vm, &debugger, end - vm->cycles);
+            break;
+        }
+        default:
+            chip8_run_frame(vm);
+            break;
+    }
+}
+
+#define CHECK(field) \
+    if (memcmp(&ref->field, &vm->field, sizeof(ref->field))) { \
+        fprintf(stderr, "%s differs from reference in frame %d: %s\n", \
+                engine_names[engine], frame, #field); \
+        abort(); \
+    }
+
+static void compare(engine_t engine, chip8_t *vm, int frame)
+{
+    const chip8_t *ref = &vms[ENGINE_REFERENCE];
+
+    chip8_sync_flags(vm);
+    CHECK(ram);
+    CHECK(V);
+    CHECK(I);
+    CHECK(PC);
+    CHECK(planes);
+    CHECK(hires);
+    CHECK(plane_mask);
+    CHECK(rpl);
+    CHECK(stack);
+    CHECK(SP);
+    CHECK(delay_timer);
+    CHECK(sound_timer);
+    CHECK(rng);
+    CHECK(cycles);
+    CHECK(tick_cycles);
+    CHECK(keycode);
+    CHECK(key_wait);
+    CHECK(key_reads);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < HEADER_SIZE)
+        return 0;
+
+    const uint16_t cycles_per_tick = 1 + data[0] % 32;
+    const uint8_t quirks = (data[0] >> 5) % NUM_QUIRK_PROFILES;
+    const int frames = 1 + data[1] % 64;
+    const uint8_t *keys = data + 2;
+    size_t romsize = size - HEADER_SIZE;
+    if (romsize > RAM_MEMORY - PC_START)
+        romsize = RAM_MEMORY - PC_START;
+
+    chip8_t *ref = &vms[ENGINE_REFERENCE];
+    chip8_initialize_vm(ref);
+    memcpy(ref->ram + PC_START, data + HEADER_SIZE, romsize);
+    ref->cycles_per_tick = cycles_per_tick;
+    ref->quirks = quirks;
+    for (int engine = 1; engine < NUM_ENGINES; engine++)
+        vms[engine] = *ref;
+    vms[ENGINE_LAZY_FLAGS].lazy_flags = 1;
+    vms[ENGINE_SKIP_IDLE].skip_idle = 1;
+    vms[ENGINE_LAZY_SKIP_IDLE].lazy_flags = 1;
+    vms[ENGINE_LAZY_SKIP_IDLE].skip_idle = 1;
+
+    // Watch the first bytes of the ROM, where self-modifying code writes.
+    debugger_init(&debugger);
+    for (int i = 0; i < 8; i++)
+        debugger_set_watch(&debugger, PC_START + i, WATCH_READ | WATCH_WRITE);
+    // And break in a few places, odd addresses included.
+    for (int i = 0; i < 4; i++)
+        debugger_set_breakpoint(&debugger, PC_START + 2 + i * 7, 1);
+
+    for (int frame = 0; frame < frames; frame++) {
+        for (int engine = 0; engine < NUM_ENGINES; engine++) {
+            vms[engine].keycode = keys[frame % NUM_KEYS];
+            run_frame(engine, &vms[engine]);
+        }
+        for (int engine = 1; engine < NUM_ENGINES; engine++)
+            compare(engine, &vms[engine], frame);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Standalone driver for the fuzz targets, used when libFuzzer is not
+// available. Replays the inputs given as files, or runs -runs=N random
+// inputs of up to -max_len=N bytes.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static uint32_t state;
+
+static uint32_t next_random()
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void replay(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *data = (uint8_t*) malloc(size > 0 ? size : 1);
+    size = fread(data, 1, size, fp);
+    fclose(fp);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long runs = 10000, max_len = 4096;
+    int replayed = 0;
+
+    state = time(NULL) | 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-runs=", 6)) {
+            runs = strtoul(argv[i] + 6, NULL, 10);
+        } else if (!strncmp(argv[i], "-max_len=", 9)) {
+            max_len = strtoul(argv[i] + 9, NULL, 10);
+        } else if (!strncmp(argv[i], "-seed=", 6)) {
+            state = strtoul(argv[i] + 6, NULL, 10) | 1;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-runs=N] [-max_len=N] [-seed=N] [<input>...]\n", argv[0]);
+            exit(1);
+        } else {
+            replay(argv[i]);
+            replayed++;
+        }
+    }
+    if (replayed > 0)
+        return 0;
+
+    fprintf(stderr, "Running %lu random inputs, seed %u\n", runs, state);
+    uint8_t *data = (uint8_t*) malloc(max_len + 1);
+    for (unsigned long run = 0; run < runs; run++) {
+        const size_t size = next_random() % (max_len + 1);
+        for (size_t i = 0; i < size; i++)
+            data[i] = next_random();
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    free(data);
+    fprintf(stderr, "Done\n");
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+
+// Fuzz target for chip8_evaluate_opcode. The input starts with the initial
+// registers (V0-VF, I, SP, keycode, delay timer, and lazy flags mode and
+// quirk profile in one byte) and continues with big-endian opcodes,
+// evaluated one after another.
+
+#define HEADER_SIZE (NUM_REGISTERS + 6)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static chip8_t vm;
+    if (size < HEADER_SIZE)
+        return 0;
+
+    chip8_initialize_vm(&vm);
+    memcpy(vm.V, data, NUM_REGISTERS);
+    vm.I = (data[16] << 8 | data[17]) % RAM_MEMORY;
+    vm.SP = data[18] % NUM_STACK_FRAMES;
+    vm.keycode = data[19];
+    vm.delay_timer = data[20];
+    vm.lazy_flags = data[21] & 1;
+    vm.quirks = (data[21] >> 1) % NUM_QUIRK_PROFILES;
+
+    for (size_t i = HEADER_SIZE; i + 1 < size; i += 2) {
+        vm.opcode.value = data[i] << 8 | data[i + 1];
+        chip8_evaluate_opcode(&vm);
+        if (vm.SP >= NUM_STACK_FRAMES || vm.plane_mask >= 1 << NUM_PLANES) {
+            fprintf(stderr, "Invalid state after 0x%.4x: SP 0x%x, planes 0x%x\n",
+                    vm.opcode.value, vm.SP, vm.plane_mask);
+            abort();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "chip8-vm.h"
+#include "debugger.h"
+#include "gdbstub.h"
+
+#define GDB_PACKET_SIZE 4096
+#define NUM_GDB_REGISTERS (NUM_REGISTERS + 3)
+
+// Signal numbers reported in stop replies.
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target><feature name=\"org.chip8.core\">"
+    "<reg name=\"v0\" bitsize=\"8\" regnum=\"0\"/><reg name=\"v1\" bitsize=\"8\"/>"
+    "<reg name=\"v2\" bitsize=\"8\"/><reg name=\"v3\" bitsize=\"8\"/>"
+    "<reg name=\"v4\" bitsize=\"8\"/><reg name=\"v5\" bitsize=\"8\"/>"
+    "<reg name=\"v6\" bitsize=\"8\"/><reg name=\"v7\" bitsize=\"8\"/>"
+    "<reg name=\"v8\" bitsize=\"8\"/><reg name=\"v9\" bitsize=\"8\"/>"
+    "<reg name=\"va\" bitsize=\"8\"/><reg name=\"vb\" bitsize=\"8\"/>"
+    "<reg name=\"vc\" bitsize=\"8\"/><reg name=\"vd\" bitsize=\"8\"/>"
+    "<reg name=\"ve\" bitsize=\"8\"/><reg name=\"vf\" bitsize=\"8\"/>"
+    "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"16\"/>"
+    "</feature></target>";
+
+typedef enum {
+    RESUME_NONE,
+    RESUME_CONTINUE,
+    RESUME_STEP,
+    RESUME_KILL,
+} resume_t;
+
+struct gdb_stub {
+    int listen_fd;
+    int fd;             // Connected client, -1 if none.
+    int stopped;
+    int resuming;       // First frame after a continue, ignore a breakpoint at PC.
+    int killed;
+    chip8_debugger_t dbg;
+    size_t points;      // Breakpoints and watched addresses set.
+    char in[GDB_PACKET_SIZE];
+    size_t inlen;
+};
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static unsigned long parse_hex(const char **str)
+{
+    unsigned long value = 0;
+    int digit;
+
+    while ((digit = hex_value(**str)) >= 0) {
+        value = value << 4 | digit;
+        (*str)++;
+    }
+    return value;
+}
+
+static char* put_byte(char *out, uint8_t value)
+{
+    *out++ = hexdigits[value >> 4];
+    *out++ = hexdigits[value & 0xF];
+    return out;
+}
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void send_packet(gdb_stub_t *stub, const char *data, size_t len)
+{
+    char packet[GDB_PACKET_SIZE * 2 + 4];
+    uint8_t checksum = 0;
+    size_t n = 0;
+
+    packet[n++] = '$';
+    for (size_t i = 0; i < len; i++) {
+        checksum += (uint8_t) data[i];
+        packet[n++] = data[i];
+    }
+    packet[n++] = '#';
+    put_byte(packet + n, checksum);
+    write_all(stub->fd, packet, n + 2);
+}
+
+static void send_string(gdb_stub_t *stub, const char *str)
+{
+    send_packet(stub, str, strlen(str));
+}
+
+static void send_stop(gdb_stub_t *stub, debug_stop_t stop, int signal)
+{
+    char reply[64];
+
+    if (stop == STOP_WATCHPOINT) {
+        snprintf(reply, sizeof(reply), "T%02x%s:%x;", GDB_SIGTRAP,
+                 stub->dbg.stop_access == WATCH_WRITE ? "watch" : "rwatch", stub->dbg.stop_addr);
+    } else {
+        snprintf(reply, sizeof(reply), "S%02x", signal);
+    }
+    send_string(stub, reply);
+}
+
+static void disconnect(gdb_stub_t *stub)
+{
+    close(stub->fd);
+    stub->fd = -1;
+    stub->stopped = 0;
+    stub->inlen = 0;
+    stub->points = 0;
+    debugger_init(&stub->dbg);
+}
+
+static uint16_t read_register(const chip8_t *vm, int n)
+{
+    if (n < NUM_REGISTERS)
+        return vm->V[n];
+    if (n == NUM_REGISTERS)
+        return vm->I;
+    return n == NUM_REGISTERS + 1 ? vm->PC : vm->SP;
+}
+
+static void write_register(chip8_t *vm, int n, uint16_t value)
+{
+    if (n < NUM_REGISTERS) {
+        vm->V[n] = value;
+    } else if (n == NUM_REGISTERS) {
+        vm->I = value;
+    } else if (n == NUM_REGISTERS + 1) {
+        vm->PC = value;
+    } else {
+        vm->SP = value;
+    }
+}
+
+// Registers are sent as little-endian hex, one byte for V0-VF and two for
+// the rest.
+static char* put_register(char *out, const chip8_t *vm, int n)
+{
+    const uint16_t value = read_register(vm, n);
+    out = put_byte(out, value & 0xFF);
+    if (n >= NUM_REGISTERS)
+        out = put_byte(out, value >> 8);
+    return out;
+}
+
+static const char* get_register(const char *in, chip8_t *vm, int n)
+{
+    const int bytes = n < NUM_REGISTERS ? 1 : 2;
+    uint16_t value = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        if (hex_value(in[0]) < 0 || hex_value(in[1]) < 0)
+            return NULL;
+        value |= (hex_value(in[0]) << 4 | hex_value(in[1])) << (8 * i);
+        in += 2;
+    }
+    write_register(vm, n, value);
+    return in;
+}
+
+static void set_breakpoint(gdb_stub_t *stub, uint16_t addr, int enabled)
+{
+    if (debugger_has_breakpoint(&stub->dbg, addr) == enabled)
+        return;
+    debugger_set_breakpoint(&stub->dbg, addr, enabled);
+    stub->points += enabled ? 1 : -1;
+}
+
+static void set_watch(gdb_stub_t *stub, uint16_t addr, uint8_t access, int enabled)
+{
+    const uint8_t old = stub->dbg.watch[addr];
+    const uint8_t flags = enabled ? old | access : old & ~access;
+
+    if (!old != !flags)
+        stub->points += flags ? 1 : -1;
+    debugger_set_watch(&stub->dbg, addr, flags);
+}
+
+// Z and z packets: type,addr,kind. Types 0 and 1 are breakpoints, 2, 3 and 4
+// are write, read and access watchpoints of kind bytes.
+static const char* point(gdb_stub_t *stub, const char *args, int enabled)
+{
+    const int type = *args++ - '0';
+    if (*args++ != ',')
+        return "E01";
+    const unsigned long addr = parse_hex(&args);
+    unsigned long len = 1;
+    if (*args == ',') {
+        args++;
+        len = parse_hex(&args);
+    }
+    if (addr >= RAM_MEMORY)
+        return "E01";
+
+    static const uint8_t access[] = { 0, 0, WATCH_WRITE, WATCH_READ, WATCH_READ | WATCH_WRITE };
+    if (type == 0 || type == 1) {
+        set_breakpoint(stub, addr, enabled);
+    } else if (type >= 2 && type <= 4) {
+        for (unsigned long a = addr; a < addr + len && a < RAM_MEMORY; a++)
+            set_watch(stub, a, access[type], enabled);
+    } else {
+        return "";
+    }
+    return "OK";
+}
+
+static void read_memory(gdb_stub_t *stub, const chip8_t *vm, const char *args)
+{
+    char reply[GDB_PACKET_SIZE];
+    const unsigned long addr = parse_hex(&args);
+    unsigned long len = *args == ',' ? (args++, parse_hex(&args)) : 0;
+
+    if (addr >= RAM_MEMORY) {
+        send_string(stub, "E01");
+        return;
+    }
+    if (len > RAM_MEMORY - addr)
+        len = RAM_MEMORY - addr;
+    if (len > sizeof(reply) / 2)
+        len = sizeof(reply) / 2;
+
+    char *out = reply;
+    for (unsigned long i = 0; i < len; i++)
+        out = put_byte(out, vm->ram[addr + i]);
+    send_packet(stub, reply, out - reply);
+}
+
+static const char* write_memory(chip8_t *vm, const char *args)
+{
+    const unsigned long addr = parse_hex(&args);
+    if (*args++ != ',')
+        return "E01";
+    const unsigned long len = parse_hex(&args);
+    if (*args++ != ':' || addr >= RAM_MEMORY || len > RAM_MEMORY - addr)
+        return "E01";
+    // The whole payload is checked first, so a short one writes nothing.
+    for (unsigned long i = 0; i < 2 * len; i++) {
+        if (hex_value(args[i]) < 0)
+            return "E01";
+    }
+
+    for (unsigned long i = 0; i < len; i++, args += 2) {
+        vm->ram[addr + i] = hex_value(args[0]) << 4 | hex_value(args[1]);
+        chip8_ram_written(vm, addr + i, 1);
+    }
+    return "OK";
+}
+
+// qXfer:features:read:target.xml:offset,length
+static void read_target_xml(gdb_stub_t *stub, const char *args)
+{
+    char reply[GDB_PACKET_SIZE];
+    const unsigned long offset = parse_hex(&args);
+    unsigned long len = *args == ',' ? (args++, parse_hex(&args)) : 0;
+    const size_t size = sizeof(target_xml) - 1;
+
+    if (offset >= size) {
+        send_string(stub, "l");
+        return;
+    }
+    if (len > size - offset)
+        len = size - offset;
+    if (len > sizeof(reply) - 1)
+        len = sizeof(reply) - 1;
+    reply[0] = offset + len < size ? 'm' : 'l';
+    memcpy(reply + 1, target_xml + offset, len);
+    send_packet(stub, reply, len + 1);
+}
+
+static resume_t handle_packet(gdb_stub_t *stub, chip8_t *vm, const char *packet)
+{
+    char reply[NUM_GDB_REGISTERS * 4 + 1];
+    const char *args = packet + 1;
+
+    switch (packet[0]) {
+        case '?':
+            send_stop(stub, STOP_BREAKPOINT, GDB_SIGTRAP);
+            return RESUME_NONE;
+        case 'g': {
+            char *out = reply;
+            for (int n = 0; n < NUM_GDB_REGISTERS; n++)
+                out = put_register(out, vm, n);
+            send_packet(stub, reply, out - reply);
+            return RESUME_NONE;
+        }
+        case 'G':
+            for (int n = 0; n < NUM_GDB_REGISTERS && args; n++)
+                args = get_register(args, vm, n);
+            send_string(stub, args ? "OK" : "E01");
+            return RESUME_NONE;
+        case 'p': {
+            const unsigned long n = parse_hex(&args);
+            if (n >= NUM_GDB_REGISTERS) {
+                send_string(stub, "E01");
+                return RESUME_NONE;
+            }
+            send_packet(stub, reply, put_register(reply, vm, n) - reply);
+            return RESUME_NONE;
+        }
+        case 'P': {
+            const unsigned long n = parse_hex(&args);
+            const int ok = n < NUM_GDB_REGISTERS && *args++ == '=' && get_register(args, vm, n);
+            send_string(stub, ok ? "OK" : "E01");
+            return RESUME_NONE;
+        }
+        case 'm':
+            read_memory(stub, vm, args);
+            return RESUME_NONE;
+        case 'M':
+            send_string(stub, write_memory(vm, args));
+            return RESUME_NONE;
+        case 'Z':
+        case 'z':
+            send_string(stub, point(stub, args, packet[0] == 'Z'));
+            return RESUME_NONE;
+        case 'c':
+            if (*args)
+                vm->PC = parse_hex(&args);
+            return RESUME_CONTINUE;
+        case 's':
+            if (*args)
+                vm->PC = parse_hex(&args);
+            return RESUME_STEP;
+        case 'k':
+            return RESUME_KILL;
+        case 'D':
+            send_string(stub, "OK");
+            disconnect(stub);
+            return RESUME_CONTINUE;
+        case 'H':
+            send_string(stub, "OK");
+            return RESUME_NONE;
+        case 'q':
+            if (!strncmp(args, "Supported", 9)) {
+                snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+", GDB_PACKET_SIZE);
+                send_string(stub, reply);
+            } else if (!strncmp(args, "Xfer:features:read:target.xml:", 30)) {
+                read_target_xml(stub, args + 30);
+            } else if (!strcmp(args, "Attached")) {
+                send_string(stub, "1");
+            } else if (!strcmp(args, "C")) {
+                send_string(stub, "QC1");
+            } else if (!strcmp(args, "fThreadInfo")) {
+                send_string(stub, "m1");
+            } else if (!strcmp(args, "sThreadInfo")) {
+                send_string(stub, "l");
+            } else {
+                send_string(stub, "");
+            }
+            return RESUME_NONE;
+        default:
+            send_string(stub, "");
+            return RESUME_NONE;
+    }
+}
+
+// Read whatever the client sent, waiting for it if block is set. Returns 0 if
+// the client went away.
+static int receive(gdb_stub_t *stub, int block)
+{
+    if (stub->inlen == sizeof(stub->in)) {
+        // Not a packet we can hold: drop it.
+        stub->inlen = 0;
+    }
+
+    for (;;) {
+        ssize_t n = read(stub->fd, stub->in + stub->inlen, sizeof(stub->in) - stub->inlen);
+        if (n > 0) {
+            stub->inlen += n;
+            return 1;
+        }
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return 0;
+        if (!block)
+            return 1;
+        struct pollfd pfd = { stub->fd, POLLIN, 0 };
+        poll(&pfd, 1, -1);
+    }
+}
+
+// Handle complete packets in the input buffer, up to the first one that
+// resumes the VM. A Ctrl-C byte stops it.
+static resume_t process_input(gdb_stub_t *stub, chip8_t *vm)
+{
+    resume_t resume = RESUME_NONE;
+    size_t pos = 0;
+
+    while (pos < stub->inlen && resume == RESUME_NONE && stub->fd >= 0) {
+        char *start = stub->in + pos;
+        if (*start == 0x03) {
+            if (!stub->stopped) {
+                stub->stopped = 1;
+                send_stop(stub, STOP_CYCLES, GDB_SIGINT);
+            }
+            pos++;
+            continue;
+        }
+        if (*start != '$') {
+            // Acks, we never retransmit.
+            pos++;
+            continue;
+        }
+
+        char *hash = memchr(start, '#', stub->inlen - pos);
+        if (!hash || hash + 3 > stub->in + stub->inlen)
+            break;
+        *hash = '\0';
+        pos = hash + 3 - stub->in;
+
+        write_all(stub->fd, "+", 1);
+        chip8_sync_flags(vm);
+        resume = handle_packet(stub, vm, start + 1);
+    }
+
+    if (stub->fd >= 0) {
+        memmove(stub->in, stub->in + pos, stub->inlen - pos);
+        stub->inlen -= pos;
+    }
+    return resume;
+}
+
+static void resume(gdb_stub_t *stub, chip8_t *vm, resume_t how)
+{
+    if (how == RESUME_KILL) {
+        stub->killed = 1;
+        disconnect(stub);
+    } else if (how == RESUME_CONTINUE) {
+        stub->stopped = 0;
+        stub->resuming = 1;
+    } else if (how == RESUME_STEP) {
+        send_stop(stub, debugger_run(vm, &stub->dbg, 1), GDB_SIGTRAP);
+    }
+}
+
+gdb_stub_t* create_gdb_stub(const char *spec)
+{
+    gdb_stub_t *stub = (gdb_stub_t*) calloc(1, sizeof(gdb_stub_t));
+    stub->listen_fd = -1;
+    stub->fd = -1;
+    debugger_init(&stub->dbg);
+    if (!spec)
+        return stub;
+
+    char *end;
+    const long port = strtol(spec, &end, 10);
+    if (*spec && !*end) {
+        struct sockaddr_in addr = { 0 };
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        const int one = 1;
+        stub->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(stub->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(stub->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Could not listen on port %ld\n", port);
+            exit(1);
+        }
+    } else {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec, sizeof(addr.sun_path) - 1);
+        unlink(spec);
+        stub->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bind(stub->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Could not listen on %s\n", spec);
+            exit(1);
+        }
+    }
+    listen(stub->listen_fd, 1);
+    set_nonblocking(stub->listen_fd);
+
+    return stub;
+}
+
+void delete_gdb_stub(gdb_stub_t *stub)
+{
+    if (stub->fd >= 0)
+        close(stub->fd);
+    if (stub->listen_fd >= 0)
+        close(stub->listen_fd);
+    free(stub);
+}
+
+void gdb_attach(gdb_stub_t *stub, int fd)
+{
+    if (stub->fd >= 0)
+        disconnect(stub);
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_nonblocking(fd);
+    stub->fd = fd;
+    stub->stopped = 1;
+}
+
+int gdb_run_frame(gdb_stub_t *stub, chip8_t *vm)
+{
+    if (stub->listen_fd >= 0 && stub->fd < 0) {
+        int fd = accept(stub->listen_fd, NULL, NULL);
+        if (fd >= 0)
+            gdb_attach(stub, fd);
+    }
+
+    if (stub->fd >= 0 && !stub->stopped) {
+        if (!receive(stub, 0)) {
+            disconnect(stub);
+        } else {
+            resume(stub, vm, process_input(stub, vm));
+        }
+    }
+    while (stub->fd >= 0 && stub->stopped) {
+        resume_t how = process_input(stub, vm);
+        if (how != RESUME_NONE) {
+            resume(stub, vm, how);
+        } else if (!receive(stub, 1)) {
+            disconnect(stub);
+        }
+    }
+    if (stub->killed)
+        return -1;
+
+    if (stub->fd < 0 || stub->points == 0)
+        return chip8_run_frame(vm);
+
+    // Breakpoints are only checked here, between frames, and by the
+    // debugger loop within the frame.
+    if (!stub->resuming && debugger_has_breakpoint(&stub->dbg, vm->PC)) {
+        stub->stopped = 1;
+        send_stop(stub, STOP_BREAKPOINT, GDB_SIGTRAP);
+        return 0;
+    }
+    stub->resuming = 0;
+
+    const debug_stop_t stop = debugger_run(vm, &stub->dbg, vm->cycles_per_tick - vm->tick_cycles);
+    if (stop != STOP_CYCLES) {
+        stub->stopped = 1;
+        send_stop(stub, stop, GDB_SIGTRAP);
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "chip8-vm.h"
+
+// GDB remote serial protocol stub. Registers are V0-VF, I, PC and SP, in
+// that order, described to the debugger through target.xml.
+typedef struct gdb_stub gdb_stub_t;
+
+// Listen on a TCP port of localhost if spec is a number, or on a unix
+// socket path otherwise. A NULL spec creates a stub without listener, for
+// gdb_attach. Exits on error.
+gdb_stub_t* create_gdb_stub(const char *spec);
+void delete_gdb_stub(gdb_stub_t *stub);
+// Serve an already connected socket. The VM stops until the client resumes it.
+void gdb_attach(gdb_stub_t *stub, int fd);
+// Drop-in replacement for chip8_run_frame. Client input is polled without
+// blocking once per frame, and while no breakpoint or watchpoint is set the
+// frame runs at full speed. Blocks serving the client while the VM is
+// stopped. Returns -1 if the client killed the program.
+int gdb_run_frame(gdb_stub_t *stub, chip8_t *vm);
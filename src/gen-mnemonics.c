@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+#include "parser.h"
+
+// Generates src/mnemonics.h: a seed for mnemonic_hash() and a table mapping
+// each hash slot to its instruction, so that every mnemonic lands in a
+// different slot.
+
+#define MNEMONIC_BITS 7
+#define MNEMONIC_SLOTS (1 << MNEMONIC_BITS)
+
+static int try_seed(uint32_t seed, uint8_t *slots)
+{
+    memset(slots, 0, MNEMONIC_SLOTS);
+    for (size_t i = 0; i < NUM_INSTRUCTIONS; i++) {
+        const char *name = instructions[i];
+        uint32_t slot = mnemonic_hash(name, strlen(name), seed) >> (32 - MNEMONIC_BITS);
+        if (slots[slot])
+            return 0;
+        slots[slot] = i + 1;
+    }
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    uint8_t slots[MNEMONIC_SLOTS];
+    uint32_t seed = 2166136261u;
+
+    while (!try_seed(seed, slots)) {
+        seed++;
+    }
+
+    printf("#pragma once\n\n");
+    printf("// Generated by gen-mnemonics, do not edit.\n\n");
+    printf("#define MNEMONIC_SEED 0x%08xu\n", seed);
+    printf("#define MNEMONIC_BITS %d\n\n", MNEMONIC_BITS);
+    printf("// Slot -> index in instructions[] plus one, 0 if empty.\n");
+    printf("static const uint8_t mnemonic_slots[%d] = {", MNEMONIC_SLOTS);
+    for (int i = 0; i < MNEMONIC_SLOTS; i++) {
+        printf("%s%2d,", i % 16 == 0 ? "\n    " : " ", slots[i]);
+    }
+    printf("\n};\n");
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "job.h"
+#include "ram-image.h"
+#include "backend.h"
+#include "util.h"
+
+static const char* output_names[] = { "frame", "state", "regs", "screen" };
+#define NUM_OUTPUTS (sizeof(output_names) / sizeof(output_names[0]))
+
+static const char* next_field(const char *str, char *field, size_t size)
+{
+    size_t len = 0;
+
+    while (*str == ' ')
+        str++;
+    while (*str && *str != ' ') {
+        if (len + 1 < size)
+            field[len++] = *str;
+        str++;
+    }
+    field[len] = '\0';
+    return str;
+}
+
+static int parse_outputs(const char *str, unsigned *outputs)
+{
+    *outputs = 0;
+    if (!strcmp(str, "-"))
+        return 0;
+    while (*str) {
+        const size_t len = strcspn(str, ",");
+        size_t i = 0;
+        for (; i < NUM_OUTPUTS; i++) {
+            if (strlen(output_names[i]) == len && !strncmp(str, output_names[i], len))
+                break;
+        }
+        if (i == NUM_OUTPUTS)
+            return -1;
+        *outputs |= 1 << i;
+        str += len + (str[len] == ',');
+    }
+    return 0;
+}
+
+static int parse_events(const char *str, emulation_job_t *job)
+{
+    size_t capacity = 0;
+
+    while (*str) {
+        char *end;
+        const unsigned long frame = strtoul(str, &end, 10);
+        if (end == str || *end != ':' || (job->numevents > 0 && frame < job->events[job->numevents - 1].frame))
+            return -1;
+        str = end + 1;
+
+        uint8_t key;
+        if (*str == '-') {
+            key = NO_KEY;
+        } else if (*str >= '0' && *str <= '9') {
+            key = *str - '0';
+        } else if ((*str | 0x20) >= 'a' && (*str | 0x20) <= 'f') {
+            key = (*str | 0x20) - 'a' + 10;
+        } else {
+            return -1;
+        }
+        str++;
+        if (*str && *str++ != ',')
+            return -1;
+
+        if (job->numevents == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            job->events = (job_event_t*) realloc(job->events, capacity * sizeof(job_event_t));
+        }
+        job->events[job->numevents].frame = frame;
+        job->events[job->numevents].key = key;
+        job->numevents++;
+    }
+    return 0;
+}
+
+int job_parse(const char *line, emulation_job_t *job, const char **error)
+{
+    char field[MAX_JOB_LINE];
+    char *end;
+
+    memset(job, 0, sizeof(emulation_job_t));
+    line = next_field(line, job->id, sizeof(job->id));
+    if (!job->id[0]) {
+        *error = "empty request";
+        return -1;
+    }
+
+    line = next_field(line, field, sizeof(field));
+    job->hash = strtoull(field, &end, 16);
+    if (!field[0] || *end) {
+        *error = "bad ROM hash";
+        return -1;
+    }
+    line = next_field(line, field, sizeof(field));
+    job->cycles = strtoull(field, &end, 10);
+    if (!field[0] || *end) {
+        *error = "bad cycle budget";
+        return -1;
+    }
+    line = next_field(line, field, sizeof(field));
+    if (!field[0] || parse_outputs(field, &job->outputs) < 0) {
+        *error = "bad outputs";
+        return -1;
+    }
+    line = next_field(line, field, sizeof(field));
+    if (parse_events(field, job) < 0) {
+        *error = "bad input";
+        return -1;
+    }
+    line = next_field(line, field, sizeof(field));
+    if (field[0]) {
+        *error = "trailing fields";
+        return -1;
+    }
+    return 0;
+}
+
+void job_free(emulation_job_t *job)
+{
+    free(job->events);
+    job->events = NULL;
+    job->numevents = 0;
+}
+
+// Hash of the state, field by field so padding doesn't leak in.
+static uint64_t state_hash(chip8_t *vm)
+{
+    static __thread uint8_t buf[RAM_MEMORY + sizeof(vm->planes) + 64];
+    uint8_t *p = buf;
+
+    chip8_sync_flags(vm);
+    memcpy(p, vm->ram, RAM_MEMORY);
+    p += RAM_MEMORY;
+    memcpy(p, vm->planes, sizeof(vm->planes));
+    p += sizeof(vm->planes);
+    memcpy(p, vm->V, NUM_REGISTERS);
+    p += NUM_REGISTERS;
+    // CALL stores past SP, so the live frames are stack[1..SP].
+    for (int i = 1; i <= vm->SP && i < NUM_STACK_FRAMES; i++) {
+        *p++ = vm->stack[i] >> 8;
+        *p++ = vm->stack[i];
+    }
+    *p++ = vm->I >> 8;
+    *p++ = vm->I;
+    *p++ = vm->PC >> 8;
+    *p++ = vm->PC;
+    *p++ = vm->SP;
+    *p++ = vm->delay_timer;
+    *p++ = vm->sound_timer;
+    *p++ = vm->hires;
+    *p++ = vm->plane_mask;
+    return hash_bytes(buf, p - buf);
+}
+
+// Run until the cycle budget is spent, a frame at a time while whole frames
+// fit, applying input events at frame boundaries.
+static void run(const emulation_job_t *job, chip8_t *vm)
+{
+    size_t next = 0;
+
+    while (vm->cycles < job->cycles) {
+        const uint64_t frame = vm->cycles / vm->cycles_per_tick;
+        for (; next < job->numevents && job->events[next].frame <= frame; next++)
+            vm->keycode = job->events[next].key;
+
+        if (vm->cycles + vm->cycles_per_tick - vm->tick_cycles <= job->cycles) {
+            chip8_run_frame(vm);
+        } else {
+            chip8_emulateCycle(vm);
+        }
+    }
+}
+
+size_t job_run(const emulation_job_t *job, chip8_t *vm, const uint8_t *rom, size_t size,
+               const rom_analysis_t *analysis, int image, char *out)
+{
+    if (image < 0 || chip8_reset_from_ram_image(vm, image) < 0) {
+        chip8_initialize_vm(vm);
+        if (chip8_load_rom(vm, rom, size) < 0)
+            return job_error(job->id, "ROM too large", out);
+    }
+    rom_apply(analysis, vm);
+    run(job, vm);
+    chip8_sync_flags(vm);
+
+    size_t len = sprintf(out, "%s ok cycles=%" PRIu64, job->id, vm->cycles);
+    chip8_frame_t frame;
+    if (job->outputs & (JOB_FRAME | JOB_SCREEN))
+        chip8_frame(vm, &frame);
+    if (job->outputs & JOB_FRAME) {
+        // Resolutions differ in pixel count, so the pixels alone tell them apart.
+        len += sprintf(out + len, " frame=%016" PRIx64, hash_bytes(frame.pixels, frame.width * frame.height));
+    }
+    if (job->outputs & JOB_STATE)
+        len += sprintf(out + len, " state=%016" PRIx64, state_hash(vm));
+    if (job->outputs & JOB_REGS) {
+        len += sprintf(out + len, " regs=");
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            len += sprintf(out + len, "%02x", vm->V[i]);
+        len += sprintf(out + len, ",%04x,%04x,%02x,%02x,%02x", vm->I, vm->PC, vm->SP,
+                       vm->delay_timer, vm->sound_timer);
+    }
+    if (job->outputs & JOB_SCREEN) {
+        len += sprintf(out + len, " screen=%dx%d:", frame.width, frame.height);
+        for (int i = 0; i < frame.width * frame.height; i++)
+            out[len++] = "0123456789abcdef"[frame.pixels[i] & 0xF];
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+size_t job_error(const char *id, const char *error, char *out)
+{
+    return sprintf(out, "%s error %s\n", id[0] ? id : "-", error);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8-vm.h"
+#include "analyser.h"
+
+// Emulation jobs served by chip8d, one request and one reply line each:
+//
+//   <id> <rom hash> <cycles> <outputs> [<input>]
+//   <id> ok cycles=<n> [frame=<hash>] [state=<hash>] [regs=<hex>] [screen=<w>x<h>:<hex>]
+//   <id> error <message>
+//
+// The id is any token chosen by the client, echoed so that replies to
+// pipelined jobs can be matched: they come back in completion order. Outputs
+// are a comma separated list of frame, state, regs and screen, or "-" for
+// none. Input is a comma separated list of <frame>:<key> events applied
+// before that frame (timer tick) runs, key being a hex digit or "-" to
+// release it, e.g. "0:5,30:-".
+#define MAX_JOB_ID 32
+#define MAX_JOB_LINE 65536
+#define MAX_JOB_REPLY (64 + HIRES_WIDTH * HIRES_HEIGHT + 256)
+
+#define JOB_FRAME  0x1      // Hash of the framebuffer.
+#define JOB_STATE  0x2      // Hash of memory, registers, stack, timers and planes.
+#define JOB_REGS   0x4      // V0-VF, I, PC, SP, DT and ST in hex.
+#define JOB_SCREEN 0x8      // Framebuffer, one hex digit of plane bits per pixel.
+
+typedef struct {
+    uint32_t frame;
+    uint8_t key;            // NO_KEY to release.
+} job_event_t;
+
+typedef struct {
+    char id[MAX_JOB_ID];
+    uint64_t hash;
+    uint64_t cycles;
+    unsigned outputs;
+    size_t numevents;
+    job_event_t *events;
+} emulation_job_t;
+
+// Parse a request line without its newline. Returns -1 with a reason in
+// error on a malformed line; the id is still filled in if there is one.
+int job_parse(const char *line, emulation_job_t *job, const char **error);
+void job_free(emulation_job_t *job);
+// Run the job on vm from a clean start with the ROM given, and write the
+// reply line, newline included, to out. Returns its length. image is a RAM
+// image of the ROM (see ram-image.h) to map instead of copying the ROM, or
+// -1; if mapping fails the ROM is copied.
+size_t job_run(const emulation_job_t *job, chip8_t *vm, const uint8_t *rom, size_t size,
+               const rom_analysis_t *analysis, int image, char *out);
+// Reply for a job that couldn't run.
+size_t job_error(const char *id, const char *error, char *out);
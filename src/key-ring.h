@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Single-producer single-consumer ring of key events, from the thread that
+// polls the host for them to the emulation thread. Same scheme as the sound
+// ring: each side only writes its own counter.
+#define KEY_RING_SIZE 64        // Power of two.
+
+typedef struct {
+    uint64_t time;              // Host CLOCK_MONOTONIC time in nanoseconds.
+    uint8_t key;                // 0-F.
+    uint8_t down;
+} key_event_t;
+
+typedef struct {
+    key_event_t events[KEY_RING_SIZE];
+    uint32_t head;
+    char padding[64];
+    uint32_t tail;
+} key_ring_t;
+
+// Producer side. Returns 0 when the ring is full and the event is dropped.
+static inline int key_ring_push(key_ring_t *ring, const key_event_t *event)
+{
+    const uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == KEY_RING_SIZE)
+        return 0;
+    ring->events[head % KEY_RING_SIZE] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Consumer side: take the oldest event. Returns 0 when empty.
+static inline int key_ring_pop(key_ring_t *ring, key_event_t *event)
+{
+    const uint32_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    *event = ring->events[tail % KEY_RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
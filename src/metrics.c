@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define MAX_SHARDS 256
+#define MAX_REQUEST_SIZE 4096
+// The MIPS gauge is measured over windows of this length.
+#define MIPS_WINDOW_MS 1000
+
+static const char* counter_names[NUM_COUNTERS][2] = {
+#define X(id, name, help) { name, help },
+    CHIP8_COUNTERS(X)
+#undef X
+};
+
+static const char* histogram_names[NUM_HISTOGRAMS][2] = {
+#define X(id, name, help) { name, help },
+    CHIP8_HISTOGRAMS(X)
+#undef X
+};
+
+// Written by its thread, read by scrapes. Threads past MAX_SHARDS share the
+// last one, which is why updates are atomic adds rather than plain stores;
+// on a line owned by one thread they cost next to nothing.
+struct metrics_shard {
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t sums[NUM_HISTOGRAMS];
+    uint64_t buckets[NUM_HISTOGRAMS][NUM_BUCKETS];
+} __attribute__((aligned(64)));
+
+static metrics_shard_t shards[MAX_SHARDS];
+static unsigned numshards;
+static __thread metrics_shard_t *own_shard;
+
+// MIPS gauge in thousandths, over the last full window. Only the server
+// thread measures it, so scrapes don't change what other scrapers see.
+static uint64_t mips_milli;
+static double window_start;
+static uint64_t window_instructions;
+
+struct metrics_server {
+    int listen_fd;
+    pthread_t thread;
+    char *path;                 // Unix socket to remove, or NULL.
+};
+
+metrics_shard_t* metrics_shard()
+{
+    if (!own_shard) {
+        const unsigned i = __atomic_fetch_add(&numshards, 1, __ATOMIC_RELAXED);
+        own_shard = &shards[i < MAX_SHARDS ? i : MAX_SHARDS - 1];
+    }
+    return own_shard;
+}
+
+void metrics_add(metrics_shard_t *shard, int counter, uint64_t n)
+{
+    __atomic_fetch_add(&shard->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+int metrics_bucket(uint64_t ns)
+{
+    if (ns < (1ULL << METRICS_MIN_SHIFT))
+        return 0;
+    const int shift = 63 - __builtin_clzll(ns);
+    if (shift > METRICS_MAX_SHIFT)
+        return NUM_BUCKETS - 1;
+    const int sub = (ns >> (shift - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    return 1 + ((shift - METRICS_MIN_SHIFT) << METRICS_SUB_BITS) + sub;
+}
+
+uint64_t metrics_bucket_bound(int bucket)
+{
+    if (bucket == 0)
+        return 1ULL << METRICS_MIN_SHIFT;
+    const int shift = METRICS_MIN_SHIFT + ((bucket - 1) >> METRICS_SUB_BITS);
+    const int sub = (bucket - 1) & ((1 << METRICS_SUB_BITS) - 1);
+    return (1ULL << shift) + ((uint64_t) (sub + 1) << (shift - METRICS_SUB_BITS));
+}
+
+void metrics_observe(metrics_shard_t *shard, int histogram, uint64_t ns)
+{
+    __atomic_fetch_add(&shard->buckets[histogram][metrics_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->sums[histogram], ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned used_shards()
+{
+    const unsigned count = __atomic_load_n(&numshards, __ATOMIC_RELAXED);
+    return count < MAX_SHARDS ? count : MAX_SHARDS;
+}
+
+// Observations in a bucket, over all shards.
+static uint64_t bucket_total(int histogram, int bucket)
+{
+    const unsigned used = used_shards();
+    uint64_t total = 0;
+
+    for (unsigned s = 0; s < used; s++)
+        total += load(&shards[s].buckets[histogram][bucket]);
+    return total;
+}
+
+uint64_t metrics_count(int histogram)
+{
+    uint64_t total = 0;
+
+    for (int b = 0; b < NUM_BUCKETS; b++)
+        total += bucket_total(histogram, b);
+    return total;
+}
+
+uint64_t metrics_quantile(int histogram, double q)
+{
+    const uint64_t count = metrics_count(histogram);
+    // Rank of the observation wanted, from 1.
+    const uint64_t rank = q * count < 1 ? 1 : (uint64_t) (q * count + 0.5);
+    uint64_t total = 0;
+
+    if (count == 0)
+        return 0;
+    for (int b = 0; b < NUM_BUCKETS - 1; b++) {
+        total += bucket_total(histogram, b);
+        if (total >= rank)
+            return metrics_bucket_bound(b);
+    }
+    // Past the last bound: the best known is that bound.
+    return metrics_bucket_bound(NUM_BUCKETS - 2);
+}
+
+static uint64_t counter_total(int counter)
+{
+    const unsigned used = used_shards();
+    uint64_t total = 0;
+
+    for (unsigned s = 0; s < used; s++)
+        total += load(&shards[s].counters[counter]);
+    return total;
+}
+
+// Server thread: close the MIPS window once it is long enough.
+static void update_mips()
+{
+    const double now = now_seconds();
+    if (now - window_start < MIPS_WINDOW_MS / 1e3)
+        return;
+    const uint64_t total = counter_total(METRIC_INSTRUCTIONS);
+    __atomic_store_n(&mips_milli, (uint64_t) ((total - window_instructions) / (now - window_start) / 1e3),
+                     __ATOMIC_RELAXED);
+    window_start = now;
+    window_instructions = total;
+}
+
+void metrics_write(FILE *fp)
+{
+    const unsigned used = used_shards();
+
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        const uint64_t total = counter_total(c);
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[c][0], counter_names[c][1],
+                counter_names[c][0], counter_names[c][0], (unsigned long long) total);
+
+        if (c == METRIC_INSTRUCTIONS) {
+            fprintf(fp, "# HELP chip8_mips Emulated instructions per second over the last %gs, in millions.\n"
+                        "# TYPE chip8_mips gauge\nchip8_mips %.3f\n", MIPS_WINDOW_MS / 1e3,
+                    __atomic_load_n(&mips_milli, __ATOMIC_RELAXED) / 1e3);
+        }
+    }
+
+    for (int h = 0; h < NUM_HISTOGRAMS; h++) {
+        const char *name = histogram_names[h][0];
+        uint64_t total = 0, sum = 0;
+
+        fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[h][1], name);
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            total += bucket_total(h, b);
+            if (b == NUM_BUCKETS - 1)
+                fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) total);
+            else
+                fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name, metrics_bucket_bound(b) / 1e9,
+                        (unsigned long long) total);
+        }
+        for (unsigned s = 0; s < used; s++)
+            sum += load(&shards[s].sums[h]);
+        fprintf(fp, "%s_sum %.9f\n%s_count %llu\n", name, sum / 1e9, name, (unsigned long long) total);
+    }
+}
+
+// Any request gets the metrics: the request line and headers are read, up to
+// the empty line, and ignored.
+static void serve(int fd)
+{
+    char request[MAX_REQUEST_SIZE];
+    size_t len = 0;
+    char *body;
+    size_t size;
+
+    const struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(request) - 1) {
+        const ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    FILE *fp = open_memstream(&body, &size);
+    metrics_write(fp);
+    fclose(fp);
+
+    char header[256];
+    const int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", size);
+    if (write(fd, header, header_len) == header_len && size > 0 && write(fd, body, size) < 0) {
+        // The scraper went away, nothing to do.
+    }
+    free(body);
+}
+
+static void* server_thread(void *arg)
+{
+    metrics_server_t *server = (metrics_server_t*) arg;
+
+    window_start = now_seconds();
+    window_instructions = counter_total(METRIC_INSTRUCTIONS);
+    for (;;) {
+        // Wakes up at least once a window, scraped or not.
+        struct pollfd pfd = { server->listen_fd, POLLIN, 0 };
+        const int ready = poll(&pfd, 1, MIPS_WINDOW_MS);
+        update_mips();
+        if (ready == 0)
+            continue;
+        const int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+            break;
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+metrics_server_t* create_metrics_server(const char *spec)
+{
+    metrics_server_t *server = (metrics_server_t*) calloc(1, sizeof(metrics_server_t));
+
+    char *end;
+    const long port = strtol(spec, &end, 10);
+    if (*spec && !*end) {
+        struct sockaddr_in addr = { 0 };
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        const int one = 1;
+        server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Could not listen on port %ld\n", port);
+            exit(1);
+        }
+    } else {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec, sizeof(addr.sun_path) - 1);
+        unlink(spec);
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Could not listen on %s\n", spec);
+            exit(1);
+        }
+        server->path = strdup(spec);
+    }
+    listen(server->listen_fd, 16);
+    if (pthread_create(&server->thread, NULL, server_thread, server) != 0) {
+        fprintf(stderr, "Couldn't start the metrics thread\n");
+        exit(1);
+    }
+    return server;
+}
+
+void delete_metrics_server(metrics_server_t *server)
+{
+    // Wakes up the accept() of the server thread.
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    if (server->path) {
+        unlink(server->path);
+        free(server->path);
+    }
+    free(server);
+}
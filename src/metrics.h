@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Process metrics in Prometheus text format. Each thread updates a shard of
+// its own, without locks, and a scrape adds up the shards of all threads.
+
+// Counters: id, name, help.
+#define CHIP8_COUNTERS(X) \
+    X(INSTRUCTIONS,   "chip8_instructions_total",   "Emulated instructions run, idle skips included.") \
+    X(FRAMES,         "chip8_frames_total",         "Emulated frames run.") \
+    X(DROPPED_FRAMES, "chip8_dropped_frames_total", "Frames replaced by a newer one before being presented.") \
+    X(JOBS,           "chip8_jobs_total",           "Jobs run by chip8d.")
+
+// Histograms of durations: id, name, help.
+#define CHIP8_HISTOGRAMS(X) \
+    X(FRAME_TIME,    "chip8_frame_time_seconds",    "Host time from one emulated frame to the next.") \
+    X(INPUT_LATENCY, "chip8_input_latency_seconds", "Time from a key read on the host to the start of the frame emulating it.") \
+    X(KEY_TO_PHOTON, "chip8_key_to_photon_seconds", "Time from a host key event to the present of the first frame drawn after the VM read the key.") \
+    X(JOB_DURATION,  "chip8_job_duration_seconds",  "Time to run a chip8d job.")
+
+enum {
+#define X(id, ...) METRIC_##id,
+    CHIP8_COUNTERS(X)
+#undef X
+    NUM_COUNTERS
+};
+
+enum {
+#define X(id, ...) METRIC_##id,
+    CHIP8_HISTOGRAMS(X)
+#undef X
+    NUM_HISTOGRAMS
+};
+
+// Histogram buckets are HDR style: each power of two of nanoseconds from
+// 2^METRICS_MIN_SHIFT to 2^METRICS_MAX_SHIFT is split in 2^METRICS_SUB_BITS,
+// so a value is known within 25% over the whole range. The first bucket holds
+// smaller values and the last one, +Inf in Prometheus, larger ones.
+#define METRICS_MIN_SHIFT 10
+#define METRICS_MAX_SHIFT 34
+#define METRICS_SUB_BITS 2
+#define NUM_BUCKETS (((METRICS_MAX_SHIFT - METRICS_MIN_SHIFT + 1) << METRICS_SUB_BITS) + 2)
+
+typedef struct metrics_shard metrics_shard_t;
+typedef struct metrics_server metrics_server_t;
+
+// Shard of the calling thread, created on first use.
+metrics_shard_t* metrics_shard();
+void metrics_add(metrics_shard_t *shard, int counter, uint64_t n);
+void metrics_observe(metrics_shard_t *shard, int histogram, uint64_t ns);
+// Bucket of a duration, and the upper bound of a bucket in nanoseconds.
+int metrics_bucket(uint64_t ns);
+uint64_t metrics_bucket_bound(int bucket);
+// Observations of a histogram so far, and the upper bound in nanoseconds of
+// the bucket holding quantile q, 0 to 1, of them. Both are 0 when empty.
+uint64_t metrics_count(int histogram);
+uint64_t metrics_quantile(int histogram, double q);
+// All metrics, plus an emulated MIPS gauge measured by the metrics server
+// over fixed windows (0 without a server), in Prometheus text format.
+void metrics_write(FILE *fp);
+
+// Serve metrics_write over HTTP on a TCP port of localhost if spec is a
+// number, or on a unix socket path otherwise, from a thread of its own.
+// Exits on error.
+metrics_server_t* create_metrics_server(const char *spec);
+void delete_metrics_server(metrics_server_t *server);
@@ -0,0 +1,18 @@
+#pragma once
+
+// Generated by gen-mnemonics, do not edit.
+
+#define MNEMONIC_SEED 0x8122e716u
+#define MNEMONIC_BITS 7
+
+// Slot -> index in instructions[] plus one, 0 if empty.
+static const uint8_t mnemonic_slots[128] = {
+    18,  0,  0,  0,  0,  0, 44,  0,  0,  0,  0,  0, 33,  4, 30,  0,
+     0,  0,  0,  0,  0, 29, 43,  0,  8,  0,  0, 21,  0,  0,  0,  0,
+     7, 39,  0,  0, 47,  0,  0, 13, 41, 10,  0,  0,  0,  0,  0,  3,
+    14,  0,  0,  0, 32,  0, 46,  0,  0,  0,  0, 45, 48, 37, 28,  0,
+     0,  0, 36,  0,  0, 50, 38,  0,  2,  0,  0,  0,  0,  0,  0, 34,
+     0,  0,  0, 40, 24, 20,  9,  0, 49, 23,  1, 42,  5,  0, 17, 11,
+     0,  0,  0, 31,  0,  0, 12, 19,  0, 15,  0,  6, 27, 16,  0,  0,
+     0,  0, 51,  0, 22,  0, 35,  0,  0, 25,  0,  0,  0,  0,  0, 26,
+};
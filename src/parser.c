@@ -6,6 +6,31 @@
 #include "parser.h"
 #include "chip8-vm.h"
 #include "util.h"
+#include "mnemonics.h"
+
+// Character classes used by the tokenizers.
+#define CC_SPACE    0x01
+#define CC_EOL      0x02
+#define CC_COMMENT  0x04
+#define CC_SEP      0x08
+#define CC_WORD     0x10
+
+static const uint8_t char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['\n'] = CC_EOL, [';'] = CC_COMMENT, [','] = CC_SEP,
+    ['#'] = CC_WORD, ['_'] = CC_WORD,
+    ['0' ... '9'] = CC_WORD, ['a' ... 'z'] = CC_WORD, ['A' ... 'Z'] = CC_WORD,
+};
+
+#define NOT_HEX 0xFF
+
+static const uint8_t hex_value[256] = {
+    [0 ... 255] = NOT_HEX,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
 
 const instr_t empty_instr = {
     keyword: "",
@@ -15,11 +40,11 @@ const instr_t empty_instr = {
     numops: 0
 };
 
-static void parsing_error(const char* errmsg, const char* line, int offset)
+static int parsing_error(const char* errmsg, const char* line, int offset)
 {
     fprintf(stderr, "%s: %s\n", errmsg, line);
     fprintf(stdout, "%*c\n", (int) strlen(errmsg) + 2 + offset, '^');
-    exit(1);
+    return -1;
 }
 
 int eol(char c)
@@ -27,34 +52,35 @@ int eol(char c)
     return c == '\0' || c == ';';
 }
 
-int next_token(char* dest, const char* src, int start, char* delim)
+int next_token(char* dest, size_t size, const char* src, int start, char* delim)
 {
     char* ptr = (char*) (src + start);
     int len;
+    uint8_t is_delim[256] = { 0 };
+
+    for (const char* d = delim; *d; d++) {
+        is_delim[(uint8_t) *d] = 1;
+    }
 
     // Skip whitespace.
     while (*ptr == ' ') ptr++;
     // Mark beginning of token here.
     char* begin = ptr;
     // Move forward while not finding delim character or end of string.
-    while (!eol(*ptr)) {
-        for (int i = 0; i < strlen(delim); i++) {
-            // printf("'%c' == '%c'\n", ptr[0], delim[i]);
-            if (ptr[0] == delim[i])
-                goto exit;
-        }
+    while (!eol(*ptr) && !is_delim[(uint8_t) *ptr]) {
         ptr++;
     }
-    // Copy token.
-    exit:
+    // Copy token, truncated to the size of dest.
     len = ptr - begin;
+    if (len > size - 1)
+        len = size - 1;
     strncpy(dest, begin, len);
     dest[len] = '\0';
     // Return distance between last position and beginning.
     return ptr - (src + start);
 }
 
-void assembler_parse_line(instr_t *instr, const char *line)
+int assembler_parse_line(instr_t *instr, const char *line)
 {
     *instr = empty_instr;
 
@@ -65,15 +91,15 @@ void assembler_parse_line(instr_t *instr, const char *line)
     char token[8];
     int pos = 0, start = 0;
 
-    pos += next_token(token, line, pos, " \t");
+    pos += next_token(token, sizeof(token), line, pos, " \t\r\n");
     // Maybe address?
     if (token[0] == '0' && token[1] == 'x') {
         start = pos;
-        pos += next_token(token, line, pos, " \t");
+        pos += next_token(token, sizeof(token), line, pos, " \t\r\n");
     }
     // Must be a keyword.
     if (strlen(token) > 5) {
-        parsing_error("Error: Unrecognized keyword", line, pos);
+        return parsing_error("Error: Unrecognized keyword", line, pos);
     }
     strcpy(instr->keyword, token);
 
@@ -93,8 +119,15 @@ void assembler_parse_line(instr_t *instr, const char *line)
     // Parse operands.
     int i = 0;
     while (1) {
-        pos += next_token(token, line, pos, " \t,");
+        const int begin = pos;
+        pos += next_token(token, sizeof(token), line, pos, " \t,\r\n");
+        if (strlen(token) >= sizeof(instr->op[0])) {
+            return parsing_error("Error: Operand too long", line, begin);
+        }
         if (strlen(token) > 0) {
+            if (i == 3) {
+                return parsing_error("Error: Too many operands", line, begin);
+            }
             strcpy(instr->op[i++], token);
         }
         if (eol(line[pos]))
@@ -111,6 +144,7 @@ void assembler_parse_line(instr_t *instr, const char *line)
         parsing_error("Error: Too many operands", line, start);
     }
     */
+    return 0;
 }
 
 uint16_t tohex(const char* str)
@@ -121,35 +155,37 @@ uint16_t tohex(const char* str)
     return strtoul(str, NULL, 16);
 }
 
-uint16_t assembler_compile_instruction(instr_t* instr)
+int assembler_lookup_mnemonic(const char *str, size_t len)
 {
-    uint16_t opcode;
+    uint32_t slot = mnemonic_hash(str, len, MNEMONIC_SEED) >> (32 - MNEMONIC_BITS);
+    int i = mnemonic_slots[slot] - 1;
 
-    // Find opcode.
-    int i = 0;
-    while (i < NUM_INSTRUCTIONS) {
-        if (!strcmp(instr->keyword, instructions[i])) {
-            opcode = opcodes[i];
-            break;
-        }
-        i++;
-    }
-    if (i == NUM_INSTRUCTIONS) {
-        fprintf(stderr, "Illegal instruction: '%s'", instr->keyword);
-        exit(1);
-    }
+    if (i < 0 || strncmp(instructions[i], str, len) != 0 || instructions[i][len] != '\0')
+        return -1;
+    return i;
+}
 
+// Place operands into the opcode template of an instruction.
+static uint16_t encode_instruction(uint16_t opcode, const uint16_t *ops)
+{
     switch (opcode) {
         case 0x00E0: // CLS.
         case 0x00EE: // RET.
+        case 0xF000: // LONGI, the address follows in the next word.
 
         break;
 
+        case 0x00C0: // SCD.
+        case 0x00D0: // SCU.
+            opcode |= ops[0] & 0x0F;
+        break;
+
+        case 0x0000: // SYS.
         case 0x1000: // JUMP.
         case 0x2000: // CALL.
         case 0xA000: // LOADI.
         case 0xB000: // JUMPI
-            opcode |= tohex(instr->op1);
+            opcode |= ops[0] & 0xFFF;
         break;
 
         case 0x3000: // SKE.
@@ -157,10 +193,12 @@ uint16_t assembler_compile_instruction(instr_t* instr)
         case 0x6000: // LOAD.
         case 0x7000: // ADD.
         case 0xC000: // RAND.
-            opcode |= tohex(instr->op1) << 8 | tohex(instr->op2);
+            opcode |= (ops[0] & 0x0F) << 8 | (ops[1] & 0xFF);
         break;
 
         case 0x5000: // SKRE.
+        case 0x5002: // PUSHR.
+        case 0x5003: // POPR.
         case 0x8000: // MOVE.
         case 0x8001: // OR.
         case 0x8002: // AND.
@@ -168,9 +206,10 @@ uint16_t assembler_compile_instruction(instr_t* instr)
         case 0x8004: // ADDR.
         case 0x8005: // SUB.
         case 0x8006: // SHR.
+        case 0x8007: // SUBB.
         case 0x800E: // SHL.
         case 0x9000: { // SKRNE.
-            opcode |= tohex(instr->op1) << 8 | tohex(instr->op2) << 4;
+            opcode |= (ops[0] & 0x0F) << 8 | (ops[1] & 0x0F) << 4;
         }
         break;
 
@@ -185,17 +224,282 @@ uint16_t assembler_compile_instruction(instr_t* instr)
         case 0xF033: // BCD.
         case 0xF055: // STOR.
         case 0xF065: // READ.
-            opcode |= tohex(instr->op1) & 0x0F << 8;
+        case 0xF001: // PLANE.
+        case 0xF030: // LDBIG.
+        case 0xF03A: // PITCH.
+        case 0xF075: // SRPL.
+        case 0xF085: // LRPL.
+            opcode |= (ops[0] & 0x0F) << 8;
         break;
 
         case 0xD000: {// DRAW.
-            opcode = 0xD000 | tohex(instr->op1) << 8 | tohex(instr->op2) << 4 | tohex(instr->op3);
+            opcode |= (ops[0] & 0x0F) << 8 | (ops[1] & 0x0F) << 4 | (ops[2] & 0x0F);
         }
         break;
     }
     return opcode;
 }
 
+int assembler_compile_instruction(instr_t* instr)
+{
+    int i = assembler_lookup_mnemonic(instr->keyword, strlen(instr->keyword));
+    if (i < 0) {
+        fprintf(stderr, "Illegal instruction: '%s'\n", instr->keyword);
+        return -1;
+    }
+
+    uint16_t ops[3];
+    for (int j = 0; j < 3; j++) {
+        ops[j] = tohex(instr->op[j]);
+    }
+    return encode_instruction(opcodes[i], ops);
+}
+
+static void assemble_error(const char* errmsg, const char* line, const char* end, const char* pos, size_t lineno)
+{
+    const char* eol = line;
+    while (eol < end && *eol != '\n') eol++;
+
+    int prefix = fprintf(stderr, "%zu: %s: ", lineno, errmsg);
+    fprintf(stderr, "%.*s\n", (int) (eol - line), line);
+    fprintf(stderr, "%*c\n", prefix + (int) (pos - line) + 1, '^');
+    exit(1);
+}
+
+// Parse a register (#X, vX) or hexadecimal number (0xNNN, NNN) operand.
+// Anything else is a label reference.
+static int parse_operand(const char* str, size_t len, uint16_t* value)
+{
+    if (len == 2 && (str[0] == '#' || str[0] == 'v' || str[0] == 'V')) {
+        str++, len--;
+    } else if (len > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        str += 2, len -= 2;
+    } else if (hex_value[(uint8_t) str[0]] > 9) {
+        return 0;
+    }
+    if (len == 0 || len > 4)
+        return 0;
+
+    uint16_t ret = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t digit = hex_value[(uint8_t) str[i]];
+        if (digit == NOT_HEX)
+            return 0;
+        ret = ret << 4 | digit;
+    }
+    *value = ret;
+    return 1;
+}
+
+static int is_label(const char* str, size_t len)
+{
+    return len > 0 && str[0] != '#' && hex_value[(uint8_t) str[0]] > 9;
+}
+
+// Mask of the address taken as first operand, which may be a label, or 0
+// when the instruction has no address operand.
+static uint16_t takes_address(uint16_t opcode)
+{
+    switch (opcode) {
+        case 0x0000: // SYS.
+        case 0x1000: // JUMP.
+        case 0x2000: // CALL.
+        case 0xA000: // LOADI.
+        case 0xB000: // JUMPI.
+            return 0x0FFF;
+        case 0xF000: // LONGI.
+            return 0xFFFF;
+    }
+    return 0;
+}
+
+// Symbol table: open addressing over names that point into the source buffer.
+
+typedef struct {
+    const char *name;
+    size_t len;
+    uint16_t value;
+    uint8_t defined;
+} symbol_t;
+
+typedef struct {
+    symbol_t *entries;
+    size_t cap, count;
+} symtab_t;
+
+// A label reference waiting for its definition.
+typedef struct {
+    size_t offset;
+    uint16_t mask;
+    const char *name, *line;
+    size_t len, lineno;
+} fixup_t;
+
+static symbol_t* symtab_lookup(symtab_t *symtab, const char *name, size_t len);
+
+static void symtab_grow(symtab_t *symtab)
+{
+    symtab_t old = *symtab;
+
+    symtab->cap = old.cap ? old.cap * 2 : 256;
+    symtab->count = 0;
+    symtab->entries = (symbol_t*) calloc(symtab->cap, sizeof(symbol_t));
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.entries[i].name) {
+            *symtab_lookup(symtab, old.entries[i].name, old.entries[i].len) = old.entries[i];
+        }
+    }
+    free(old.entries);
+}
+
+// Return the entry for name, inserting an undefined one if missing.
+static symbol_t* symtab_lookup(symtab_t *symtab, const char *name, size_t len)
+{
+    if ((symtab->count + 1) * 2 > symtab->cap)
+        symtab_grow(symtab);
+
+    size_t mask = symtab->cap - 1;
+    size_t i = mnemonic_hash(name, len, 2166136261u) & mask;
+    for (;; i = (i + 1) & mask) {
+        symbol_t *entry = &symtab->entries[i];
+        if (!entry->name) {
+            entry->name = name;
+            entry->len = len;
+            symtab->count++;
+            return entry;
+        }
+        if (entry->len == len && !memcmp(entry->name, name, len))
+            return entry;
+    }
+}
+
+size_t assembler_assemble(const char *src, size_t len, uint8_t *output)
+{
+    const char *ptr = src, *end = src + len;
+    uint8_t *dst = output;
+    size_t lineno = 1;
+
+    symtab_t symtab = { NULL, 0, 0 };
+    fixup_t *fixups = NULL;
+    size_t numfixups = 0, capfixups = 0;
+
+    for (; ptr < end; lineno++) {
+        const char *line = ptr;
+        const char *word;
+
+        // Skip leading whitespace.
+        while (ptr < end && (char_class[(uint8_t) *ptr] & CC_SPACE)) ptr++;
+        word = ptr;
+        while (ptr < end && (char_class[(uint8_t) *ptr] & CC_WORD)) ptr++;
+
+        // Label definition.
+        if (ptr < end && *ptr == ':' && ptr > word) {
+            if (!is_label(word, ptr - word)) {
+                assemble_error("Invalid label", line, end, word, lineno);
+            }
+            symbol_t *symbol = symtab_lookup(&symtab, word, ptr - word);
+            if (symbol->defined) {
+                assemble_error("Duplicated label", line, end, word, lineno);
+            }
+            symbol->value = PC_START + (dst - output);
+            symbol->defined = 1;
+            ptr++;
+            while (ptr < end && (char_class[(uint8_t) *ptr] & CC_SPACE)) ptr++;
+            word = ptr;
+            while (ptr < end && (char_class[(uint8_t) *ptr] & CC_WORD)) ptr++;
+        }
+
+        // Optional address in front of the mnemonic, as emitted by the disassembler.
+        if (ptr - word > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X')) {
+            while (ptr < end && (char_class[(uint8_t) *ptr] & CC_SPACE)) ptr++;
+            word = ptr;
+            while (ptr < end && (char_class[(uint8_t) *ptr] & CC_WORD)) ptr++;
+        }
+
+        if (ptr > word) {
+            int i = assembler_lookup_mnemonic(word, ptr - word);
+            if (i < 0) {
+                assemble_error("Unrecognized keyword", line, end, word, lineno);
+            }
+
+            // Operands, separated by commas and/or whitespace.
+            uint16_t ops[3] = { 0, 0, 0 };
+            uint8_t numops = 0;
+            while (1) {
+                while (ptr < end && (char_class[(uint8_t) *ptr] & (CC_SPACE | CC_SEP))) ptr++;
+                word = ptr;
+                while (ptr < end && (char_class[(uint8_t) *ptr] & CC_WORD)) ptr++;
+                if (ptr == word)
+                    break;
+                if (numops == 3) {
+                    assemble_error("Too many operands", line, end, word, lineno);
+                }
+                if (!parse_operand(word, ptr - word, &ops[numops])) {
+                    if (numops > 0 || !takes_address(opcodes[i]) || !is_label(word, ptr - word)) {
+                        assemble_error("Invalid operand", line, end, word, lineno);
+                    }
+                    symbol_t *symbol = symtab_lookup(&symtab, word, ptr - word);
+                    if (symbol->defined) {
+                        if (symbol->value & ~takes_address(opcodes[i])) {
+                            assemble_error("Label out of range", line, end, word, lineno);
+                        }
+                        ops[numops] = symbol->value;
+                    } else {
+                        // Forward reference, patched once all labels are known.
+                        if (numfixups == capfixups) {
+                            capfixups = capfixups ? capfixups * 2 : 64;
+                            fixups = (fixup_t*) realloc(fixups, capfixups * sizeof(fixup_t));
+                        }
+                        const uint16_t mask = takes_address(opcodes[i]);
+                        fixups[numfixups++] = (fixup_t) {
+                            dst - output + (mask == 0xFFFF ? 2 : 0), mask, word, line, ptr - word, lineno
+                        };
+                    }
+                }
+                numops++;
+            }
+            if (numops != num_operands_per_instruction[i]) {
+                assemble_error("Wrong number of operands", line, end, word, lineno);
+            }
+
+            uint16_t opcode = encode_instruction(opcodes[i], ops);
+            *dst++ = opcode >> 8;
+            *dst++ = opcode & 0xFF;
+            if (opcode == 0xF000) {
+                *dst++ = ops[0] >> 8;
+                *dst++ = ops[0] & 0xFF;
+            }
+        }
+
+        // Only a comment may follow.
+        if (ptr < end && !(char_class[(uint8_t) *ptr] & (CC_EOL | CC_COMMENT))) {
+            assemble_error("Unexpected character", line, end, ptr, lineno);
+        }
+        while (ptr < end && *ptr != '\n') ptr++;
+        ptr++;
+    }
+
+    // Patch forward references.
+    for (size_t i = 0; i < numfixups; i++) {
+        const fixup_t *fixup = &fixups[i];
+        symbol_t *symbol = symtab_lookup(&symtab, fixup->name, fixup->len);
+        if (!symbol->defined) {
+            assemble_error("Undefined label", fixup->line, end, fixup->name, fixup->lineno);
+        }
+        // 12-bit operands can't reach labels past 0xFFF, LONGI can.
+        if (symbol->value & ~fixup->mask) {
+            assemble_error("Label out of range", fixup->line, end, fixup->name, fixup->lineno);
+        }
+        output[fixup->offset] |= (symbol->value & fixup->mask) >> 8;
+        output[fixup->offset + 1] = symbol->value & 0xFF;
+    }
+
+    free(fixups);
+    free(symtab.entries);
+
+    return dst - output;
+}
+
 void dump_instr(const instr_t* instr)
 {
     fprintf(stderr, "{ keyword: '%s', op1: '%s', op2: '%s', op3: '%s', numops: %d }\n",
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define DEBUG 0
 
 typedef struct {
@@ -17,8 +20,32 @@ typedef struct {
 
 extern const instr_t empty_instr;
 
-void assembler_parse_line(instr_t *instr, const char *line);
+// Returns 0, or -1 after printing an error.
+int assembler_parse_line(instr_t *instr, const char *line);
 int eol(char c);
-int next_token(char* dest, const char* src, int start, char* delim);
-uint16_t assembler_compile_instruction(instr_t* instr);
+// Copy the next token to dest, truncated to size bytes including the NUL.
+int next_token(char* dest, size_t size, const char* src, int start, char* delim);
+// Returns the opcode, or -1 for an unknown mnemonic.
+int assembler_compile_instruction(instr_t* instr);
 void dump_instr(const instr_t* instr);
+
+// Index of the mnemonic in instructions[], or -1 if it does not exist.
+int assembler_lookup_mnemonic(const char *str, size_t len);
+
+// Assemble a whole source buffer in a single pass, writing big-endian opcodes
+// to output, which must hold at least len + 2 bytes. Address operands of
+// SYS, JUMP, CALL, LOADI, JUMPI and LONGI may be labels ("name:" at the start
+// of a line); forward references are patched at the end. LONGI takes four
+// bytes, its 16-bit address following the opcode. Returns the number of
+// bytes written. Exits on error.
+size_t assembler_assemble(const char *src, size_t len, uint8_t *output);
+
+// Hash used to build the mnemonic perfect hash table (see gen-mnemonics.c).
+static inline uint32_t mnemonic_hash(const char *str, size_t len, uint32_t seed)
+{
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) str[i]) * 16777619;
+    }
+    return h;
+}
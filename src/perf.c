@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[NUM_PERF_COUNTERS] = {
+    { "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                        PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+typedef struct {
+    uint64_t frames, vm_cycles;
+    uint64_t counts[NUM_PERF_COUNTERS];
+} perf_total_t;
+
+struct perf_counters {
+    int leader;
+    int fds[NUM_PERF_COUNTERS];     // -1 if not available.
+    int slots[NUM_PERF_COUNTERS];   // Position in a group read, -1 if not available.
+    int numopen;
+    uint64_t start[NUM_PERF_COUNTERS];
+    uint64_t start_cycles, start_idle;
+    perf_sample_t *ring;
+    size_t ring_size, numframes;
+    perf_total_t totals[NUM_PERF_ENGINES];
+};
+
+static int open_counter(int i, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+perf_counters_t* create_perf_counters(size_t ring_size)
+{
+    perf_counters_t *perf = (perf_counters_t*) calloc(1, sizeof(perf_counters_t));
+    int error = 0;
+
+    // One group, so that all counters are read with a single read().
+    perf->leader = -1;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        perf->fds[i] = open_counter(i, perf->leader);
+        perf->slots[i] = -1;
+        if (perf->fds[i] < 0) {
+            error = errno;
+            continue;
+        }
+        if (perf->leader < 0)
+            perf->leader = perf->fds[i];
+        perf->slots[i] = perf->numopen++;
+    }
+    if (perf->leader < 0) {
+        fprintf(stderr, "No performance counters: %s\n", strerror(error));
+        free(perf);
+        return NULL;
+    }
+
+    perf->ring_size = ring_size ? ring_size : 1;
+    perf->ring = (perf_sample_t*) calloc(perf->ring_size, sizeof(perf_sample_t));
+    return perf;
+}
+
+void delete_perf_counters(perf_counters_t *perf)
+{
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (perf->fds[i] >= 0)
+            close(perf->fds[i]);
+    }
+    free(perf->ring);
+    free(perf);
+}
+
+static void read_counters(const perf_counters_t *perf, uint64_t *counts)
+{
+    uint64_t values[1 + NUM_PERF_COUNTERS];
+
+    if (read(perf->leader, values, sizeof(values)) < (ssize_t) sizeof(uint64_t))
+        memset(values, 0, sizeof(values));
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        counts[i] = perf->slots[i] >= 0 ? values[1 + perf->slots[i]] : 0;
+}
+
+static int engine(const chip8_t *vm)
+{
+    return vm->quirks * 4 + (vm->lazy_flags ? 2 : 0) + (vm->skip_idle ? 1 : 0);
+}
+
+void perf_begin(perf_counters_t *perf, const chip8_t *vm)
+{
+    perf->start_cycles = vm->cycles;
+    perf->start_idle = vm->idle_cycles;
+    read_counters(perf, perf->start);
+}
+
+void perf_end(perf_counters_t *perf, const chip8_t *vm)
+{
+    uint64_t counts[NUM_PERF_COUNTERS];
+    read_counters(perf, counts);
+
+    perf_sample_t *sample = &perf->ring[perf->numframes % perf->ring_size];
+    sample->frame = perf->numframes++;
+    sample->vm_cycles = (vm->cycles - perf->start_cycles) - (vm->idle_cycles - perf->start_idle);
+    sample->engine = engine(vm);
+
+    perf_total_t *total = &perf->totals[sample->engine];
+    total->frames++;
+    total->vm_cycles += sample->vm_cycles;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        sample->counts[i] = counts[i] - perf->start[i];
+        total->counts[i] += sample->counts[i];
+    }
+}
+
+static void engine_name(int engine, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s%s%s", chip8_quirk_names[engine / 4], engine & 2 ? "+lazy" : "",
+             engine & 1 ? "+idle" : "");
+}
+
+void perf_write_csv(const perf_counters_t *perf, FILE *fp)
+{
+    const size_t count = perf->numframes < perf->ring_size ? perf->numframes : perf->ring_size;
+    char name[64];
+
+    fprintf(fp, "frame,engine,vm_cycles");
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        fprintf(fp, ",%s", counters[i].name);
+    fprintf(fp, "\n");
+
+    for (size_t n = perf->numframes - count; n < perf->numframes; n++) {
+        const perf_sample_t *sample = &perf->ring[n % perf->ring_size];
+        engine_name(sample->engine, name, sizeof(name));
+        fprintf(fp, "%llu,%s,%llu", (unsigned long long) sample->frame, name,
+                (unsigned long long) sample->vm_cycles);
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+            if (perf->slots[i] >= 0)
+                fprintf(fp, ",%llu", (unsigned long long) sample->counts[i]);
+            else
+                fprintf(fp, ",");
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+void perf_write_summary(const perf_counters_t *perf, FILE *fp)
+{
+    char name[64];
+
+    for (int e = 0; e < NUM_PERF_ENGINES; e++) {
+        const perf_total_t *total = &perf->totals[e];
+        if (total->frames == 0)
+            continue;
+        engine_name(e, name, sizeof(name));
+        fprintf(fp, "perf %s: %llu frames, %llu instructions emulated\n", name,
+                (unsigned long long) total->frames, (unsigned long long) total->vm_cycles);
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+            if (perf->slots[i] < 0) {
+                fprintf(fp, "  %-14s n/a\n", counters[i].name);
+                continue;
+            }
+            fprintf(fp, "  %-14s %llu, %.3f per instruction\n", counters[i].name,
+                    (unsigned long long) total->counts[i],
+                    total->vm_cycles ? (double) total->counts[i] / total->vm_cycles : 0);
+        }
+    }
+}
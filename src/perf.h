@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8-vm.h"
+
+// Host performance counters read with perf_event_open around each emulated
+// frame, for the calling thread in user space only. Counters the host can't
+// provide, e.g. hardware ones in most virtual machines, read as n/a.
+enum { PERF_TASK_CLOCK, PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_L1D_MISSES,
+       NUM_PERF_COUNTERS };
+
+// Engines are the specialised interpreters: profile, lazy flags and idle skip.
+#define NUM_PERF_ENGINES (NUM_QUIRK_PROFILES * 4)
+
+typedef struct {
+    uint64_t frame;
+    uint64_t vm_cycles;         // Instructions run in the frame, idle skips left out.
+    uint8_t engine;
+    uint64_t counts[NUM_PERF_COUNTERS];
+} perf_sample_t;
+
+typedef struct perf_counters perf_counters_t;
+
+// Keep the last ring_size frames. Returns NULL, with the reason on stderr, if
+// no counter at all can be opened.
+perf_counters_t* create_perf_counters(size_t ring_size);
+void delete_perf_counters(perf_counters_t *perf);
+// Around one frame of vm.
+void perf_begin(perf_counters_t *perf, const chip8_t *vm);
+void perf_end(perf_counters_t *perf, const chip8_t *vm);
+// Frames in the ring, oldest first, one line each.
+void perf_write_csv(const perf_counters_t *perf, FILE *fp);
+// Totals of all frames per engine, and per emulated instruction.
+void perf_write_summary(const perf_counters_t *perf, FILE *fp);
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "ram-image.h"
+
+int create_ram_image(const uint8_t *rom, size_t size)
+{
+    if (size > MAX_ROM_SIZE)
+        return -1;
+
+    const int fd = memfd_create("chip8-ram", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+
+    // Only the pages written are allocated, the rest read as zeros.
+    chip8_t *vm = (chip8_t*) aligned_alloc(RAM_PAGE_SIZE, sizeof(chip8_t));
+    chip8_initialize_vm(vm);
+    chip8_load_rom(vm, rom, size);
+    const size_t used = PC_START + size;
+    const int ok = ftruncate(fd, RAM_MEMORY) == 0 && pwrite(fd, vm->ram, used, 0) == (ssize_t) used &&
+                   fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+    free(vm);
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void delete_ram_image(int fd)
+{
+    close(fd);
+}
+
+int chip8_map_ram_image(chip8_t *vm, int fd)
+{
+    if (sysconf(_SC_PAGESIZE) > RAM_PAGE_SIZE)
+        return -1;
+    void *ram = mmap(vm->ram, RAM_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (ram == MAP_FAILED)
+        return -1;
+    vm->ram_dirty = ~0ULL;
+    return 0;
+}
+
+int chip8_reset_from_ram_image(chip8_t *vm, int fd)
+{
+    if (chip8_map_ram_image(vm, fd) < 0)
+        return -1;
+    chip8_reset_vm(vm);
+    return 0;
+}
+
+void chip8_unmap_ram_image(chip8_t *vm)
+{
+    uint8_t *copy = (uint8_t*) malloc(RAM_MEMORY);
+
+    memcpy(copy, vm->ram, RAM_MEMORY);
+    if (mmap(vm->ram, RAM_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        fprintf(stderr, "Couldn't remap VM memory\n");
+        exit(1);
+    }
+    memcpy(vm->ram, copy, RAM_MEMORY);
+    free(copy);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8-vm.h"
+
+// A RAM image is a sealed memfd holding the memory a VM starts with: the
+// fonts and a ROM at PC_START. VMs map it privately over their RAM, so its
+// pages are shared by every VM running the ROM, in this process or any other
+// the descriptor is handed to, and the kernel copies a page for a VM only the
+// first time that VM writes to it. Sharing is per page: the fonts share the
+// first page with the start of the ROM.
+
+// New image for a ROM. Returns its descriptor, or -1 if the ROM is too large
+// or memfds are not available.
+int create_ram_image(const uint8_t *rom, size_t size);
+void delete_ram_image(int fd);
+// Map an image over the RAM of an initialized VM. Returns -1, leaving RAM as
+// it was, if it can't be mapped, e.g. on hosts with pages larger than
+// RAM_PAGE_SIZE: the caller then loads the ROM the usual way.
+int chip8_map_ram_image(chip8_t *vm, int fd);
+// Start a VM afresh from an image, like chip8_initialize_vm and
+// chip8_load_rom but without touching RAM: mapping the image again drops the
+// pages the VM wrote and shares the image's in their place. Returns -1,
+// leaving the VM as it was, if the image can't be mapped.
+int chip8_reset_from_ram_image(chip8_t *vm, int fd);
+// Back the VM's RAM with private memory again, keeping its contents. Must be
+// called before a mapped VM goes away.
+void chip8_unmap_ram_image(chip8_t *vm);
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rompack.h"
+#include "util.h"
+
+#define HEADER_SIZE 16
+
+static void bad_pack(const char *filename, const char *reason)
+{
+    fprintf(stderr, "Bad ROM pack: %s, %s\n", filename, reason);
+    exit(1);
+}
+
+rom_pack_t* open_rom_pack(const char *filename)
+{
+    rom_pack_t *pack = (rom_pack_t*) calloc(1, sizeof(rom_pack_t));
+    pack->data = mapfile(filename, &pack->size);
+
+    if (pack->size < HEADER_SIZE || memcmp(pack->data, ROM_PACK_MAGIC, 8) != 0)
+        bad_pack(filename, "no header");
+    uint64_t count;
+    memcpy(&count, pack->data + 8, sizeof(count));
+    if (count > (pack->size - HEADER_SIZE) / sizeof(rom_pack_entry_t))
+        bad_pack(filename, "truncated index");
+    pack->count = count;
+    pack->index = (const rom_pack_entry_t*) (pack->data + HEADER_SIZE);
+
+    // Checked once here so lookups can trust the index.
+    for (size_t i = 0; i < pack->count; i++) {
+        const rom_pack_entry_t *entry = &pack->index[i];
+        if (entry->offset > pack->size || entry->size > pack->size - entry->offset)
+            bad_pack(filename, "entry out of bounds");
+        if (i > 0 && entry->hash <= pack->index[i - 1].hash)
+            bad_pack(filename, "index not sorted");
+    }
+    return pack;
+}
+
+void close_rom_pack(rom_pack_t *pack)
+{
+    unmapfile(pack->data, pack->size);
+    free(pack);
+}
+
+long rom_pack_index(const rom_pack_t *pack, uint64_t hash)
+{
+    size_t lo = 0, hi = pack->count;
+
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (pack->index[mid].hash == hash)
+            return mid;
+        if (pack->index[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+const uint8_t* rom_pack_find(const rom_pack_t *pack, uint64_t hash, size_t *size)
+{
+    const long i = rom_pack_index(pack, hash);
+
+    if (i < 0)
+        return NULL;
+    *size = pack->index[i].size;
+    return (const uint8_t*) pack->data + pack->index[i].offset;
+}
+
+typedef struct {
+    rom_pack_entry_t entry;
+    const char *data;
+} pack_item_t;
+
+static int compare_items(const void *a, const void *b)
+{
+    const uint64_t x = ((const pack_item_t*) a)->entry.hash;
+    const uint64_t y = ((const pack_item_t*) b)->entry.hash;
+    return x < y ? -1 : x > y;
+}
+
+size_t write_rom_pack(const char *filename, const char **roms, size_t count)
+{
+    pack_item_t *items = (pack_item_t*) calloc(count ? count : 1, sizeof(pack_item_t));
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size;
+        items[i].data = mapfile(roms[i], &size);
+        items[i].entry.hash = hash_bytes(items[i].data, size);
+        items[i].entry.size = size;
+    }
+    qsort(items, count, sizeof(pack_item_t), compare_items);
+
+    // Same hash, same content: keep the first copy only.
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && items[unique - 1].entry.hash == items[i].entry.hash) {
+            unmapfile(items[i].data, items[i].entry.size);
+            continue;
+        }
+        items[unique++] = items[i];
+    }
+
+    uint64_t offset = HEADER_SIZE + unique * sizeof(rom_pack_entry_t);
+    for (size_t i = 0; i < unique; i++) {
+        items[i].entry.offset = offset;
+        offset += items[i].entry.size;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't create file: %s\n", filename);
+        exit(1);
+    }
+    const uint64_t n = unique;
+    fwrite(ROM_PACK_MAGIC, 1, 8, fp);
+    fwrite(&n, sizeof(n), 1, fp);
+    for (size_t i = 0; i < unique; i++)
+        fwrite(&items[i].entry, sizeof(rom_pack_entry_t), 1, fp);
+    for (size_t i = 0; i < unique; i++) {
+        fwrite(items[i].data, 1, items[i].entry.size, fp);
+        unmapfile(items[i].data, items[i].entry.size);
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Couldn't write file: %s\n", filename);
+        exit(1);
+    }
+    free(items);
+    return unique;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A pack file holds many ROMs keyed by content hash (see hash_bytes()), each
+// stored once. It is mapped whole, so finding a ROM is a binary search of
+// the index and loading it a single copy out of the mapping.
+//
+// Layout, in host byte order:
+//   header  "CH8PACK1", uint64 count
+//   index   count entries { uint64 hash; uint64 offset; uint64 size }, sorted by hash
+//   data    ROM bytes, at the offsets given from the start of the file
+#define ROM_PACK_MAGIC "CH8PACK1"
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t size;
+} rom_pack_entry_t;
+
+typedef struct {
+    const char *data;           // Whole file, mapped.
+    size_t size;
+    const rom_pack_entry_t *index;
+    size_t count;
+} rom_pack_t;
+
+// Map a pack file and check that its index stays inside it. Exits on error.
+rom_pack_t* open_rom_pack(const char *filename);
+void close_rom_pack(rom_pack_t *pack);
+// Position in the index of the ROM with this hash, or -1.
+long rom_pack_index(const rom_pack_t *pack, uint64_t hash);
+// Bytes of the ROM with this hash and their number in size, or NULL.
+const uint8_t* rom_pack_find(const rom_pack_t *pack, uint64_t hash, size_t *size);
+// Write the ROM files given to a new pack, dropping duplicates. Returns the
+// number of distinct ROMs. Exits on error.
+size_t write_rom_pack(const char *filename, const char **roms, size_t count);
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+typedef struct {
+    chip8_t *vm;
+    uint8_t state;
+} task_t;
+
+// Tasks are kept in one array, scanned in order each round: a round is
+// cheap next to running a slice, and most frames take a single round.
+struct scheduler {
+    uint32_t slice;
+    task_t *tasks;
+    size_t numtasks, capacity;
+};
+
+scheduler_t* create_scheduler(uint32_t slice)
+{
+    scheduler_t *sched = (scheduler_t*) calloc(1, sizeof(scheduler_t));
+    sched->slice = slice;
+    return sched;
+}
+
+void delete_scheduler(scheduler_t *sched)
+{
+    free(sched->tasks);
+    free(sched);
+}
+
+size_t scheduler_add(scheduler_t *sched, chip8_t *vm)
+{
+    size_t task = 0;
+
+    while (task < sched->numtasks && sched->tasks[task].state != TASK_FREE)
+        task++;
+    if (task == sched->numtasks) {
+        if (sched->numtasks == sched->capacity) {
+            sched->capacity = sched->capacity ? sched->capacity * 2 : 64;
+            sched->tasks = (task_t*) realloc(sched->tasks, sched->capacity * sizeof(task_t));
+        }
+        sched->numtasks++;
+    }
+    sched->tasks[task].vm = vm;
+    sched->tasks[task].state = vm->key_wait && vm->keycode > 0xF ? TASK_KEY_WAIT : TASK_READY;
+    return task;
+}
+
+void scheduler_remove(scheduler_t *sched, size_t task)
+{
+    sched->tasks[task].vm = NULL;
+    sched->tasks[task].state = TASK_FREE;
+    while (sched->numtasks > 0 && sched->tasks[sched->numtasks - 1].state == TASK_FREE)
+        sched->numtasks--;
+}
+
+task_state_t scheduler_state(const scheduler_t *sched, size_t task)
+{
+    return (task_state_t) sched->tasks[task].state;
+}
+
+void scheduler_key(scheduler_t *sched, size_t task, uint8_t key)
+{
+    task_t *t = &sched->tasks[task];
+
+    t->vm->keycode = key;
+    if (t->state == TASK_KEY_WAIT && key <= 0xF)
+        t->state = TASK_READY;
+}
+
+size_t scheduler_run_frame(scheduler_t *sched)
+{
+    size_t slices = 0;
+    int ready = 0;
+
+    // Parked tasks sit at a frame boundary, see below.
+    for (size_t i = 0; i < sched->numtasks; i++) {
+        task_t *t = &sched->tasks[i];
+        if (t->state == TASK_FRAME_DONE)
+            t->state = TASK_READY;
+        else if (t->state == TASK_KEY_WAIT)
+            chip8_wait_frame(t->vm);
+        ready |= t->state == TASK_READY;
+    }
+
+    while (ready) {
+        ready = 0;
+        for (size_t i = 0; i < sched->numtasks; i++) {
+            task_t *t = &sched->tasks[i];
+            if (t->state != TASK_READY)
+                continue;
+            switch (chip8_run(t->vm, sched->slice)) {
+                case YIELD_FRAME:
+                    t->state = TASK_FRAME_DONE;
+                    break;
+                case YIELD_KEY:
+                    // Finish the frame unless the wait's own cycle did.
+                    if (t->vm->tick_cycles != 0)
+                        chip8_wait_frame(t->vm);
+                    t->state = TASK_KEY_WAIT;
+                    break;
+                case YIELD_SLICE:
+                    ready = 1;
+                    break;
+            }
+            slices++;
+        }
+    }
+    return slices;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8-vm.h"
+
+// Cooperative scheduler running many VMs on the calling thread, each as a
+// task resumed through chip8_run. A task runs a slice at a time in turn with
+// the others until it completes its frame, and then waits for the next one.
+// A task blocked on FX0A is parked until a key is given to it. It takes no
+// slices meanwhile, but its emulated time still advances a frame per frame,
+// in constant time, so its timers keep ticking as they would on hardware.
+typedef enum {
+    TASK_READY,
+    TASK_FRAME_DONE,        // Waiting for the next frame.
+    TASK_KEY_WAIT,          // Waiting for a key.
+    TASK_FREE,              // Slot of a removed task.
+} task_state_t;
+
+typedef struct scheduler scheduler_t;
+
+// Tasks run at most slice cycles before the next one gets its turn.
+scheduler_t* create_scheduler(uint32_t slice);
+void delete_scheduler(scheduler_t *sched);
+// Add a VM, which the caller still owns, ready to run. Returns its task
+// number, which stays the same until the task is removed.
+size_t scheduler_add(scheduler_t *sched, chip8_t *vm);
+void scheduler_remove(scheduler_t *sched, size_t task);
+task_state_t scheduler_state(const scheduler_t *sched, size_t task);
+// Set the key held on a task's VM, NO_KEY to release it. A key wakes the task
+// up if it waits for one.
+void scheduler_key(scheduler_t *sched, size_t task, uint8_t key);
+// Start a frame and run tasks until each one has completed it or waits for a
+// key. Called at 60Hz by an interactive host. Returns the number of slices run.
+size_t scheduler_run_frame(scheduler_t *sched);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+// Single-producer single-consumer ring of beeper edges, from the emulation
+// thread to the audio callback. The producer only writes head and the
+// consumer only writes tail, so neither side takes a lock.
+#define SOUND_RING_SIZE 256     // Power of two.
+
+typedef struct {
+    uint64_t time;              // Emulated time in microseconds.
+    uint8_t on;
+} sound_edge_t;
+
+typedef struct {
+    sound_edge_t edges[SOUND_RING_SIZE];
+    // Free-running counters, kept on separate cache lines.
+    uint32_t head;
+    char padding[64];
+    uint32_t tail;
+} sound_ring_t;
+
+// Producer side. Returns 0 when the ring is full: the edge is dropped rather
+// than waiting for the consumer.
+static inline int sound_ring_push(sound_ring_t *ring, uint64_t time, uint8_t on)
+{
+    const uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == SOUND_RING_SIZE)
+        return 0;
+    ring->edges[head % SOUND_RING_SIZE].time = time;
+    ring->edges[head % SOUND_RING_SIZE].on = on;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Consumer side: oldest edge without removing it. Returns 0 when empty.
+static inline int sound_ring_peek(sound_ring_t *ring, sound_edge_t *edge)
+{
+    const uint32_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    *edge = ring->edges[tail % SOUND_RING_SIZE];
+    return 1;
+}
+
+static inline void sound_ring_pop(sound_ring_t *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
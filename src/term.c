@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "term.h"
+
+#define CELL_INVALID 0xFFFF
+
+// Half-block glyphs indexed by (bottom << 1 | top).
+static const char* halfblocks[] = { " ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88" };
+
+// Bit assigned to each pixel of a 2x4 braille cell, indexed by [row][col].
+static const uint8_t braille_dots[4][2] = {
+    { 0x01, 0x08 },
+    { 0x02, 0x10 },
+    { 0x04, 0x20 },
+    { 0x40, 0x80 },
+};
+
+static void out_reserve(term_display_t *display, size_t len)
+{
+    if (display->outlen + len <= display->outcap)
+        return;
+    while (display->outlen + len > display->outcap)
+        display->outcap *= 2;
+    display->out = (char*) realloc(display->out, display->outcap);
+    if (!display->out) {
+        fprintf(stderr, "Could not allocate terminal buffer\n");
+        exit(1);
+    }
+}
+
+static void out_append(term_display_t *display, const char *str, size_t len)
+{
+    out_reserve(display, len);
+    memcpy(display->out + display->outlen, str, len);
+    display->outlen += len;
+}
+
+static void out_number(term_display_t *display, unsigned value)
+{
+    char digits[10];
+    size_t n = 0;
+
+    do {
+        digits[sizeof(digits) - ++n] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    out_append(display, digits + sizeof(digits) - n, n);
+}
+
+// Move cursor to cell (col, row). Terminal coordinates are 1-based.
+static void out_goto(term_display_t *display, size_t col, size_t row)
+{
+    out_append(display, "\x1b[", 2);
+    out_number(display, row + 1);
+    out_append(display, ";", 1);
+    out_number(display, col + 1);
+    out_append(display, "H", 1);
+}
+
+static void out_flush(term_display_t *display)
+{
+    const char *ptr = display->out;
+    size_t left = display->outlen;
+
+    while (left > 0) {
+        ssize_t n = write(display->fd, ptr, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        ptr += n;
+        left -= n;
+    }
+    display->outlen = 0;
+}
+
+static inline uint8_t pixel(const term_display_t *display, const uint8_t *vram, size_t x, size_t y)
+{
+    if (x >= display->width || y >= display->height)
+        return 0;
+    return vram[y * display->width + x] ? 1 : 0;
+}
+
+static uint16_t cell_value(const term_display_t *display, const uint8_t *vram, size_t col, size_t row)
+{
+    if (display->glyphs == TERM_HALFBLOCK) {
+        return pixel(display, vram, col, row * 2) |
+               pixel(display, vram, col, row * 2 + 1) << 1;
+    }
+
+    uint16_t value = 0;
+    for (size_t y = 0; y < 4; y++) {
+        for (size_t x = 0; x < 2; x++) {
+            if (pixel(display, vram, col * 2 + x, row * 4 + y))
+                value |= braille_dots[y][x];
+        }
+    }
+    return value;
+}
+
+static void out_cell(term_display_t *display, uint16_t value)
+{
+    if (display->glyphs == TERM_HALFBLOCK) {
+        out_append(display, halfblocks[value], value ? 3 : 1);
+        return;
+    }
+
+    // U+2800 + value, encoded as UTF-8.
+    char glyph[3] = { 0xE2, 0xA0 | (value >> 6), 0x80 | (value & 0x3F) };
+    out_append(display, glyph, sizeof(glyph));
+}
+
+term_display_t* create_term_display(int fd, size_t width, size_t height, term_glyphs_t glyphs)
+{
+    term_display_t *display = (term_display_t*) malloc(sizeof(term_display_t));
+    if (!display) {
+        fprintf(stderr, "Could not create terminal display\n");
+        exit(1);
+    }
+
+    display->fd = fd;
+    display->glyphs = glyphs;
+    display->width = width;
+    display->height = height;
+    if (glyphs == TERM_HALFBLOCK) {
+        display->cols = width;
+        display->rows = (height + 1) / 2;
+    } else {
+        display->cols = (width + 1) / 2;
+        display->rows = (height + 3) / 4;
+    }
+
+    // Force every cell to be emitted on the first refresh.
+    display->screen = (uint16_t*) malloc(display->cols * display->rows * sizeof(uint16_t));
+    for (size_t i = 0; i < display->cols * display->rows; i++)
+        display->screen[i] = CELL_INVALID;
+
+    display->outcap = 4096;
+    display->outlen = 0;
+    display->out = (char*) malloc(display->outcap);
+
+    // Clear screen and hide cursor.
+    out_append(display, "\x1b[2J\x1b[?25l", 10);
+    out_flush(display);
+
+    return display;
+}
+
+void delete_term_display(term_display_t *display)
+{
+    // Place cursor below the screen and show it again.
+    out_goto(display, 0, display->rows);
+    out_append(display, "\x1b[?25h", 6);
+    out_flush(display);
+
+    free(display->screen);
+    free(display->out);
+    free(display);
+}
+
+void term_refresh(term_display_t *display, const uint8_t *vram)
+{
+    for (size_t row = 0; row < display->rows; row++) {
+        // Column right after the last emitted cell, where the cursor is now.
+        size_t cursor = SIZE_MAX;
+        for (size_t col = 0; col < display->cols; col++) {
+            uint16_t value = cell_value(display, vram, col, row);
+            uint16_t *prev = &display->screen[row * display->cols + col];
+            if (*prev == value)
+                continue;
+            if (cursor != col)
+                out_goto(display, col, row);
+            out_cell(display, value);
+            *prev = value;
+            cursor = col + 1;
+        }
+    }
+    if (display->outlen > 0)
+        out_flush(display);
+}
+
+// Backend wrapper around the terminal display.
+
+typedef struct {
+    chip8_backend_t base;
+    term_display_t *display;
+} term_backend_t;
+
+static void term_present(chip8_backend_t *backend, const chip8_frame_t *frame)
+{
+    term_backend_t *term = (term_backend_t*) backend;
+
+    // The resolution changed: start over with a cleared screen.
+    if (frame->width != term->display->width || frame->height != term->display->height) {
+        const term_glyphs_t glyphs = term->display->glyphs;
+        delete_term_display(term->display);
+        term->display = create_term_display(STDOUT_FILENO, frame->width, frame->height, glyphs);
+    }
+    term_refresh(term->display, frame->pixels);
+}
+
+static void term_destroy(chip8_backend_t *backend)
+{
+    delete_term_display(((term_backend_t*) backend)->display);
+    free(backend);
+}
+
+static chip8_backend_t* create_term_backend(const char *name, size_t width, size_t height, term_glyphs_t glyphs)
+{
+    term_backend_t *ret = (term_backend_t*) calloc(1, sizeof(term_backend_t));
+    ret->base.name = name;
+    ret->base.present = term_present;
+    ret->base.poll = NULL;
+    ret->base.destroy = term_destroy;
+    ret->display = create_term_display(STDOUT_FILENO, width, height, glyphs);
+    return &ret->base;
+}
+
+chip8_backend_t* term_backend_create(size_t width, size_t height, const char *arg)
+{
+    return create_term_backend("term", width, height, TERM_HALFBLOCK);
+}
+
+chip8_backend_t* braille_backend_create(size_t width, size_t height, const char *arg)
+{
+    return create_term_backend("braille", width, height, TERM_BRAILLE);
+}
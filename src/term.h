@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Glyph sets used to map framebuffer pixels to terminal cells.
+//  - halfblock: one cell covers 1x2 pixels (U+2580 family).
+//  - braille: one cell covers 2x4 pixels (U+2800 family).
+typedef enum { TERM_HALFBLOCK, TERM_BRAILLE } term_glyphs_t;
+
+typedef struct term_display_t {
+    int fd;
+    term_glyphs_t glyphs;
+    size_t width, height;       // Framebuffer size in pixels.
+    size_t cols, rows;          // Screen size in terminal cells.
+    uint16_t *screen;           // Last emitted cell values.
+    char *out;                  // Escape sequences for the current frame.
+    size_t outlen, outcap;
+} term_display_t;
+
+term_display_t* create_term_display(int fd, size_t width, size_t height, term_glyphs_t glyphs);
+void delete_term_display(term_display_t *display);
+void term_refresh(term_display_t *display, const uint8_t *vram);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8-vm.h"
+#include "backend.h"
+
+// Triple buffer of frames, from the emulation thread to the render thread.
+// The producer fills its back buffer and swaps it with the middle one, the
+// consumer swaps the middle one with its front buffer when it holds a newer
+// frame. Both swaps are a single atomic exchange, so neither side ever waits
+// for the other: frames the renderer is too slow for are dropped, and it
+// presents the newest one.
+//
+// Each frame carries a tag, e.g. the time of the key it responds to, or 0.
+// A tagged frame about to be dropped passes its tag on to an untagged one
+// replacing it, so what it stood for still reaches the screen. A tagged one
+// keeps its own: the newer key is the one followed. Only the producer writes
+// tags.
+#define TRIPLE_FRESH 0x4        // Middle buffer holds a frame not yet taken.
+
+typedef struct {
+    uint8_t pixels[3][HIRES_WIDTH * HIRES_HEIGHT];
+    uint16_t width[3], height[3];
+    uint64_t tag[3];
+    // Index of the middle buffer, plus TRIPLE_FRESH.
+    uint32_t middle;
+    char padding[64];
+    // Owned by the producer and the consumer respectively.
+    uint32_t back;
+    char padding2[64];
+    uint32_t front;
+} triple_buffer_t;
+
+static inline void triple_buffer_init(triple_buffer_t *tb)
+{
+    tb->back = 0;
+    tb->middle = 1;
+    tb->front = 2;
+    tb->tag[0] = tb->tag[1] = tb->tag[2] = 0;
+}
+
+// Producer side: copy a frame into the back buffer and make it the newest.
+// Returns 1 if that dropped the previous one, which was never taken. The
+// consumer can take that one while its tag is passed on, so it may see the
+// same tag twice.
+static inline int triple_buffer_publish(triple_buffer_t *tb, const chip8_frame_t *frame, uint64_t tag)
+{
+    const uint32_t back = tb->back;
+
+    memcpy(tb->pixels[back], frame->pixels, (size_t) frame->width * frame->height);
+    tb->width[back] = frame->width;
+    tb->height[back] = frame->height;
+    const uint32_t pending = __atomic_load_n(&tb->middle, __ATOMIC_RELAXED);
+    if (!tag && (pending & TRIPLE_FRESH))
+        tag = tb->tag[pending & ~TRIPLE_FRESH];
+    tb->tag[back] = tag;
+    const uint32_t middle = __atomic_exchange_n(&tb->middle, back | TRIPLE_FRESH, __ATOMIC_ACQ_REL);
+    tb->back = middle & ~TRIPLE_FRESH;
+    return (middle & TRIPLE_FRESH) != 0;
+}
+
+// Consumer side: point frame at the newest frame if one was published since
+// the last call, set its tag, and return 1. Returns 0, leaving frame and tag
+// alone, otherwise.
+static inline int triple_buffer_acquire(triple_buffer_t *tb, chip8_frame_t *frame, uint64_t *tag)
+{
+    if (!(__atomic_load_n(&tb->middle, __ATOMIC_RELAXED) & TRIPLE_FRESH))
+        return 0;
+    const uint32_t front = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL) & ~TRIPLE_FRESH;
+    tb->front = front;
+    frame->width = tb->width[front];
+    frame->height = tb->height[front];
+    frame->pixels = tb->pixels[front];
+    *tag = tb->tag[front];
+    return 1;
+}
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BUFFER_STRIDE 4096
 
@@ -52,21 +58,74 @@ unsigned char* readtext(const char* filename)
     return ret;
 }
 
-size_t readbin(uint8_t *buffer, const char* filename)
+const char* mapfile(const char* filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open file: %s\n", filename);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Couldn't stat file: %s\n", filename);
+        exit(1);
+    }
+
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+
+    void* ret = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ret == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map file: %s\n", filename);
+        exit(1);
+    }
+    madvise(ret, *size, MADV_SEQUENTIAL);
+
+    return (const char*) ret;
+}
+
+void unmapfile(const char* ptr, size_t size)
+{
+    if (size > 0)
+        munmap((void*) ptr, size);
+}
+
+size_t readbin(uint8_t *buffer, size_t capacity, const char* filename)
 {
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
-        printf("Couldn't open file\n");
+        fprintf(stderr, "Couldn't open file: %s\n", filename);
         return 0;
     }
 
     long size = filesize(fp);
-    fread(buffer, sizeof(uint8_t), size, fp);
+    if (size < 0 || (size_t) size > capacity) {
+        fprintf(stderr, "File too large: %s, %ld bytes, at most %zu\n", filename, size, capacity);
+        fclose(fp);
+        return 0;
+    }
+    size = fread(buffer, sizeof(uint8_t), size, fp);
     fclose(fp);
 
     return size;
 }
 
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t*) data;
+    uint64_t h = 14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
 char* strtrim(char* str)
 {
     size_t start, end;
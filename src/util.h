@@ -1,9 +1,16 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 uint16_t bswap(uint16_t value);
 char* first_word(char* str);
-size_t readbin(uint8_t *buffer, const char* filename);
+const char* mapfile(const char* filename, size_t *size);
+void unmapfile(const char* ptr, size_t size);
+// Read a whole file into buffer. Returns 0 if it can't be read or is larger
+// than capacity.
+size_t readbin(uint8_t *buffer, size_t capacity, const char* filename);
 unsigned char* readtext(const char* filename);
 char* strtrim(char* str);
+// 64-bit FNV-1a of a buffer, used to key ROMs by content.
+uint64_t hash_bytes(const void *data, size_t len);